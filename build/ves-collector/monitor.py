@@ -20,7 +20,12 @@
 # Status: this is a work in progress, under test.
 
 from rest_dispatcher import PathDispatcher, set_404_content
-from wsgiref.simple_server import make_server
+from wsgiref.simple_server import make_server, WSGIServer
+import SocketServer
+import Queue
+import socket
+import multiprocessing
+from multiprocessing.managers import BaseManager
 import sys
 import os
 import platform
@@ -35,6 +40,19 @@ import json
 import jsonschema
 from functools import partial
 import requests
+import threading
+import zlib
+import struct
+import hashlib
+import math
+import re
+import collections
+import urlparse
+try:
+    from kafka import KafkaProducer, KafkaConsumer
+    from kafka.errors import KafkaError
+except ImportError:
+    KafkaProducer = None
 
 monitor_mode = "f"
 vdu_id = ['','','','','','']
@@ -46,9 +64,45 @@ template_404 = b'''POST {0}'''
 columns = 0
 rows = 0
 
-class JSONObject:
-  def __init__(self, d):
-    self.__dict__ = d
+class JSONView(object):
+  '''
+  Attribute access to an already decoded JSON object, e.g. e.event.domain.
+  Nested objects and arrays are wrapped only as they are reached, rather
+  than converting the whole tree up front.
+  '''
+  __slots__ = ('_obj',)
+
+  def __init__(self, obj):
+    self._obj = obj
+
+  def __getattr__(self, name):
+    try:
+      return json_view(self._obj[name])
+    except KeyError:
+      raise AttributeError(name)
+
+class JSONListView(object):
+  __slots__ = ('_list',)
+
+  def __init__(self, l):
+    self._list = l
+
+  def __getitem__(self, i):
+    return json_view(self._list[i])
+
+  def __iter__(self):
+    for v in self._list:
+      yield json_view(v)
+
+  def __len__(self):
+    return len(self._list)
+
+def json_view(v):
+  if isinstance(v, dict):
+    return JSONView(v)
+  if isinstance(v, list):
+    return JSONListView(v)
+  return v
 
 __all__ = []
 __version__ = 0.1
@@ -65,6 +119,11 @@ PROFILE = False
 
 influxdb = '127.0.0.1'
 
+#------------------------------------------------------------------------------
+# Batched writer for influxdb, created once the configuration is known.
+#------------------------------------------------------------------------------
+influx_writer = None
+
 #------------------------------------------------------------------------------
 # Credentials we expect clients to authenticate themselves with.
 #------------------------------------------------------------------------------
@@ -87,37 +146,900 @@ throttle_schema = None
 test_control_schema = None
 
 #------------------------------------------------------------------------------
-# Pending command list from the testControl API
-# This is sent as a response commandList to the next received event.
+# Validators compiled from the schemas above, and the proportion of events
+# from each source which are validated (1 in validate_sample).
+#------------------------------------------------------------------------------
+vel_validator = None
+throttle_validator = None
+test_control_validator = None
+validate_sample = 1
+
+#------------------------------------------------------------------------------
+# Whether to print each event in full.
+#------------------------------------------------------------------------------
+verbose = 0
+
+#------------------------------------------------------------------------------
+# Pending command lists from the testControl API, sent in the response to the
+# next event from the agent they are for.
+#------------------------------------------------------------------------------
+class CommandStore(object):
+    '''
+    Queues of pending commandLists, one per sourceId, so that an agent's
+    commands are found with one dictionary lookup however many agents
+    there are.  A commandList can be for one or more sourceIds, for every
+    member of a named group, or, as before, for whichever agent posts next.
+    Each expires after its ttl if not delivered.
+
+    With several collector processes, a single CommandStore lives in a
+    manager process and each collector process reaches it through a proxy
+    over a local socket, so a command is delivered exactly once whichever
+    process the next event arrives at.  With a state file, the queues and
+    groups are saved on every change and reloaded at start-up, so they
+    survive the collector being restarted.
+    '''
+    ANY = ''
+
+    def __init__(self, state_file=None, ttl=300):
+        self.lock = threading.Lock()
+        self.state_file = state_file
+        self.ttl = ttl
+        self.queues = {}
+        self.groups = {}
+        self.last_purge = time.time()
+        if state_file and os.path.exists(state_file):
+            try:
+                state = json.load(open(state_file, 'r'))
+                self.groups = state.get('groups', {})
+                for source_id, entries in state.get('queues', {}).items():
+                    self.queues[source_id] = collections.deque(
+                                               tuple(entry) for entry in entries)
+            except (IOError, ValueError) as e:
+                print('Ignoring command state {0}: {1}'.format(state_file, e))
+
+    def save(self):
+        '''
+        Write the queues and groups to the state file, if there is one.
+        Called with the lock held.
+        '''
+        if not self.state_file:
+            return
+        state = {'groups': self.groups,
+                 'queues': dict((source_id, list(queue))
+                                for source_id, queue in self.queues.items())}
+        temp_file = self.state_file + '.tmp'
+        with open(temp_file, 'w') as f:
+            json.dump(state, f)
+        os.rename(temp_file, self.state_file)
+
+    def purge(self, now):
+        '''
+        Drop expired commandLists from every queue, at most once a minute.
+        Called with the lock held; returns whether anything was dropped.
+        '''
+        if now - self.last_purge < 60:
+            return False
+        self.last_purge = now
+        purged = False
+        for source_id in list(self.queues.keys()):
+            queue = self.queues[source_id]
+            live = [entry for entry in queue if entry[0] > now]
+            if len(live) != len(queue):
+                purged = True
+                if live:
+                    self.queues[source_id] = collections.deque(live)
+                else:
+                    del self.queues[source_id]
+        return purged
+
+    def put(self, commands, source_ids=None, groups=None, ttl=None):
+        '''
+        Queue a commandList for the given sourceIds and members of the
+        given groups, or for the next agent if there are neither.  Returns
+        the number of queues it was added to, or None if a group is not
+        known.
+        '''
+        self.lock.acquire()
+        try:
+            targets = set(source_ids or [])
+            for group in groups or []:
+                if group not in self.groups:
+                    return None
+                targets.update(self.groups[group])
+            if not source_ids and not groups:
+                targets.add(self.ANY)
+            expires = time.time() + (self.ttl if ttl is None else ttl)
+            for source_id in targets:
+                self.queues.setdefault(source_id, collections.deque()).append(
+                                                          (expires, commands))
+            self.purge(time.time())
+            self.save()
+            return len(targets)
+        finally:
+            self.lock.release()
+
+    def take(self, source_id=None):
+        '''
+        Remove and return the unexpired commandLists for the sourceId, or
+        for any agent if there are none, merged into one, or None.
+        '''
+        self.lock.acquire()
+        try:
+            now = time.time()
+            changed = self.purge(now)
+            entries = []
+            for key in (source_id, self.ANY):
+                if key is None or key not in self.queues:
+                    continue
+                entries = [entry for entry in self.queues.pop(key)
+                           if entry[0] > now]
+                changed = True
+                if entries:
+                    break
+            if changed:
+                self.save()
+        finally:
+            self.lock.release()
+        return merge_commands([entry[1] for entry in entries])
+
+    def peek(self, source_id=None):
+        self.lock.acquire()
+        try:
+            now = time.time()
+            queue = self.queues.get(self.ANY if source_id is None
+                                    else source_id, ())
+            return merge_commands([entry[1] for entry in queue
+                                   if entry[0] > now])
+        finally:
+            self.lock.release()
+
+    def pending(self):
+        '''
+        Number of commands waiting to be sent, across every queue.
+        '''
+        self.lock.acquire()
+        try:
+            now = time.time()
+            return sum(len(entry[1].get('commandList') or [])
+                       for queue in self.queues.values()
+                       for entry in queue
+                       if entry[0] > now and isinstance(entry[1], dict))
+        finally:
+            self.lock.release()
+
+    def set_group(self, name, source_ids):
+        '''
+        Define, or with no sourceIds remove, a named group of agents.
+        '''
+        self.lock.acquire()
+        try:
+            if source_ids:
+                self.groups[name] = sorted(set(source_ids))
+            else:
+                self.groups.pop(name, None)
+            self.save()
+        finally:
+            self.lock.release()
+
+    def get_groups(self):
+        return dict(self.groups)
+
+def merge_commands(command_lists):
+    '''
+    One commandList holding the commands of each of those given, or the
+    one given if it is not a commandList, or None if none are given.
+    '''
+    if not command_lists:
+        return None
+    if len(command_lists) == 1:
+        return command_lists[0]
+    merged = []
+    for commands in command_lists:
+        if isinstance(commands, dict):
+            merged.extend(commands.get('commandList') or [])
+    return {'commandList': merged}
+
+#------------------------------------------------------------------------------
+# The sourceId of an event body, found without decoding the whole body so
+# its commands can be looked up before it is queued.
+#------------------------------------------------------------------------------
+SOURCE_ID_JSON = re.compile(r'"sourceId"\s*:\s*"((?:[^"\\]|\\.)*)"')
+SOURCE_ID_CBOR = '\x68sourceId'
+
+def event_source_id(body, decode):
+    '''
+    The sourceId in an event body, or None if it hasn't one.
+    '''
+    try:
+        if decode is json.loads:
+            match = SOURCE_ID_JSON.search(body)
+            if match is not None:
+                return json.loads('"' + match.group(1) + '"')
+        else:
+            pos = body.find(SOURCE_ID_CBOR)
+            if pos >= 0:
+                value, pos = cbor_item(body, pos + len(SOURCE_ID_CBOR))
+                if isinstance(value, basestring):
+                    return value
+    except Exception:
+        pass
+    return None
+
+class CommandManager(BaseManager):
+    pass
+
+CommandManager.register('CommandStore', CommandStore)
+
+command_store = CommandStore()
+
+#------------------------------------------------------------------------------
+# Which of the collector processes this is, when there are several.
+#------------------------------------------------------------------------------
+worker_id = 0
+
+#------------------------------------------------------------------------------
+# Events accepted by the listener and waiting for a worker to validate and
+# save them, and what to tell agents to do when it is full.
+#------------------------------------------------------------------------------
+ingest_queue = None
+ingest_retry_after = 1
+ingest_stats = {'accepted': 0, 'rejected': 0, 'processed': 0,
+                'gzipBodies': 0, 'wireBytes': 0, 'inflatedBytes': 0,
+                'inflateMs': 0.0, 'cborBodies': 0, 'kafkaPublished': 0,
+                'kafkaFailed': 0, 'duplicates': 0}
+ingest_stats_lock = threading.Lock()
+
+def count_ingest(name, amount=1):
+    '''
+    Add to one of the ingest_stats, which the listener threads, the ingest
+    workers and the Kafka producer's callbacks all update.
+    '''
+    ingest_stats_lock.acquire()
+    try:
+        ingest_stats[name] += amount
+    finally:
+        ingest_stats_lock.release()
+
+#------------------------------------------------------------------------------
+# Largest body accepted once a gzip Content-Encoding has been inflated.
+#------------------------------------------------------------------------------
+max_inflated_bytes = 16 * 1024 * 1024
+
+#------------------------------------------------------------------------------
+# Largest eventList accepted in one eventBatch request.
+#------------------------------------------------------------------------------
+batch_max_events = 1000
+
+#------------------------------------------------------------------------------
+# Kafka sink, if events are published to Kafka rather than saved to influxdb
+# by the collector itself.
+#------------------------------------------------------------------------------
+kafka_sink = None
+
+#------------------------------------------------------------------------------
+# Rollups of the points saved, if configured.
+#------------------------------------------------------------------------------
+rollups = None
+
+#------------------------------------------------------------------------------
+# Overload controller, if the collector throttles agents itself.
+#------------------------------------------------------------------------------
+overload_controller = None
+
+#------------------------------------------------------------------------------
+# Filter of events already seen, if duplicates are suppressed.
+#------------------------------------------------------------------------------
+deduplicator = None
+
+#------------------------------------------------------------------------------
+# Live stream of events, points and rollups to /eventStream subscribers, if
+# enabled.
+#------------------------------------------------------------------------------
+event_stream = None
+
+#------------------------------------------------------------------------------
+# Self-metrics served at /metrics in the Prometheus text format.
 #------------------------------------------------------------------------------
-pending_command_list = None
+class Histogram(object):
+    '''
+    Cumulative histogram of durations, in seconds, with fixed buckets from
+    50us to 10s, so observing is a short scan and a few additions.
+    '''
+    BUCKETS = (0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01,
+               0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0)
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.counts = [0] * (len(self.BUCKETS) + 1)
+        self.total = 0.0
+
+    def observe(self, seconds):
+        i = 0
+        while i < len(self.BUCKETS) and seconds > self.BUCKETS[i]:
+            i += 1
+        self.lock.acquire()
+        self.counts[i] += 1
+        self.total += seconds
+        self.lock.release()
+
+    def render(self, name, labels):
+        self.lock.acquire()
+        counts = list(self.counts)
+        total = self.total
+        self.lock.release()
+        lines = []
+        cumulative = 0
+        for bound, count in zip(self.BUCKETS + ('+Inf',), counts):
+            cumulative += count
+            lines.append('{0}_bucket{{{1},le="{2}"}} {3}'.format(name, labels,
+                                                                 bound,
+                                                                 cumulative))
+        lines.append('{0}_sum{{{1}}} {2:.6f}'.format(name, labels, total))
+        lines.append('{0}_count{{{1}}} {2}'.format(name, labels, cumulative))
+        return lines
+
+class CollectorMetrics(object):
+    '''
+    Events saved by domain and source, and histograms of the time taken by
+    each stage an event goes through: waiting in the ingest queue, parsing,
+    schema validation and the influxdb write of the points it produced.
+    Sources beyond max_sources are counted together as "other", so agents
+    with changing names can't grow the output without bound.
+    '''
+
+    def __init__(self, max_sources=1000):
+        self.lock = threading.Lock()
+        self.max_sources = max_sources
+        self.events = {}
+        self.queue_wait = Histogram()
+        self.parse = Histogram()
+        self.validation = Histogram()
+        self.influxdb_write = Histogram()
+
+    def event(self, jobj):
+        header = jobj['event']['commonEventHeader']
+        key = (header.get('domain', ''), header.get('sourceName', ''))
+        self.lock.acquire()
+        if key not in self.events and len(self.events) >= self.max_sources:
+            key = (key[0], 'other')
+        self.events[key] = self.events.get(key, 0) + 1
+        self.lock.release()
+
+    def render(self):
+        '''
+        The metrics, in the Prometheus text exposition format.
+        '''
+        worker = 'worker="{0}"'.format(worker_id)
+        lines = ['# HELP ves_collector_events_total Events saved, by domain '
+                 'and source.',
+                 '# TYPE ves_collector_events_total counter']
+        self.lock.acquire()
+        events = sorted(self.events.items())
+        self.lock.release()
+        for (domain, source), count in events:
+            lines.append('ves_collector_events_total{{{0},domain="{1}",'
+                         'source="{2}"}} {3}'.format(worker,
+                                                     metric_label(domain),
+                                                     metric_label(source),
+                                                     count))
+        for name, help_text, histogram in (
+                ('ves_collector_queue_wait_seconds',
+                 'Time events waited in the ingest queue.', self.queue_wait),
+                ('ves_collector_parse_seconds',
+                 'Time to decode an event body.', self.parse),
+                ('ves_collector_validation_seconds',
+                 'Time to validate an event against its schema.',
+                 self.validation),
+                ('ves_collector_influxdb_write_seconds',
+                 'Latency of each write of points to influxdb.',
+                 self.influxdb_write)):
+            lines.append('# HELP {0} {1}'.format(name, help_text))
+            lines.append('# TYPE {0} histogram'.format(name))
+            lines.extend(histogram.render(name, worker))
+        values = [('ves_collector_ingest_queue_depth',
+                   'Events waiting in the ingest queue.',
+                   ingest_queue.qsize() if ingest_queue is not None else 0),
+                  ('ves_collector_ingest_rejected_total',
+                   'Events refused because the ingest queue was full.',
+                   ingest_stats['rejected']),
+                  ('ves_collector_influxdb_late_points_total',
+                   'Points older than the last written for their series.',
+                   influx_writer.late if influx_writer is not None else 0),
+                  ('ves_collector_influxdb_buffered_points',
+                   'Points held in the influxdb reorder buffer.',
+                   influx_writer.count if influx_writer is not None else 0),
+                  ('ves_collector_influxdb_stalls_total',
+                   'Writes that waited for room in the reorder buffer.',
+                   influx_writer.stalls if influx_writer is not None else 0),
+                  ('ves_collector_pending_commands',
+                   'Commands waiting to be sent in a commandList.',
+                   command_store.pending())]
+        spool = influx_writer.spool if influx_writer is not None else None
+        if spool is not None:
+            values.extend([
+                ('ves_collector_spool_bytes',
+                 'Bytes of points spooled on disk for influxdb.',
+                 spool.size()),
+                ('ves_collector_spool_segments',
+                 'Spool segment files on disk.', len(spool.segments())),
+                ('ves_collector_spool_age_seconds',
+                 'Age of the oldest spooled points.', spool.age()),
+                ('ves_collector_spool_replayed_points_total',
+                 'Spooled points written to influxdb.', spool.replayed),
+                ('ves_collector_spool_dropped_points_total',
+                 'Spooled points dropped to stay within spool_max_bytes.',
+                 spool.dropped)])
+        if event_stream is not None:
+            values.extend([
+                ('ves_collector_stream_subscribers',
+                 'Subscribers to /eventStream.',
+                 len(event_stream.subscribers)),
+                ('ves_collector_stream_items_total',
+                 'Events, points and rollups sent to /eventStream '
+                 'subscribers.', event_stream.published),
+                ('ves_collector_stream_dropped_subscribers_total',
+                 'Subscribers dropped as too slow to keep up.',
+                 event_stream.dropped)])
+        if deduplicator is not None:
+            values.extend([
+                ('ves_collector_duplicate_events_total',
+                 'Events dropped as already seen.', deduplicator.duplicates),
+                ('ves_collector_dedup_events',
+                 'Events in the current duplicate filter.',
+                 deduplicator.count),
+                ('ves_collector_dedup_early_rotations_total',
+                 'Duplicate filters rotated before the window ended, as they '
+                 'reached capacity.', deduplicator.early_rotations)])
+        if overload_controller is not None:
+            values.extend([
+                ('ves_collector_overloaded',
+                 'Whether the overload controller last found the collector '
+                 'overloaded.', int(overload_controller.overloaded)),
+                ('ves_collector_throttled_sources',
+                 'Sources currently throttled by the overload controller.',
+                 len(overload_controller.throttled)),
+                ('ves_collector_throttles_total',
+                 'Throttle commands queued by the overload controller.',
+                 overload_controller.throttles),
+                ('ves_collector_restores_total',
+                 'Restore commands queued by the overload controller.',
+                 overload_controller.restores)])
+        if rollups is not None:
+            values.extend([
+                ('ves_collector_rollups_written_total',
+                 'Rollup points written.', rollups.emitted),
+                ('ves_collector_rollups_late_points_total',
+                 'Points too late for their rollup window.', rollups.late),
+                ('ves_collector_rollups_dropped_points_total',
+                 'Points left out of rollups as too many series were open.',
+                 rollups.dropped)])
+        for name, help_text, value in values:
+            lines.append('# HELP {0} {1}'.format(name, help_text))
+            lines.append('# TYPE {0} {1}'.format(name,
+                                                 'counter'
+                                                 if name.endswith('_total')
+                                                 else 'gauge'))
+            lines.append('{0}{{{1}}} {2}'.format(name, worker, value))
+        return '\n'.join(lines) + '\n'
+
+def metric_label(value):
+    '''
+    A value escaped for use as a Prometheus label value.
+    '''
+    return unicode(value).replace('\\', '\\\\').replace('"', '\\"').\
+           replace('\n', '\\n').encode('utf-8')
+
+metrics = CollectorMetrics()
 
 #------------------------------------------------------------------------------
 # Logger for this module.
 #------------------------------------------------------------------------------
 logger = None
 
-def listener(environ, start_response, schema):
+#------------------------------------------------------------------------------
+# CBOR (RFC 7049) event bodies, sent with Content-Type application/cbor.  A C
+# decoder is used if one is installed; the one below is for when it isn't.
+#------------------------------------------------------------------------------
+try:
+    from cbor2 import loads as cbor_loads
+except ImportError:
+    try:
+        from cbor import loads as cbor_loads
+    except ImportError:
+        cbor_loads = None
+
+CBOR_BREAK = object()
+
+def cbor_half(bits):
     '''
-    Handler for the Vendor Event Listener REST API.
+    Value of an IEEE 754 half-precision float.
+    '''
+    exponent = (bits >> 10) & 0x1f
+    mantissa = bits & 0x3ff
+    if exponent == 0:
+        value = mantissa * 2.0 ** -24
+    elif exponent == 31:
+        value = float('nan') if mantissa else float('inf')
+    else:
+        value = (mantissa + 1024) * 2.0 ** (exponent - 25)
+    return -value if bits & 0x8000 else value
+
+def cbor_item(data, pos):
+    '''
+    Decode the CBOR item at pos, returning it and the position after it.
+    '''
+    initial = ord(data[pos])
+    pos += 1
+    major = initial >> 5
+    info = initial & 0x1f
+
+    if major == 7:
+        if info == 20:
+            return False, pos
+        if info == 21:
+            return True, pos
+        if info == 22 or info == 23:
+            return None, pos
+        if info == 25:
+            return cbor_half(struct.unpack_from('>H', data, pos)[0]), pos + 2
+        if info == 26:
+            return struct.unpack_from('>f', data, pos)[0], pos + 4
+        if info == 27:
+            return struct.unpack_from('>d', data, pos)[0], pos + 8
+        if info == 31:
+            return CBOR_BREAK, pos
+        raise ValueError('Unsupported CBOR simple value {0}'.format(info))
+
+    if info < 24:
+        arg = info
+    elif info == 24:
+        arg = ord(data[pos])
+        pos += 1
+    elif info == 25:
+        arg = struct.unpack_from('>H', data, pos)[0]
+        pos += 2
+    elif info == 26:
+        arg = struct.unpack_from('>I', data, pos)[0]
+        pos += 4
+    elif info == 27:
+        arg = struct.unpack_from('>Q', data, pos)[0]
+        pos += 8
+    elif info == 31 and major in (2, 3, 4, 5):
+        arg = None
+    else:
+        raise ValueError('Bad CBOR length {0}'.format(info))
+
+    if major == 0:
+        return arg, pos
+    if major == 1:
+        return -1 - arg, pos
+    if major == 2 or major == 3:
+        if arg is None:
+            chunks = []
+            while True:
+                chunk, pos = cbor_item(data, pos)
+                if chunk is CBOR_BREAK:
+                    break
+                chunks.append(chunk)
+            value = (u'' if major == 3 else '').join(chunks)
+            return value, pos
+        if pos + arg > len(data):
+            raise ValueError('Truncated CBOR string')
+        value = data[pos:pos + arg]
+        if major == 3:
+            value = value.decode('utf-8')
+        return value, pos + arg
+    if major == 4:
+        value = []
+        while arg is None or len(value) < arg:
+            item, pos = cbor_item(data, pos)
+            if item is CBOR_BREAK:
+                if arg is not None:
+                    raise ValueError('Unexpected CBOR break')
+                break
+            value.append(item)
+        return value, pos
+    if major == 5:
+        value = {}
+        count = 0
+        while arg is None or count < arg:
+            key, pos = cbor_item(data, pos)
+            if key is CBOR_BREAK:
+                if arg is not None:
+                    raise ValueError('Unexpected CBOR break')
+                break
+            value[key], pos = cbor_item(data, pos)
+            count += 1
+        return value, pos
+    # major == 6: a tag, which only qualifies the item that follows.
+    return cbor_item(data, pos)
+
+def cbor_decode(data):
+    '''
+    Decode a CBOR document into the objects json.loads would give for the
+    equivalent JSON.
+    '''
+    value, pos = cbor_item(data, 0)
+    if value is CBOR_BREAK or pos != len(data):
+        raise ValueError('Malformed CBOR document')
+    return value
+
+if cbor_loads is None:
+    cbor_loads = cbor_decode
+
+#------------------------------------------------------------------------------
+# Schema validation, compiled once.
+#------------------------------------------------------------------------------
+class EventValidator:
+    '''
+    Validator for one schema, built once at start-up rather than for every
+    event.
+
+    Where the schema defines a commonEventHeader and <domain>Fields blocks,
+    an event is checked against its header and its own domain's fields only,
+    chosen by commonEventHeader.domain, rather than against every domain in
+    the schema.  Anything else is checked against the whole schema.
+
+    With a sample_rate of N, only 1 in N events from each source is checked.
+    '''
+
+    MAX_SOURCES = 10000
+
+    def __init__(self, schema, sample_rate=1):
+        jsonschema.Draft4Validator.check_schema(schema)
+        self.validator = jsonschema.Draft4Validator(schema)
+        self.sample_rate = sample_rate
+        self.seen = {}
+        self.lock = threading.Lock()
+
+        resolver = jsonschema.RefResolver.from_schema(schema)
+        definitions = schema.get('definitions', {})
+        self.header = None
+        self.domains = {}
+        if 'commonEventHeader' in definitions:
+            self.header = jsonschema.Draft4Validator(
+                                            definitions['commonEventHeader'],
+                                            resolver=resolver)
+            for name, definition in definitions.items():
+                if name.endswith('Fields') and len(name) > len('Fields'):
+                    self.domains[name[:-len('Fields')]] = (
+                        name,
+                        jsonschema.Draft4Validator(definition,
+                                                   resolver=resolver))
+
+    def validate(self, decoded_body):
+        '''
+        Raise jsonschema.ValidationError if the body is invalid.  Returns
+        False if the body was skipped by sampling, True if it was checked.
+        '''
+        event = None
+        header = None
+        if isinstance(decoded_body, dict):
+            event = decoded_body.get('event')
+        if isinstance(event, dict):
+            header = event.get('commonEventHeader')
+        if not isinstance(header, dict):
+            self.validator.validate(decoded_body)
+            return True
+
+        if self.sample_rate > 1:
+            source = header.get('sourceId', header.get('sourceName'))
+            self.lock.acquire()
+            try:
+                if len(self.seen) >= self.MAX_SOURCES:
+                    self.seen.clear()
+                count = self.seen.get(source, 0)
+                self.seen[source] = count + 1
+            finally:
+                self.lock.release()
+            if count % self.sample_rate != 0:
+                return False
+
+        domain = header.get('domain')
+        if self.header is None or domain not in self.domains:
+            self.validator.validate(decoded_body)
+            return True
+
+        self.header.validate(header)
+        name, validator = self.domains[domain]
+        if name in event:
+            validator.validate(event[name])
+        return True
+
+def compile_validator(name, schema, sample_rate=1):
+    '''
+    Build an EventValidator, or return None (no validation) if there is no
+    schema or the schema itself is invalid.
+    '''
+    if schema is None:
+        return None
+    try:
+        return EventValidator(schema, sample_rate)
+    except jsonschema.SchemaError as e:
+        logger.error('{0} schema is not valid! {1}'.format(name, e))
+        print('{0} schema is not valid! {1}'.format(name, e))
+        return None
 
-    Extract headers and the body and check that:
+def show_event(title, decoded_body):
+    '''
+    Print an event in full in verbose mode, otherwise just say what it was.
+    '''
+    if verbose > 0:
+        print('{0}:\n{1}'.format(title, json.dumps(decoded_body,
+                                                   sort_keys=True,
+                                                   indent=4,
+                                                   separators=(',', ': '))))
+    else:
+        try:
+            header = decoded_body['event']['commonEventHeader']
+            print('{0}: {1} from {2}'.format(title,
+                                             header.get('domain'),
+                                             header.get('sourceName')))
+        except (KeyError, TypeError):
+            print(title)
+
+def listener(environ, start_response, validator):
+    '''
+    Handler for the Vendor Event Listener REST API.
 
-      1)  The client authenticated themselves correctly.
-      2)  The body validates against the provided schema for the API.
+    Extract headers and the body, check that the client authenticated
+    themselves correctly and queue the body for an ingest worker, which
+    validates and saves it.  The agent gets its 202 as soon as the body is
+    queued, or a 503 if the queue is full.
 
     '''
     logger.info('Got a Vendor Event request')
     print('==== ' + time.asctime() + ' ' + '=' * 49)
 
+    credentials = get_credentials(environ)
+
     #--------------------------------------------------------------------------
-    # Extract the content from the request.
+    # See whether the user authenticated themselves correctly.
     #--------------------------------------------------------------------------
+    if (credentials == (vel_username + ':' + vel_password)):
+        logger.debug('Authenticated OK')
+#        print('Authenticated OK')
+
+        #----------------------------------------------------------------------
+        # Extract the content from the request, only once we know who it is
+        # from since it may need inflating.
+        #----------------------------------------------------------------------
+        try:
+            body = read_body(environ)
+            decode = body_decoder(environ)
+        except BodyError as e:
+            yield body_error(start_response, e)
+            return
+        logger.debug('Content Body: {0}'.format(body))
+
+        #----------------------------------------------------------------------
+        # Hand the body over to the ingest workers.  If they are too far
+        # behind, ask the agent to come back later rather than queueing
+        # without bound.
+        #----------------------------------------------------------------------
+        source_id = event_source_id(body, decode)
+        if overload_controller is not None:
+            overload_controller.observe(source_id)
+        try:
+            ingest_queue.put_nowait((body, validator, decode, time.time()))
+            count_ingest('accepted')
+        except Queue.Full:
+            count_ingest('rejected')
+            logger.warn('Ingest queue full, rejecting event')
+            yield overloaded(start_response)
+            return
+
+        #----------------------------------------------------------------------
+        # Respond to the caller. If we have a pending commandList from the
+        # testControl API for it, send it in response.
+        #----------------------------------------------------------------------
+        yield accept(start_response, source_id=source_id)
+    else:
+        yield auth_failed(start_response, credentials)
+
+class BodyError(Exception):
+    '''
+    A request body that can't be read, with the HTTP status to reply with.
+    '''
+    def __init__(self, status, text):
+        Exception.__init__(self, text)
+        self.status = status
+        self.text = text
+
+def read_body(environ):
+    '''
+    Read a request body, inflating it if it was sent with a gzip
+    Content-Encoding.
+
+    The body is inflated as it is read, a chunk at a time, and never to more
+    than max_inflated_bytes, so a small body that inflates to gigabytes is
+    rejected without the collector ever holding more than the limit.
+    '''
     length = int(environ.get('CONTENT_LENGTH', '0'))
     logger.debug('Content Length: {0}'.format(length))
-    body = environ['wsgi.input'].read(length)
-    logger.debug('Content Body: {0}'.format(body))
+    stream = environ['wsgi.input']
+    encoding = environ.get('HTTP_CONTENT_ENCODING', '').strip().lower()
+    if encoding in ('', 'identity'):
+        return stream.read(length)
+    if encoding not in ('gzip', 'x-gzip'):
+        raise BodyError('415 Unsupported Media Type',
+                        'Content-Encoding {0} not supported'.format(encoding))
+
+    start = time.time()
+    inflater = zlib.decompressobj(16 + zlib.MAX_WBITS)
+    parts = []
+    size = 0
+    remaining = length
+    try:
+        while remaining > 0:
+            chunk = stream.read(min(remaining, 65536))
+            if not chunk:
+                break
+            remaining -= len(chunk)
+            while chunk:
+                part = inflater.decompress(chunk,
+                                           max_inflated_bytes - size + 1)
+                size += len(part)
+                if size > max_inflated_bytes:
+                    raise BodyError('413 Request Entity Too Large',
+                                    'Body inflates to more than {0} '
+                                    'bytes'.format(max_inflated_bytes))
+                parts.append(part)
+                chunk = inflater.unconsumed_tail
+        part = inflater.flush()
+    except zlib.error as e:
+        raise BodyError('400 Bad Request',
+                        'Body is not valid gzip: {0}'.format(e))
+    size += len(part)
+    if size > max_inflated_bytes:
+        raise BodyError('413 Request Entity Too Large',
+                        'Body inflates to more than {0} bytes'.format(
+                                                         max_inflated_bytes))
+    parts.append(part)
+
+    count_ingest('gzipBodies')
+    count_ingest('wireBytes', length)
+    count_ingest('inflatedBytes', size)
+    count_ingest('inflateMs', (time.time() - start) * 1000)
+    logger.debug('Inflated {0} bytes to {1}'.format(length, size))
+    return ''.join(parts)
+
+def body_decoder(environ):
+    '''
+    The function that decodes a request body of the request's Content-Type:
+    json.loads, or cbor_loads for application/cbor.
+    '''
+    content_type = environ.get('CONTENT_TYPE', '').split(';')[0].strip().lower()
+    if content_type == 'application/cbor':
+        count_ingest('cborBodies')
+        return cbor_loads
+    if content_type in ('', 'application/json', 'text/plain',
+                        'application/x-www-form-urlencoded'):
+        return json.loads
+    raise BodyError('415 Unsupported Media Type',
+                    'Content-Type {0} not supported'.format(content_type))
+
+def body_error(start_response, e):
+    '''
+    Start the response for a BodyError and return its body.
+    '''
+    logger.warn('Failed to read body: {0}'.format(e.text))
+    print('Failed to read body: {0}'.format(e.text))
+    start_response(e.status, [('Content-type', 'application/json')])
+    req_error = { 'requestError': {
+                    'serviceException': {
+                        'messageId': 'SVC0002',
+                        'text': e.text
+                        }
+                    }
+                }
+    return json.dumps(req_error)
 
+def get_credentials(environ):
+    '''
+    Return the "user:password" from a request's Basic authorization header,
+    or None if there isn't one.
+    '''
     mode, b64_credentials = string.split(environ.get('HTTP_AUTHORIZATION',
                                                      'None None'))
     # logger.debug('Auth. Mode: {0} Credentials: {1}'.format(mode,
@@ -130,26 +1052,236 @@ def listener(environ, start_response, schema):
 
     # logger.debug('Credentials: {0}'.format(credentials))
     logger.debug('Credentials: ****')
+    return credentials
+
+def accept(start_response, response=None, source_id=None):
+    '''
+    Start a 202 response and return its body: the pending commandList from
+    the testControl API for the agent with that sourceId, or for any agent,
+    if there is one, merged into any response given.
+    '''
+    commands = command_store.take(source_id)
+    if commands is not None:
+        print('\n'+ '='*80)
+        print('Sending pending commandList in the response:\n'
+              '{0}'.format(json.dumps(commands,
+                                      sort_keys=True,
+                                      indent=4,
+                                      separators=(',', ': '))))
+        print('='*80 + '\n')
+        if response is None:
+            response = commands
+        else:
+            response.update(commands)
+
+    if response is not None:
+        start_response('202 Accepted',
+                       [('Content-type', 'application/json')])
+        return json.dumps(response)
+    start_response('202 Accepted', [])
+    return ''
+
+def auth_failed(start_response, credentials):
+    '''
+    Start a 401 response and return its body.
+    '''
+    logger.warn('Failed to authenticate OK; creds: {0}'.format(credentials))
+    print('Failed to authenticate agent credentials: ', credentials,
+          'against expected ', vel_username, ':', vel_password)
+
+    start_response('401 Unauthorized', [ ('Content-type',
+                                          'application/json')])
+    req_error = { 'requestError': {
+                    'policyException': {
+                        'messageId': 'POL0001',
+                        'text': 'Failed to authenticate'
+                        }
+                    }
+                }
+    return json.dumps(req_error)
+
+def overloaded(start_response):
+    '''
+    Start a 503 response, asking the agent to retry after
+    ingest_retry_after seconds, and return its body.
+    '''
+    start_response('503 Service Unavailable',
+                   [('Content-type', 'application/json'),
+                    ('Retry-After', str(ingest_retry_after))])
+    svc_error = { 'requestError': {
+                    'serviceException': {
+                        'messageId': 'SVC1000',
+                        'text': 'Collector is overloaded, retry '
+                                'after {0} seconds'.format(ingest_retry_after)
+                        }
+                    }
+                }
+    return json.dumps(svc_error)
+
+def bad_request(start_response, text, response=None):
+    '''
+    Start a 400 response and return its body.
+    '''
+    logger.warn('Bad request: {0}'.format(text))
+    print('Bad request: {0}'.format(text))
+    start_response('400 Bad Request', [('Content-type', 'application/json')])
+    req_error = { 'requestError': {
+                    'serviceException': {
+                        'messageId': 'SVC0002',
+                        'text': text
+                        }
+                    }
+                }
+    if response is not None:
+        req_error.update(response)
+    return json.dumps(req_error)
+
+def batch_listener(environ, start_response, validator):
+    '''
+    Handler for the Vendor Event Listener eventBatch REST API.
+
+    The body is an eventList.  Each event in it is validated against its
+    own domain, in this request rather than by the ingest workers, so that
+    the response can say which events were rejected and why; the rest are
+    saved and their points handed to influxdb together, as one flush, or
+    published to Kafka.  An event's points are only written if it was
+    saved as a whole.  Batches don't go through the ingest queue, but are
+    refused with the same 503 while it is full.
+
+    The response is a 202 if any events were accepted, with an
+    eventListErrors array giving the index, eventId and reason for each that
+    was not.  Duplicates are accepted but not saved again.  If none were
+    accepted it is a 400 with the same array.
+    '''
+    logger.info('Got a Vendor Event Batch request')
+    print('==== ' + time.asctime() + ' ' + '=' * 49)
+
+    credentials = get_credentials(environ)
+    if (credentials != (vel_username + ':' + vel_password)):
+        yield auth_failed(start_response, credentials)
+        return
+
+    if ingest_queue is not None and ingest_queue.full():
+        count_ingest('rejected')
+        logger.warn('Ingest queue full, rejecting event batch')
+        yield overloaded(start_response)
+        return
+
+    try:
+        body = read_body(environ)
+        decode = body_decoder(environ)
+    except BodyError as e:
+        yield body_error(start_response, e)
+        return
+
+    try:
+        start = time.time()
+        event_list = decode(body)['eventList']
+        metrics.parse.observe(time.time() - start)
+    except Exception as e:
+        yield bad_request(start_response,
+                          'Body is not an eventList: {0}'.format(e))
+        return
+    if not isinstance(event_list, list):
+        yield bad_request(start_response, 'eventList is not an array')
+        return
+    if len(event_list) > batch_max_events:
+        yield bad_request(start_response,
+                          'eventList has {0} events, more than {1}'.format(
+                                          len(event_list), batch_max_events))
+        return
 
     #--------------------------------------------------------------------------
-    # If we have a schema file then check that the event matches that expected.
+    # Validate and save each event, collecting their points rather than
+    # writing them one at a time.  Each event's points are kept apart until
+    # it has been saved, so one that fails part way adds none.
     #--------------------------------------------------------------------------
-    if (schema is not None):
-        logger.debug('Attempting to validate data: {0}\n'
-                     'Against schema: {1}'.format(body, schema))
+    points = []
+    errors = []
+    saved = 0
+    for index, event in enumerate(event_list):
+        decoded_body = {'event': event}
+        event_id = None
         try:
-            decoded_body = json.loads(body)
-            jsonschema.validate(decoded_body, schema)
-            logger.info('Event is valid!')
-            print('Valid body decoded & checked against schema OK:\n'
-                  '{0}'.format(json.dumps(decoded_body,
-                                          sort_keys=True,
-                                          indent=4,
-                                          separators=(',', ': '))))
+            event_id = event['commonEventHeader'].get('eventId')
+            if validator is not None:
+                start = time.time()
+                validator.validate(decoded_body)
+                metrics.validation.observe(time.time() - start)
+            event_points = []
+            if store_event(decoded_body, event_points):
+                points.extend(event_points)
+                saved += 1
+        except jsonschema.ValidationError as e:
+            errors.append({'index': index,
+                           'eventId': event_id,
+                           'text': 'Not valid against schema: {0}'.format(
+                                                                  e.message)})
+        except Exception as e:
+            errors.append({'index': index,
+                           'eventId': event_id,
+                           'text': 'Not a valid event: {0!r}'.format(e)})
+
+    accepted = len(event_list) - len(errors)
+    count_ingest('accepted', saved)
+    count_ingest('processed', saved)
+    if points:
+        influx_writer.write_batch(points)
+    print('Event batch: {0} events, {1} saved, {2} duplicates, {3} '
+          'points'.format(len(event_list), saved, accepted - saved,
+                          len(points)))
+    logger.info('Event batch: {0} events, {1} rejected'.format(len(event_list),
+                                                               len(errors)))
+
+    try:
+        source_id = event_list[0]['commonEventHeader'].get('sourceId')
+    except Exception:
+        source_id = None
+    if overload_controller is not None:
+        overload_controller.observe(source_id, len(event_list))
+    if not errors:
+        yield accept(start_response, source_id=source_id)
+    elif accepted > 0:
+        for error in errors:
+            print('Event {index} ({eventId}) rejected: {text}'.format(**error))
+        yield accept(start_response, {'eventListErrors': errors},
+                     source_id=source_id)
+    else:
+        yield bad_request(start_response, 'No events in eventList accepted',
+                          {'eventListErrors': errors})
+
+def ingest(body, validator, decode=json.loads):
+    '''
+    Decode, validate and save one event body taken from the ingest queue.
+    The body is JSON or, for application/cbor, CBOR; decode is the matching
+    function.
+    '''
+    #--------------------------------------------------------------------------
+    # The body is decoded once here; the same object is then validated, saved
+    # and processed.
+    #--------------------------------------------------------------------------
+    decoded_body = None
 
-        except jsonschema.SchemaError as e:
-            logger.error('Schema is not valid! {0}'.format(e))
-            print('Schema is not valid! {0}'.format(e))
+    #--------------------------------------------------------------------------
+    # If we have a schema file then check that the event matches that expected.
+    #--------------------------------------------------------------------------
+    if (validator is not None):
+        logger.debug('Attempting to validate data: {0}'.format(body))
+        try:
+            start = time.time()
+            decoded_body = decode(body)
+            validate_start = time.time()
+            metrics.parse.observe(validate_start - start)
+            sampled = validator.validate(decoded_body)
+            metrics.validation.observe(time.time() - validate_start)
+            if sampled:
+                logger.info('Event is valid!')
+                show_event('Valid body decoded & checked against schema OK',
+                           decoded_body)
+            else:
+                logger.debug('Event not sampled for validation')
+                show_event('Valid body decoded (not sampled for schema '
+                           'checking)', decoded_body)
 
         except jsonschema.ValidationError as e:
             logger.warn('Event is not valid against schema! {0}'.format(e))
@@ -166,85 +1298,1394 @@ def listener(environ, start_response, schema):
     else:
         logger.debug('No schema so just decode JSON: {0}'.format(body))
         try:
-            decoded_body = json.loads(body)
-            print('Valid JSON body (no schema checking) decoded:\n'
-                  '{0}'.format(json.dumps(decoded_body,
-                                         sort_keys=True,
-                                         indent=4,
-                                         separators=(',', ': '))))
-            logger.info('Event is valid JSON but not checked against schema!')
+            start = time.time()
+            decoded_body = decode(body)
+            metrics.parse.observe(time.time() - start)
+            show_event('Valid body (no schema checking) decoded',
+                       decoded_body)
+            logger.info('Event decoded but not checked against schema!')
 
         except Exception as e:
             logger.error('Event invalid for unexpected reason! {0}'.format(e))
-            print('JSON body not valid for unexpected reason! {0}'.format(e))
+            print('Body not valid for unexpected reason! {0}'.format(e))
+
+    if decoded_body is not None:
+        store_event(decoded_body)
+
+def ingest_worker():
+    '''
+    Ingest thread: process queued bodies until the collector exits.
+    '''
+    while True:
+        body, validator, decode, queued = ingest_queue.get()
+        metrics.queue_wait.observe(time.time() - queued)
+        try:
+            ingest(body, validator, decode)
+        except Exception as e:
+            logger.error('Failed to process event: {0}'.format(e))
+            logger.error(traceback.format_exc())
+        count_ingest('processed')
+        ingest_queue.task_done()
+
+def ingest_monitor(interval):
+    '''
+    Record the ingest queue depth, the events accepted, rejected and
+    processed, the bytes received and inflated from gzip bodies and the
+    time spent inflating them, and the events published to Kafka, in
+    influxdb every interval seconds.
+    '''
+    while True:
+        time.sleep(interval)
+        send_to_influxdb('collector',
+                         'collector,system=ves-collector,worker={5} '
+                         'queueDepth={0},queueSize={1},accepted={2},'
+                         'rejected={3},processed={4},gzipBodies={6},'
+                         'wireBytes={7},inflatedBytes={8},'
+                         'inflateMs={9:.1f},cborBodies={10},'
+                         'kafkaPublished={11},kafkaFailed={12},'
+                         'duplicates={13}'.format(
+                                                 ingest_queue.qsize(),
+                                                 ingest_queue.maxsize,
+                                                 ingest_stats['accepted'],
+                                                 ingest_stats['rejected'],
+                                                 ingest_stats['processed'],
+                                                 worker_id,
+                                                 ingest_stats['gzipBodies'],
+                                                 ingest_stats['wireBytes'],
+                                                 ingest_stats['inflatedBytes'],
+                                                 ingest_stats['inflateMs'],
+                                                 ingest_stats['cborBodies'],
+                                                 ingest_stats['kafkaPublished'],
+                                                 ingest_stats['kafkaFailed'],
+                                                 ingest_stats['duplicates']))
+
+def metrics_listener(environ, start_response):
+    '''
+    Handler for /metrics: this process's self-metrics for Prometheus.  There
+    is no authentication on this interface.  With several processes each
+    scrape reaches one of them, so give each its own metrics_port as well.
+    '''
+    start_response('200 OK',
+                   [('Content-type', 'text/plain; version=0.0.4')])
+    return [metrics.render()]
+
+class OverloadController(object):
+    '''
+    Closed-loop throttling of the noisiest agents when the collector is
+    overloaded.
+
+    Every event is charged to a token bucket for its sourceId, refilled at
+    source_rate events a second up to burst; events beyond that are counted
+    as excess.  Every interval seconds the controller looks at the ingest
+    queue, events rejected since last time and, if cpu_budget is set, the
+    CPU this process used in cores.  If the queue is at least high_water
+    full, or events were rejected, or the CPU budget was exceeded, it
+    queues throttle commands for up to throttle_count sources, those with
+    excess events and the most events in the interval, that aren't already
+    throttled: a measurementIntervalChange to throttled_interval and, if
+    suppress_fields are given, a throttlingSpecification suppressing those
+    measurementsForVfScaling fields.  Once the queue has stayed at or below
+    low_water for hold seconds, throttled sources are restored to
+    normal_interval with the suppression lifted.
+    '''
+
+    def __init__(self, source_rate, burst, high_water, low_water, cpu_budget,
+                 interval, throttle_count, hold, throttled_interval,
+                 normal_interval, suppress_fields, max_sources=100000):
+        self.source_rate = float(source_rate)
+        self.burst = float(max(burst, 1))
+        self.high_water = high_water
+        self.low_water = low_water
+        self.cpu_budget = cpu_budget
+        self.interval = interval
+        self.throttle_count = throttle_count
+        self.hold = hold
+        self.throttled_interval = throttled_interval
+        self.normal_interval = normal_interval
+        self.suppress_fields = suppress_fields
+        self.max_sources = max_sources
+        self.lock = threading.Lock()
+        self.buckets = {}
+        self.events = {}
+        self.excess = {}
+        self.throttled = {}
+        self.calm_since = None
+        self.last_rejected = 0
+        self.last_cpu = sum(os.times()[:2])
+        self.last_tick = time.time()
+
+        self.throttles = 0
+        self.restores = 0
+        self.overloaded = False
+
+        self.thread = threading.Thread(target=self.run,
+                                       name='overload-controller')
+        self.thread.daemon = True
+        self.thread.start()
+
+    def observe(self, source_id, count=1):
+        '''
+        Charge count events to the source's token bucket.
+        '''
+        if source_id is None:
+            return
+        now = time.time()
+        self.lock.acquire()
+        try:
+            bucket = self.buckets.get(source_id)
+            if bucket is None:
+                if len(self.buckets) >= self.max_sources:
+                    return
+                bucket = self.buckets[source_id] = [self.burst, now]
+            bucket[0] = min(self.burst,
+                            bucket[0] + (now - bucket[1]) * self.source_rate)
+            bucket[1] = now
+            bucket[0] -= count
+            if bucket[0] < 0:
+                self.excess[source_id] = (self.excess.get(source_id, 0) +
+                                          min(count, -bucket[0]))
+                bucket[0] = 0.0
+            self.events[source_id] = self.events.get(source_id, 0) + count
+        finally:
+            self.lock.release()
+
+    def commands(self, interval, suppress):
+        commands = [{'command': {'commandType': 'measurementIntervalChange',
+                                 'measurementInterval': interval}}]
+        if self.suppress_fields:
+            specification = {'eventDomain': 'measurementsForVfScaling'}
+            if suppress:
+                specification['suppressedFieldNames'] = self.suppress_fields
+            commands.append({'command': {
+                                'commandType': 'throttlingSpecification',
+                                'eventDomainThrottleSpecification':
+                                    specification}})
+        return {'commandList': commands}
+
+    def run(self):
+        while True:
+            time.sleep(self.interval)
+            try:
+                self.tick()
+            except Exception as e:
+                logger.error('Overload controller failed: {0}'.format(e))
+
+    def tick(self):
+        now = time.time()
+        cpu = sum(os.times()[:2])
+        cores = (cpu - self.last_cpu) / max(now - self.last_tick, 0.001)
+        self.last_cpu = cpu
+        self.last_tick = now
+        total_rejected = ingest_stats['rejected']
+        rejected = total_rejected - self.last_rejected
+        self.last_rejected = total_rejected
+        fill = float(ingest_queue.qsize()) / max(ingest_queue.maxsize, 1)
+
+        self.lock.acquire()
+        try:
+            events = self.events
+            excess = self.excess
+            self.events = {}
+            self.excess = {}
+            for source_id in list(self.buckets.keys()):
+                if now - self.buckets[source_id][1] > 600:
+                    del self.buckets[source_id]
+        finally:
+            self.lock.release()
+
+        self.overloaded = (fill >= self.high_water or rejected > 0 or
+                           (self.cpu_budget > 0 and cores > self.cpu_budget))
+        if self.overloaded:
+            self.calm_since = None
+            noisiest = sorted((source_id for source_id in excess
+                               if source_id not in self.throttled),
+                              key=lambda source_id: -events.get(source_id, 0))
+            noisiest = noisiest[:self.throttle_count]
+            for source_id in noisiest:
+                command_store.put(self.commands(self.throttled_interval, True),
+                                  [source_id])
+                self.throttled[source_id] = now
+                self.throttles += 1
+            if noisiest:
+                logger.warn('Overloaded (queue {0:.0%}, {1} rejected, '
+                            '{2:.2f} cores), throttling {3}'.format(
+                                  fill, rejected, cores, ', '.join(noisiest)))
+        elif fill <= self.low_water:
+            if self.calm_since is None:
+                self.calm_since = now
+            if self.throttled and now - self.calm_since >= self.hold:
+                restored = sorted(self.throttled.keys())
+                for source_id in restored:
+                    command_store.put(self.commands(self.normal_interval,
+                                                    False),
+                                      [source_id])
+                    self.restores += 1
+                self.throttled = {}
+                logger.info('Load is down, restoring {0}'.format(
+                                                         ', '.join(restored)))
+        else:
+            self.calm_since = None
+
+class StreamSubscriber(object):
+    '''
+    One /eventStream subscriber: what it asked for and its buffer.
+    '''
+
+    def __init__(self, kind, domains, sources, measurements, buffer_size):
+        self.kind = kind
+        self.domains = set(domains)
+        self.sources = set(sources)
+        self.measurements = set(measurements)
+        self.queue = Queue.Queue(buffer_size)
+        self.dropped = False
+
+class EventStream(object):
+    '''
+    Fan-out of saved events, their influxdb points or rollups to /eventStream
+    subscribers, filtered by domain, source and measurement.
+
+    Publishing never blocks ingest: each item is offered to each matching
+    subscriber's bounded buffer, and a subscriber whose buffer is full is
+    too slow to keep up and is dropped.  Items are only encoded if some
+    subscriber wants them, and once however many do, so with no subscribers
+    publishing is a check of an empty tuple.
+    '''
+
+    KINDS = ('events', 'points', 'rollups')
+
+    def __init__(self, max_subscribers, buffer_size):
+        self.max_subscribers = max_subscribers
+        self.buffer_size = buffer_size
+        self.lock = threading.Lock()
+        self.subscribers = ()
+
+        self.published = 0
+        self.dropped = 0
+
+    def subscribe(self, kind, domains, sources, measurements):
+        '''
+        A new subscriber, or None if there are already max_subscribers.
+        '''
+        subscriber = StreamSubscriber(kind, domains, sources, measurements,
+                                      self.buffer_size)
+        self.lock.acquire()
+        try:
+            if len(self.subscribers) >= self.max_subscribers:
+                return None
+            self.subscribers = self.subscribers + (subscriber,)
+        finally:
+            self.lock.release()
+        return subscriber
+
+    def unsubscribe(self, subscriber):
+        self.lock.acquire()
+        try:
+            self.subscribers = tuple(s for s in self.subscribers
+                                     if s is not subscriber)
+        finally:
+            self.lock.release()
+
+    def offer(self, subscriber, kind, data):
+        try:
+            subscriber.queue.put_nowait((kind, data))
+            self.published += 1
+        except Queue.Full:
+            if not subscriber.dropped:
+                subscriber.dropped = True
+                self.dropped += 1
+                self.unsubscribe(subscriber)
+                logger.warn('Dropped a slow {0} stream subscriber'.format(
+                                                             subscriber.kind))
+
+    def publish_event(self, jobj):
+        subscribers = [s for s in self.subscribers if s.kind == 'events']
+        if not subscribers:
+            return
+        header = jobj['event']['commonEventHeader']
+        domain = header.get('domain')
+        names = set((header.get('sourceName'), header.get('sourceId')))
+        data = None
+        for subscriber in subscribers:
+            if subscriber.domains and domain not in subscriber.domains:
+                continue
+            if subscriber.sources and not (names & subscriber.sources):
+                continue
+            if data is None:
+                data = json.dumps(jobj['event'])
+            self.offer(subscriber, 'event', data)
+
+    def publish_points(self, lines, kind='points', window=None):
+        subscribers = [s for s in self.subscribers if s.kind == kind]
+        if not subscribers:
+            return
+        for line in lines:
+            point = parse_point(line)
+            if point is None:
+                continue
+            if window is not None:
+                point['window'] = window
+            data = None
+            for subscriber in subscribers:
+                if subscriber.measurements and \
+                   point['measurement'] not in subscriber.measurements:
+                    continue
+                if subscriber.sources and \
+                   point['tags'].get('system') not in subscriber.sources:
+                    continue
+                if data is None:
+                    data = json.dumps(point)
+                self.offer(subscriber, kind[:-1], data)
+
+POINT_FIELD = re.compile(r'((?:[^,=\\]|\\.)+)=("(?:[^"\\]|\\.)*"|[^,]*)')
+
+def parse_point(line):
+    '''
+    A line protocol point as a dict of measurement, tags, fields and
+    timestamp, or None if it can't be parsed.
+    '''
+    parts = re.split(r'(?<!\\) ', line.strip(), 1)
+    if len(parts) != 2:
+        return None
+    head, rest = parts
+    parts = re.split(r'(?<!\\),', head)
+    tags = {}
+    for tag in parts[1:]:
+        key, _, value = tag.partition('=')
+        tags[key.replace('\\', '')] = value.replace('\\', '')
+    fields_text, _, timestamp = rest.rpartition(' ')
+    if not timestamp.isdigit():
+        fields_text, timestamp = rest, None
+    fields = {}
+    for key, value in POINT_FIELD.findall(fields_text):
+        if value.startswith('"'):
+            fields[key] = value[1:-1].replace('\\"', '"')
+            continue
+        try:
+            fields[key] = float(value.rstrip('i'))
+        except ValueError:
+            fields[key] = value
+    if not fields:
+        return None
+    return {'measurement': parts[0].replace('\\', ''),
+            'tags': tags,
+            'fields': fields,
+            'timestamp': int(timestamp) if timestamp else None}
+
+class ThreadingWSGIServer(SocketServer.ThreadingMixIn, WSGIServer):
+    '''
+    WSGI server handling each request on its own thread, so one slow agent
+    connection doesn't hold up the others.
+    '''
+    daemon_threads = True
+
+class ReusePortWSGIServer(ThreadingWSGIServer):
+    '''
+    Threaded WSGI server whose listening socket is bound with SO_REUSEPORT,
+    so several collector processes can share the port and have the kernel
+    spread connections between them.
+    '''
+    def server_bind(self):
+        self.socket.setsockopt(socket.SOL_SOCKET,
+                               getattr(socket, 'SO_REUSEPORT', 15),
+                               1)
+        ThreadingWSGIServer.server_bind(self)
+
+def serve(worker, port, dispatcher, server_class, influx_url, batch_points,
+          batch_ms, queue_size, workers, stats_interval, kafka_config=None,
+          metrics_port=0, spool_config=None, rollup_config=None,
+          overload_config=None):
+    '''
+    Start the influxdb writer, Kafka sink if configured, and ingest workers,
+    then serve the collector's URLs on the port until interrupted.  Runs once
+    in each collector process.
+    '''
+    global worker_id
+    global influx_writer
+    global kafka_sink
+    global rollups
+    global overload_controller
+    global ingest_queue
+    worker_id = worker
 
     #--------------------------------------------------------------------------
-    # See whether the user authenticated themselves correctly.
+    # Start the influxdb writer and Kafka producer before any events can
+    # arrive.  The producer is made here, not in main, as it can't be shared
+    # across a fork.
     #--------------------------------------------------------------------------
-    if (credentials == (vel_username + ':' + vel_password)):
-        logger.debug('Authenticated OK')
-#        print('Authenticated OK')
+    influx_writer = InfluxWriter(influx_url, batch_points, batch_ms / 1000.0,
+                                 spool=make_spool(spool_config,
+                                                  'worker-{0}'.format(worker)))
+    if kafka_config is not None:
+        kafka_sink = KafkaSink(**kafka_config)
+    else:
+        rollups = make_rollups(rollup_config, influx_url, batch_points,
+                               batch_ms, spool_config,
+                               'worker-{0}'.format(worker), worker)
 
-        #----------------------------------------------------------------------
-        # Respond to the caller. If we have a pending commandList from the
-        # testControl API, send it in response.
-        #----------------------------------------------------------------------
-        global pending_command_list
-        if pending_command_list is not None:
-            start_response('202 Accepted',
-                           [('Content-type', 'application/json')])
-            response = pending_command_list
-            pending_command_list = None
-
-            print('\n'+ '='*80)
-            print('Sending pending commandList in the response:\n'
-                  '{0}'.format(json.dumps(response,
-                                          sort_keys=True,
-                                          indent=4,
-                                          separators=(',', ': '))))
-            print('='*80 + '\n')
-            yield json.dumps(response)
-        else:
-            start_response('202 Accepted', [])
-            yield ''
+    #--------------------------------------------------------------------------
+    # Start the ingest workers, which take events from the listener.
+    #--------------------------------------------------------------------------
+    ingest_queue = Queue.Queue(queue_size)
+    for i in range(workers):
+        thread = threading.Thread(target=ingest_worker,
+                                  name='ingest-{0}'.format(i))
+        thread.daemon = True
+        thread.start()
+    if overload_config is not None:
+        overload_controller = OverloadController(**overload_config)
+    if stats_interval > 0:
+        thread = threading.Thread(target=ingest_monitor,
+                                  args=(stats_interval,),
+                                  name='ingest-monitor')
+        thread.daemon = True
+        thread.start()
+
+    #--------------------------------------------------------------------------
+    # Serve this process's /metrics on a port of its own too, if configured.
+    #--------------------------------------------------------------------------
+    if metrics_port > 0:
+        metrics_dispatcher = PathDispatcher()
+        metrics_dispatcher.register('GET', '/metrics', metrics_listener)
+        metrics_httpd = make_server('', metrics_port + worker,
+                                    metrics_dispatcher,
+                                    server_class=ThreadingWSGIServer)
+        thread = threading.Thread(target=metrics_httpd.serve_forever,
+                                  name='metrics')
+        thread.daemon = True
+        thread.start()
+
+    httpd = make_server('', port, dispatcher, server_class=server_class)
+    print('Worker {0} serving on port {1}...'.format(worker, port))
+    try:
+        httpd.serve_forever()
+    finally:
+        if kafka_sink is not None:
+            kafka_sink.close()
+        if rollups is not None:
+            rollups.close()
+        influx_writer.close()
+
+def make_spool(spool_config, name):
+    '''
+    The influxdb spool for one process, in its own subdirectory, or None.
+    '''
+    if spool_config is None:
+        return None
+    return InfluxSpool(os.path.join(spool_config['directory'], name),
+                       spool_config['segment_bytes'],
+                       spool_config['max_bytes'],
+                       spool_config['replay_rate'])
+
+def serve_process(*args):
+    '''
+    Entry point of each collector process when there are several.
+    '''
+    try:
+        serve(*args)
+    except KeyboardInterrupt:
+        pass
+
+#--------------------------------------------------------------------------
+# Batched influxdb line-protocol writer
+#--------------------------------------------------------------------------
+class InfluxWriter:
+  '''
+  Accumulates line-protocol points and writes them to influxdb, over one
+  keep-alive session, in batches of up to max_points at most every
+  max_delay seconds.  Flushes are done on a background thread so save_event
+  never waits on influxdb while there is room for its points.
+
+  Points carry their event time, so they can be held and reordered safely.
+  The reorder buffer holds each series' points until the first of them has
+  waited max_delay seconds, so any point for the series arriving within
+  that hold is written with them, and the points written in each flush are
+  sorted by series and time.  Once a batch's worth is waiting, the series
+  held longest are written without finishing their hold.  Points older
+  than the last written for their series (e.g. replayed after an agent
+  outage) still land at their own time, and are counted as late.
+
+  The buffer holds at most max_pending points, by default ten batches.  A
+  write that would overfill it waits for a flush to make room, so while
+  influxdb is slow the ingest workers slow down with it and the ingest
+  queue, rather than the buffer, takes up the backlog.
+  '''
+
+  def __init__(self, url, max_points, max_delay, report_interval=60,
+               max_series=100000, spool=None, max_pending=None):
+    self.url = url
+    self.spool = spool
+    self.max_points = max_points
+    self.max_delay = max_delay
+    self.max_pending = max_pending or 10 * max_points
+    self.report_interval = report_interval
+    self.max_series = max_series
+    self.last_written = {}
+    self.late = 0
+    self.stalls = 0
+    self.session = requests.Session()
+    self.cond = threading.Condition()
+    self.pending = collections.OrderedDict()
+    self.count = 0
+    self.last_flush = 0
+    self.flush_now = False
+    self.closed = False
+
+    self.points = 0
+    self.flushes = 0
+    self.failures = 0
+    self.flush_time = 0.0
+    self.flush_time_max = 0.0
+    self.last_report = time.time()
+
+    self.thread = threading.Thread(target=self.run, name='influx-writer')
+    self.thread.daemon = True
+    self.thread.start()
+    if self.spool is not None:
+      self.spool.start(self)
+
+  def wait_for_room(self, count):
+    '''
+    Wait until count more points fit in the buffer, or it is empty.  Called
+    with the lock held.
+    '''
+    if self.count and self.count + count > self.max_pending:
+      self.stalls += 1
+      while (self.count and not self.closed and
+             self.count + count > self.max_pending):
+        self.cond.wait()
+
+  def hold(self, now, line):
+    '''
+    Add a point to its series in the buffer.  Called with the lock held.
+    '''
+    series = line.partition(' ')[0]
+    held = self.pending.get(series)
+    if held is None:
+      self.pending[series] = (now, [line])
     else:
-        logger.warn('Failed to authenticate OK; creds: ' +  credentials)
-        print('Failed to authenticate agent credentials: ', credentials, 
-		  'against expected ', vel_username, ':', vel_password)
+      held[1].append(line)
+    self.count += 1
 
-        #----------------------------------------------------------------------
-        # Respond to the caller.
-        #----------------------------------------------------------------------
-        start_response('401 Unauthorized', [ ('Content-type',
-                                              'application/json')])
-        req_error = { 'requestError': {
-                        'policyException': {
-                            'messageId': 'POL0001',
-                            'text': 'Failed to authenticate'
-                            }
-                        }
-                    }
-        yield json.dumps(req_error)
+  def write(self, line):
+    self.cond.acquire()
+    try:
+      self.wait_for_room(1)
+      self.hold(time.time(), line)
+      if self.count == 1 or self.count >= self.max_points:
+        self.cond.notify_all()
+    finally:
+      self.cond.release()
+
+  def write_batch(self, lines):
+    '''
+    Queue a batch of points and have them flushed now, together with
+    anything else pending, rather than held.
+    '''
+    self.cond.acquire()
+    try:
+      self.wait_for_room(len(lines))
+      now = time.time()
+      for line in lines:
+        self.hold(now, line)
+      self.flush_now = True
+      self.cond.notify_all()
+    finally:
+      self.cond.release()
+
+  def close(self):
+    self.cond.acquire()
+    self.closed = True
+    self.cond.notify_all()
+    self.cond.release()
+    self.thread.join(self.max_delay + 10)
+    if self.spool is not None:
+      self.spool.close()
+
+  def take(self):
+    '''
+    Remove and return the points due to be written: all of them if asked
+    to flush now or closing, otherwise those of every series held for
+    max_delay, and at least a batch's worth if that many are waiting.
+    Called with the lock held.
+    '''
+    everything = self.flush_now or self.closed
+    forced = self.count >= self.max_points
+    held_until = time.time() - self.max_delay
+    lines = []
+    while self.pending:
+      series = next(iter(self.pending))
+      first, series_lines = self.pending[series]
+      if (not everything and first > held_until and
+          not (forced and len(lines) < self.max_points)):
+        break
+      del self.pending[series]
+      lines.extend(series_lines)
+    self.count -= len(lines)
+    self.flush_now = False
+    self.cond.notify_all()
+    return lines
+
+  def run(self):
+    while True:
+      self.cond.acquire()
+      try:
+        while not self.closed:
+          if self.pending:
+            first = self.pending[next(iter(self.pending))][0]
+            remaining = max(first, self.last_flush) + self.max_delay - \
+                        time.time()
+            if (remaining <= 0 or self.flush_now or
+                self.count >= self.max_points):
+              break
+            self.cond.wait(remaining)
+          else:
+            self.cond.wait(self.report_interval)
+            if not self.pending:
+              break
+        lines = self.take()
+        self.last_flush = time.time()
+        closed = self.closed and not self.pending
+      finally:
+        self.cond.release()
+
+      lines = self.reorder(lines)
+      for i in range(0, len(lines), self.max_points):
+        self.flush(lines[i:i + self.max_points])
+      self.report()
+      if closed:
+        return
+
+  def reorder(self, lines):
+    '''
+    Sort points by series, then by timestamp, and count those older than
+    the newest already written for their series.  Points without a
+    timestamp are stamped by influxdb on arrival, so keep their place at
+    the end.
+    '''
+    keyed = []
+    for line in lines:
+      series, _, rest = line.partition(' ')
+      fields, _, timestamp = rest.rpartition(' ')
+      if fields and timestamp.isdigit():
+        keyed.append((series, int(timestamp), line))
+      else:
+        keyed.append((None, 0, line))
+    keyed.sort(key=lambda point: (point[0] is None, point[0], point[1]))
+
+    if len(self.last_written) > self.max_series:
+      self.last_written.clear()
+    for series, timestamp, line in keyed:
+      if series is None:
+        continue
+      if timestamp < self.last_written.get(series, 0):
+        self.late += 1
+      else:
+        self.last_written[series] = timestamp
+    return [point[2] for point in keyed]
+
+  def post(self, lines):
+    '''
+    Write points to influxdb, returning whether it took them.
+    '''
+    start = time.time()
+    try:
+      r = self.session.post(self.url, data='\n'.join(lines),
+                            headers={'Content-Type': 'text/plain'},
+                            timeout=10)
+      status_code = r.status_code
+      if status_code != 204:
+        logger.error('Influxdb write failed, return code {0}: {1}'.format(
+                                                         status_code, r.text))
+    except requests.exceptions.RequestException as e:
+      status_code = None
+      logger.error('Influxdb write failed: {0}'.format(e))
+    metrics.influxdb_write.observe(time.time() - start)
+    return status_code == 204
+
+  def flush(self, lines):
+    '''
+    Write points to influxdb, returning whether it took them.  With a spool
+    they are on disk while in flight and stay there if the write fails, to
+    be replayed later.
+    '''
+    start = time.time()
+    if self.spool is not None:
+      self.spool.begin(lines)
+    ok = self.post(lines)
+    if self.spool is not None:
+      self.spool.end(ok)
+    elapsed = time.time() - start
+
+    self.flushes += 1
+    self.points += len(lines)
+    self.flush_time += elapsed
+    self.flush_time_max = max(self.flush_time_max, elapsed)
+    if not ok:
+      self.failures += 1
+      print('*** Influxdb save of {0} points failed{1} ***'.format(
+                len(lines), ', spooled' if self.spool is not None else ''))
+    logger.debug('Flushed {0} points to influxdb in {1:.1f} ms'.format(
+                                                  len(lines), elapsed * 1000))
+    return ok
+
+  def report(self):
+    now = time.time()
+    if now - self.last_report < self.report_interval or self.flushes == 0:
+      return
+    self.last_report = now
+    logger.info('Influxdb writer: {0} points in {1} flushes ({2:.1f} '
+                'points/flush), {3} failed, flush latency mean {4:.1f} ms '
+                'max {5:.1f} ms, {6} late points, {7} stalls on a full '
+                'buffer'.format(
+                                        self.points,
+                                        self.flushes,
+                                        float(self.points) / self.flushes,
+                                        self.failures,
+                                        self.flush_time * 1000 / self.flushes,
+                                        self.flush_time_max * 1000,
+                                        self.late,
+                                        self.stalls))
+    self.flush_time_max = 0.0
+
+#--------------------------------------------------------------------------
+# On-disk spool of points influxdb didn't take
+#--------------------------------------------------------------------------
+class InfluxSpool:
+  '''
+  Write-ahead buffer, in a directory of its own, for points the
+  InfluxWriter couldn't write.
+
+  Each flush is first written to inflight.lp and removed once influxdb has
+  taken it, so a batch being written when the collector dies is still on
+  disk at the next start.  A failed batch is appended to the newest
+  segment-<ms>.lp file; segments are closed at segment_bytes, and the
+  oldest are dropped to keep the spool within max_bytes.  A replay thread
+  writes segments back, oldest first, at no more than replay_rate points a
+  second, so influxdb isn't flooded just as it comes back.  While influxdb
+  is still failing it backs off, until a live write succeeds.  Points carry
+  their event time, so a batch replayed twice overwrites itself rather than
+  duplicating.
+  '''
+
+  def __init__(self, directory, segment_bytes, max_bytes, replay_rate):
+    self.directory = directory
+    self.segment_bytes = segment_bytes
+    self.max_bytes = max_bytes
+    self.replay_rate = max(1, replay_rate)
+    self.lock = threading.Lock()
+    self.wake = threading.Event()
+    self.resume = threading.Event()
+    self.closed = False
+    self.writer = None
+    self.thread = None
+    self.current = None
+    self.sequence = 0
+
+    self.replayed = 0
+    self.dropped = 0
+
+    if not os.path.isdir(directory):
+      os.makedirs(directory)
+    inflight = self.path('inflight.lp')
+    if os.path.exists(inflight):
+      os.rename(inflight, self.path(self.segment_name()))
+    logger.info('Influxdb spool {0}: {1} segments, {2} bytes'.format(
+                                directory, len(self.segments()), self.size()))
+
+  def path(self, name):
+    return os.path.join(self.directory, name)
+
+  def segment_name(self):
+    self.sequence = max(self.sequence + 1, int(time.time() * 1000))
+    return 'segment-{0:015d}.lp'.format(self.sequence)
+
+  def segments(self):
+    return sorted(name for name in os.listdir(self.directory)
+                  if name.startswith('segment-'))
+
+  def size(self):
+    self.lock.acquire()
+    try:
+      return sum(os.path.getsize(self.path(name))
+                 for name in self.segments())
+    finally:
+      self.lock.release()
+
+  def age(self):
+    '''
+    Seconds since the oldest spooled segment was started, or 0.
+    '''
+    self.lock.acquire()
+    try:
+      segments = self.segments()
+    finally:
+      self.lock.release()
+    if not segments:
+      return 0.0
+    return max(0.0, time.time() - int(segments[0][8:-3]) / 1000.0)
+
+  def start(self, writer):
+    self.writer = writer
+    self.thread = threading.Thread(target=self.replay, name='influx-replay')
+    self.thread.daemon = True
+    self.thread.start()
+
+  def close(self):
+    self.closed = True
+    self.wake.set()
+    self.resume.set()
+    if self.thread is not None:
+      self.thread.join(10)
+
+  def begin(self, lines):
+    with open(self.path('inflight.lp'), 'wb') as f:
+      f.write('\n'.join(lines) + '\n')
+
+  def end(self, ok):
+    inflight = self.path('inflight.lp')
+    if ok:
+      os.remove(inflight)
+      self.resume.set()
+      return
+    self.lock.acquire()
+    try:
+      if self.current is None:
+        self.current = self.segment_name()
+      with open(self.path(self.current), 'ab') as segment:
+        with open(inflight, 'rb') as f:
+          segment.write(f.read())
+      os.remove(inflight)
+      if os.path.getsize(self.path(self.current)) >= self.segment_bytes:
+        self.current = None
+      self.trim()
+    finally:
+      self.lock.release()
+    self.wake.set()
+
+  def trim(self):
+    segments = self.segments()
+    size = sum(os.path.getsize(self.path(name)) for name in segments)
+    while size > self.max_bytes and len(segments) > 1:
+      oldest = self.path(segments.pop(0))
+      size -= os.path.getsize(oldest)
+      with open(oldest, 'rb') as f:
+        dropped = sum(1 for line in f if line.strip())
+      os.remove(oldest)
+      self.dropped += dropped
+      logger.error('Influxdb spool full, dropped {0} points'.format(dropped))
+
+  def replay(self):
+    backoff = 1
+    while not self.closed:
+      self.lock.acquire()
+      try:
+        segments = self.segments()
+        if segments and segments[0] == self.current:
+          self.current = None
+      finally:
+        self.lock.release()
+      if not segments:
+        self.wake.wait(5)
+        self.wake.clear()
+        continue
+
+      name = self.path(segments[0])
+      with open(name, 'rb') as f:
+        lines = [line for line in f.read().split('\n') if line]
+      sent = 0
+      while sent < len(lines) and not self.closed:
+        chunk = lines[sent:sent + self.writer.max_points]
+        start = time.time()
+        if not self.writer.post(chunk):
+          break
+        sent += len(chunk)
+        self.replayed += len(chunk)
+        time.sleep(max(0.0, len(chunk) / float(self.replay_rate) -
+                            (time.time() - start)))
+
+      self.lock.acquire()
+      try:
+        if not os.path.exists(name):
+          pass
+        elif sent == len(lines):
+          os.remove(name)
+        elif sent > 0:
+          with open(name, 'wb') as f:
+            f.write('\n'.join(lines[sent:]) + '\n')
+      finally:
+        self.lock.release()
+
+      if sent == len(lines):
+        logger.info('Replayed {0} spooled points'.format(sent))
+        backoff = 1
+      else:
+        logger.warn('Influxdb spool replay failed, retrying in {0} s'.format(
+                                                                     backoff))
+        self.resume.clear()
+        self.resume.wait(backoff)
+        backoff = 1 if self.resume.is_set() else min(backoff * 2, 60)
+
+#--------------------------------------------------------------------------
+# Streaming rollups of the points saved
+#--------------------------------------------------------------------------
+class Rollups:
+  '''
+  Per-series min, max, sum, count, mean and last of every numeric field,
+  over windows of event time (by default 1 and 5 minutes), kept
+  incrementally as points are saved.  A window's rollups are written once
+  it has ended and a further grace seconds have passed, to the same
+  measurement and tags as the raw points but in the retention policy for
+  the window, e.g. "ves_1m"."cpuUsage" with fields cpuUsageUser_min,
+  cpuUsageUser_max, cpuUsageUser_sum, cpuUsageUser_count, cpuUsageUser_mean
+  and cpuUsageUser_last.  The sum and count let rollups from several
+  workers, or of several windows, be combined into a correct mean.
+
+  Windows close by the collector's clock, not by the event times seen, so
+  points more than grace seconds older than now when saved, such as
+  events an agent buffered through an outage or a Kafka consumer's
+  backlog, are left out of the rollups and counted as late.  Points
+  replayed from a spool were rolled up when first saved.
+  '''
+
+  def __init__(self, writers, grace, tags='', max_buckets=100000):
+    self.writers = writers
+    self.windows = sorted(writers.keys())
+    self.grace = grace
+    self.tags = tags
+    self.max_buckets = max_buckets
+    self.lock = threading.Lock()
+    self.buckets = {}
+    self.closed_until = dict((window, 0) for window in self.windows)
+
+    self.emitted = 0
+    self.late = 0
+    self.dropped = 0
+
+    self.thread = threading.Thread(target=self.run, name='rollups')
+    self.thread.daemon = True
+    self.thread.start()
+
+  def add(self, line):
+    series, _, rest = line.partition(' ')
+    fields, _, timestamp = rest.rpartition(' ')
+    if not fields or not timestamp.isdigit():
+      return
+    timestamp = int(timestamp)
+    values = []
+    for field in fields.split(','):
+      name, _, value = field.partition('=')
+      try:
+        values.append((name, float(value)))
+      except ValueError:
+        pass
+    if not values:
+      return
+
+    self.lock.acquire()
+    try:
+      for window in self.windows:
+        start = timestamp - timestamp % (window * 1000000)
+        if start < self.closed_until[window]:
+          self.late += 1
+          continue
+        key = (window, series, start)
+        bucket = self.buckets.get(key)
+        if bucket is None:
+          if len(self.buckets) >= self.max_buckets:
+            self.dropped += 1
+            continue
+          bucket = self.buckets[key] = {}
+        for name, value in values:
+          aggregate = bucket.get(name)
+          if aggregate is None:
+            bucket[name] = [value, value, value, 1, timestamp, value]
+            continue
+          aggregate[0] = min(aggregate[0], value)
+          aggregate[1] = max(aggregate[1], value)
+          aggregate[2] += value
+          aggregate[3] += 1
+          if timestamp >= aggregate[4]:
+            aggregate[4] = timestamp
+            aggregate[5] = value
+    finally:
+      self.lock.release()
+
+  def run(self):
+    while True:
+      time.sleep(5)
+      self.emit(time.time() - self.grace)
+
+  def emit(self, until):
+    '''
+    Write the rollups of every window that ended before until, in seconds.
+    '''
+    closed = []
+    self.lock.acquire()
+    try:
+      for window in self.windows:
+        watermark = int(until) // window * window * 1000000
+        self.closed_until[window] = max(self.closed_until[window], watermark)
+      for key in self.buckets.keys():
+        window, series, start = key
+        if start < self.closed_until[window]:
+          closed.append((key, self.buckets.pop(key)))
+    finally:
+      self.lock.release()
+
+    lines = dict((window, []) for window in self.windows)
+    for (window, series, start), bucket in sorted(closed):
+      fields = []
+      for name, aggregate in sorted(bucket.items()):
+        fields.append('{0}_min={1!r},{0}_max={2!r},{0}_sum={3!r},'
+                      '{0}_count={4}i,{0}_mean={5!r},'
+                      '{0}_last={6!r}'.format(name,
+                                              aggregate[0],
+                                              aggregate[1],
+                                              aggregate[2],
+                                              aggregate[3],
+                                              aggregate[2] / aggregate[3],
+                                              aggregate[5]))
+      lines[window].append('{0}{1} {2} {3}'.format(series, self.tags,
+                                                  ','.join(fields), start))
+    for window in self.windows:
+      if lines[window]:
+        self.emitted += len(lines[window])
+        self.writers[window].write_batch(lines[window])
+        if event_stream is not None:
+          event_stream.publish_points(lines[window], 'rollups',
+                                      rollup_policy(window))
+
+  def close(self):
+    '''
+    Write what has been gathered so far, for every window, then close the
+    writers.
+    '''
+    self.emit(time.time() + max(self.windows))
+    for writer in self.writers.values():
+      writer.close()
+
+def rollup_policy(window):
+  '''
+  Name of the retention policy rollups over window seconds are written to.
+  '''
+  if window % 60 == 0:
+    return 'ves_{0}m'.format(window // 60)
+  return 'ves_{0}s'.format(window)
+
+def make_rollups(rollup_config, influx_url, batch_points, batch_ms,
+                 spool_config, name, worker=None):
+  '''
+  Rollups for one process, with a writer and spool for each retention
+  policy, or None.  Several collector processes may each see some of a
+  series' points, so their rollups are told apart by a worker tag; the
+  overall mean is sum(_sum) / sum(_count) across workers.
+  '''
+  if rollup_config is None:
+    return None
+  writers = {}
+  for window in rollup_config['windows']:
+    policy = rollup_policy(window)
+    writers[window] = InfluxWriter(influx_url + '&rp=' + policy,
+                                   batch_points, batch_ms / 1000.0,
+                                   spool=make_spool(spool_config,
+                                                    name + '-' + policy))
+  tags = ''
+  if rollup_config['per_worker'] and worker is not None:
+    tags = ',worker={0}'.format(worker)
+  return Rollups(writers, rollup_config['grace'], tags)
+
+def create_rollup_policies(influxdb, rollup_config):
+  '''
+  Create the rollups' retention policies, if they don't already exist.
+  '''
+  for window, duration in zip(rollup_config['windows'],
+                              rollup_config['retention']):
+    query = 'CREATE RETENTION POLICY "{0}" ON "veseventsdb" DURATION {1} ' \
+            'REPLICATION 1'.format(rollup_policy(window), duration)
+    try:
+      r = requests.post('http://{0}/query'.format(influxdb),
+                        data={'q': query}, timeout=10)
+      if r.status_code != 200:
+        logger.error('{0} failed, return code {1}: {2}'.format(
+                                                query, r.status_code, r.text))
+    except requests.exceptions.RequestException as e:
+      logger.error('{0} failed: {1}'.format(query, e))
 
-    save_event(body)
+#--------------------------------------------------------------------------
+# Send event to influxdb, at the event's time in microseconds if given
+#--------------------------------------------------------------------------
+def send_to_influxdb(event,pdata,points=None,timestamp=None):
+  if timestamp is not None:
+    pdata = '{} {}'.format(pdata, int(timestamp))
+    if rollups is not None:
+      rollups.add(pdata)
+  logger.debug('Send {} to influxdb at {}: {}'.format(event,influxdb,pdata))
+  if event_stream is not None:
+    event_stream.publish_points([pdata])
+  if points is not None:
+    points.append(pdata)
+  else:
+    influx_writer.write(pdata)
 
 #--------------------------------------------------------------------------
-# Send event to influxdb
+# Kafka sink: validated events published to a topic per domain
 #--------------------------------------------------------------------------
-def send_to_influxdb(event,pdata):
-  url = 'http://{}/write?db=veseventsdb'.format(influxdb)
-  print('Send {} to influxdb at {}: {}'.format(event,influxdb,pdata))
-  r = requests.post(url, data=pdata, headers={'Content-Type': 'text/plain'})
-  print('influxdb return code {}'.format(r.status_code))
-  if r.status_code != 204:
-    print('*** Influxdb save failed, return code {} ***'.format(r.status_code))
+class KafkaSink:
+  '''
+  Publishes each validated event, as JSON, to the Kafka topic for its
+  domain, e.g. ves_measurementsForVfScaling, keyed by sourceName so each
+  source's events stay in order on one partition.  The producer batches,
+  lingers and compresses on its own I/O thread, so publishing only waits
+  if its buffer is full, and then for no longer than max_block_ms.
+  Storage is left to consumers (see kafka_consume).
+  '''
+
+  def __init__(self, servers, topic_prefix, batch_bytes, linger_ms,
+               compression, max_block_ms=1000):
+    self.topic_prefix = topic_prefix
+    self.producer = KafkaProducer(bootstrap_servers=servers.split(','),
+                                  client_id='ves-collector-{0}'.format(
+                                                                  worker_id),
+                                  acks=1,
+                                  batch_size=batch_bytes,
+                                  linger_ms=linger_ms,
+                                  compression_type=compression or None,
+                                  max_block_ms=max_block_ms)
+    logger.info('Publishing events to Kafka at {0}, topics {1}<domain>'.format(
+                                                         servers, topic_prefix))
+
+  def publish(self, jobj):
+    header = jobj['event']['commonEventHeader']
+    topic = self.topic_prefix + header['domain']
+    key = header.get('sourceName', header.get('sourceId', ''))
+    try:
+      future = self.producer.send(topic,
+                                  value=json.dumps(jobj),
+                                  key=key.encode('utf-8'))
+    except KafkaError as e:
+      count_ingest('kafkaFailed')
+      logger.error('Kafka publish to {0} failed: {1}'.format(topic, e))
+      raise
+    future.add_callback(self.published)
+    future.add_errback(self.failed, topic)
+
+  def published(self, metadata):
+    count_ingest('kafkaPublished')
+
+  def failed(self, topic, e):
+    count_ingest('kafkaFailed')
+    logger.error('Kafka publish to {0} failed: {1}'.format(topic, e))
+
+  def close(self):
+    self.producer.flush(10)
+    self.producer.close(10)
+
+class Deduplicator:
+  '''
+  Events seen in the last window to 2 x window seconds, by sourceId (or
+  sourceName), sequence and startEpochMicrosec, so an agent's retry or
+  replay of an event is recognised while a restarted agent reusing its
+  sequence numbers is not.
+
+  Events are remembered in two Bloom filters, the current one and the one
+  before it; the current becomes the previous every window seconds, or
+  sooner if capacity events have been added to it.  Each filter is sized
+  for capacity events at half of fp_rate, so an event wrongly taken for a
+  duplicate is no likelier than fp_rate however many agents there are,
+  and memory is fixed when the collector starts.
+
+  An event is only remembered once it has been stored, so one that fails
+  to store is not taken for a duplicate when the agent retries it.  Two
+  copies of an event being stored at the same moment may both get through.
+  Each collector process has its own filter, so with several processes a
+  retry that reaches a different one is only dropped by the Kafka
+  consumer, if there is one.
+  '''
+
+  def __init__(self, window, capacity, fp_rate):
+    self.window = window
+    self.capacity = capacity
+    self.bits = int(math.ceil(-capacity * math.log(fp_rate / 2.0) /
+                              math.log(2) ** 2))
+    self.hashes = max(1, int(round(self.bits / float(capacity) *
+                                   math.log(2))))
+    self.size = (self.bits + 7) // 8
+    self.lock = threading.Lock()
+    self.current = bytearray(self.size)
+    self.previous = bytearray(self.size)
+    self.rotated = time.time()
+    self.count = 0
+
+    self.duplicates = 0
+    self.early_rotations = 0
+
+  def key(self, jobj):
+    header = jobj['event']['commonEventHeader']
+    if 'sequence' not in header:
+      return None
+    return u'{0}|{1}|{2}'.format(header.get('sourceId') or
+                                 header.get('sourceName', ''),
+                                 header['sequence'],
+                                 header.get('startEpochMicrosec', ''))
+
+  def positions(self, jobj):
+    '''
+    The filter bits for the event, or None if it has no sequence.
+    '''
+    key = self.key(jobj)
+    if key is None:
+      return None
+    h1, h2 = struct.unpack('<QQ', hashlib.md5(key.encode('utf-8')).digest())
+    return [(h1 + i * h2) % self.bits for i in xrange(self.hashes)]
+
+  def rotate(self):
+    '''
+    Start a new filter if the window has ended or the current one is full.
+    Called with the lock held.
+    '''
+    now = time.time()
+    if now - self.rotated >= self.window or self.count >= self.capacity:
+      if self.count >= self.capacity:
+        self.early_rotations += 1
+      self.previous = self.current
+      self.current = bytearray(self.size)
+      self.rotated = now
+      self.count = 0
+
+  def seen(self, jobj):
+    '''
+    Whether the event has been stored before.
+    '''
+    positions = self.positions(jobj)
+    if positions is None:
+      return False
+
+    self.lock.acquire()
+    try:
+      self.rotate()
+      current = self.current
+      previous = self.previous
+      if all(current[p >> 3] & (1 << (p & 7)) for p in positions) or \
+         all(previous[p >> 3] & (1 << (p & 7)) for p in positions):
+        self.duplicates += 1
+        count_ingest('duplicates')
+        return True
+      return False
+    finally:
+      self.lock.release()
+
+  def remember(self, jobj):
+    '''
+    Remember a stored event, so later copies of it are seen.
+    '''
+    positions = self.positions(jobj)
+    if positions is None:
+      return
+
+    self.lock.acquire()
+    try:
+      self.rotate()
+      for p in positions:
+        self.current[p >> 3] |= 1 << (p & 7)
+      self.count += 1
+    finally:
+      self.lock.release()
+
+def store_event(jobj, points=None):
+  '''
+  Hand a validated event to the Kafka sink if there is one, otherwise save
+  it to influxdb or, for a batch, to the points list.  Events already
+  stored are dropped; an event is only remembered as stored once it has
+  been, so if storing it raises, a retry of it is not dropped.  Returns
+  whether the event was stored rather than dropped.
+  '''
+  if deduplicator is not None and deduplicator.seen(jobj):
+    header = jobj['event']['commonEventHeader']
+    logger.info('Dropped duplicate event {0} from {1}'.format(
+                                  header.get('sequence'),
+                                  header.get('sourceId') or
+                                  header.get('sourceName')))
+    return False
+  if kafka_sink is not None:
+    kafka_sink.publish(jobj)
+  else:
+    save_event(jobj, points)
+  if deduplicator is not None:
+    deduplicator.remember(jobj)
+  metrics.event(jobj)
+  if event_stream is not None:
+    event_stream.publish_event(jobj)
+  return True
+
+def kafka_consume(servers, topic_prefix, group, influx_url, batch_points,
+                  spool=None, rollup_config=None, spool_config=None):
+  '''
+  Consumer mode: save the events published by the collectors' Kafka sinks
+  to influxdb, one poll's worth of points per write, until interrupted.
+  Offsets are committed only once a poll's points have been written or
+  spooled, so a consumer that dies part way re-reads rather than loses
+  events.  Without a spool a failed write is retried, with backoff, until
+  influxdb takes it; the consumer's partitions are paused meanwhile, so it
+  keeps polling and stays in its group without reading further.  Several
+  consumers in the same group share the topics' partitions.
+  '''
+  global influx_writer
+  global rollups
+  influx_writer = InfluxWriter(influx_url, batch_points, 1.0, spool=spool)
+  rollups = make_rollups(rollup_config, influx_url, batch_points, 1000,
+                         spool_config, 'consumer')
+  consumer = KafkaConsumer(bootstrap_servers=servers.split(','),
+                           group_id=group,
+                           client_id='ves-collector-consumer',
+                           enable_auto_commit=False,
+                           auto_offset_reset='earliest')
+  consumer.subscribe(pattern='^{0}.*'.format(topic_prefix))
+  logger.info('Consuming topics {0}* from Kafka at {1} as group {2}'.format(
+                                                   topic_prefix, servers, group))
+  print('Consuming topics {0}* from Kafka at {1}...'.format(topic_prefix,
+                                                            servers))
+  try:
+    while True:
+      records = consumer.poll(timeout_ms=1000, max_records=batch_points)
+      if not records:
+        continue
+      points = []
+      for partition_records in records.values():
+        for record in partition_records:
+          try:
+            jobj = json.loads(record.value)
+            if deduplicator is not None and deduplicator.seen(jobj):
+              continue
+            save_event(jobj, points)
+            if deduplicator is not None:
+              deduplicator.remember(jobj)
+          except Exception as e:
+            logger.error('Skipping bad event at {0}:{1}:{2}: {3!r}'.format(
+                         record.topic, record.partition, record.offset, e))
+      points = influx_writer.reorder(points)
+      for i in range(0, len(points), batch_points):
+        backoff = 1
+        while (not influx_writer.flush(points[i:i + batch_points]) and
+               influx_writer.spool is None):
+          logger.warn('Influxdb write failed and there is no spool, '
+                      'retrying in {0} s'.format(backoff))
+          consumer.pause(*consumer.assignment())
+          consumer.poll(timeout_ms=backoff * 1000)
+          backoff = min(backoff * 2, 60)
+        consumer.resume(*consumer.paused())
+      influx_writer.report()
+      consumer.commit()
+  finally:
+    consumer.close()
+    if rollups is not None:
+      rollups.close()
+    influx_writer.close()
 
 #--------------------------------------------------------------------------
-# Save event data
+# Save event data, to influxdb or, for a batch, to the points list
 #--------------------------------------------------------------------------
-def save_event(body):
-  jobj = json.loads(body)
-  e = json.loads(body, object_hook=JSONObject)
+def save_event(jobj, points=None):
+  e = JSONView(jobj)
 
   domain = jobj['event']['commonEventHeader']['domain']
   timestamp = jobj['event']['commonEventHeader']['lastEpochMicrosec']
@@ -255,7 +2696,7 @@ def save_event(body):
 
   if e.event.commonEventHeader.domain == "heartbeat":
     print('Found Heartbeat')
-    send_to_influxdb(event,'heartbeat,system={},sequence={}'.format(agent,e.event.commonEventHeader.sequence))
+    send_to_influxdb("heartbeat",'heartbeat,system={} sequence={}'.format(agent,e.event.commonEventHeader.sequence), points, timestamp)
 
   if 'measurementsForVfScalingFields' in jobj['event']:
     print('Found measurementsForVfScalingFields')
@@ -289,7 +2730,7 @@ def save_event(body):
           pdata = pdata + ",{}={}".format(field['name'],field['value'])
         i=pdata.find(',', pdata.find('system'))
         pdata = pdata[:i] + ' ' + pdata[i+1:]
-        send_to_influxdb("systemLoad", pdata)
+        send_to_influxdb("systemLoad", pdata, points, timestamp)
 
 #            "cpuUsageArray": [
 #                {
@@ -316,7 +2757,7 @@ def save_event(body):
             pdata = pdata + ',{}={}'.format(key,val)
         i=pdata.find(',', pdata.find('cpu='))
         pdata = pdata[:i] + ' ' + pdata[i+1:]
-        send_to_influxdb("cpuUsage", pdata)
+        send_to_influxdb("cpuUsage", pdata, points, timestamp)
 
 #            "diskUsageArray": [
 #                {
@@ -343,7 +2784,7 @@ def save_event(body):
             pdata = pdata + ',{}={}'.format(key,val)
         i=pdata.find(',', pdata.find('disk='))
         pdata = pdata[:i] + ' ' + pdata[i+1:]
-        send_to_influxdb("diskUsage", pdata)
+        send_to_influxdb("diskUsage", pdata, points, timestamp)
 
 #            "memoryUsageArray": [
 #                {
@@ -367,7 +2808,7 @@ def save_event(body):
           pdata = pdata + ',{}={}'.format(key,val)
       i=pdata.find(',', pdata.find('system'))
       pdata = pdata[:i] + ' ' + pdata[i+1:]
-      send_to_influxdb("memoryUsage", pdata)
+      send_to_influxdb("memoryUsage", pdata, points, timestamp)
 
 #            "vNicPerformanceArray": [
 #                {
@@ -394,18 +2835,26 @@ def save_event(body):
             pdata = pdata + ',{}={}'.format(key,val)
         i=pdata.find(',', pdata.find('vnic'))
         pdata = pdata[:i] + ' ' + pdata[i+1:]
-        send_to_influxdb("vNicPerformance", pdata)
+        send_to_influxdb("vNicPerformance", pdata, points, timestamp)
 
-def test_listener(environ, start_response, schema):
+def test_listener(environ, start_response, validator):
     '''
     Handler for the Test Collector Test Control API.
 
     There is no authentication on this interface.
 
-    This simply stores a commandList which will be sent in response to the next
-    incoming event on the EVEL interface.
+    This stores a commandList which will be sent in response to the next
+    incoming event on the EVEL interface from each agent it is for: those
+    with the sourceIds in the sourceId query parameter, and the members of
+    the groups in the group parameter (both may be repeated or
+    comma-separated), or otherwise whichever agent sends the next event.
+    A ttl parameter gives the seconds after which it is dropped if not
+    sent.  GET returns the pending commandList, for the sourceId given or
+    for the next agent.
     '''
-    global pending_command_list
+    query = urlparse.parse_qs(environ.get('QUERY_STRING', ''))
+    source_ids = query_list(query, 'sourceId')
+    groups = query_list(query, 'group')
     logger.info('Got a Test Control input')
     print('============================')
     print('==== TEST CONTROL INPUT ====')
@@ -415,7 +2864,8 @@ def test_listener(environ, start_response, schema):
     #--------------------------------------------------------------------------
     if environ.get('REQUEST_METHOD') == 'GET':
         start_response('200 OK', [('Content-type', 'application/json')])
-        yield json.dumps(pending_command_list)
+        yield json.dumps(command_store.peek(source_ids[0] if source_ids
+                                            else None))
         return
 
     #--------------------------------------------------------------------------
@@ -429,12 +2879,11 @@ def test_listener(environ, start_response, schema):
     #--------------------------------------------------------------------------
     # If we have a schema file then check that the event matches that expected.
     #--------------------------------------------------------------------------
-    if (schema is not None):
-        logger.debug('Attempting to validate data: {0}\n'
-                     'Against schema: {1}'.format(body, schema))
+    if (validator is not None):
+        logger.debug('Attempting to validate data: {0}'.format(body))
         try:
             decoded_body = json.loads(body)
-            jsonschema.validate(decoded_body, schema)
+            validator.validate(decoded_body)
             logger.info('TestControl is valid!')
             print('TestControl:\n'
                   '{0}'.format(json.dumps(decoded_body,
@@ -442,10 +2891,6 @@ def test_listener(environ, start_response, schema):
                                           indent=4,
                                           separators=(',', ': '))))
 
-        except jsonschema.SchemaError as e:
-            logger.error('TestControl Schema is not valid: {0}'.format(e))
-            print('TestControl Schema is not valid: {0}'.format(e))
-
         except jsonschema.ValidationError as e:
             logger.warn('TestControl input not valid: {0}'.format(e))
             print('TestControl input not valid: {0}'.format(e))
@@ -477,12 +2922,113 @@ def test_listener(environ, start_response, schema):
     # Respond to the caller. If we received otherField 'ThrottleRequest',
     # generate the appropriate canned response.
     #--------------------------------------------------------------------------
-    pending_command_list = decoded_body
+    try:
+        ttl = int(query['ttl'][0]) if 'ttl' in query else None
+    except ValueError:
+        yield bad_request(start_response, 'ttl is not a number of seconds')
+        return
+    queued = command_store.put(decoded_body, source_ids, groups, ttl)
+    if queued is None:
+        yield bad_request(start_response,
+                          'Unknown group in {0}'.format(', '.join(groups)))
+        return
+    print('Queued for {0}'.format(', '.join(source_ids + groups)
+                                  if source_ids or groups else 'next agent'))
     print('===== TEST CONTROL END =====')
     print('============================')
     start_response('202 Accepted', [])
     yield ''
 
+def group_listener(environ, start_response):
+    '''
+    Handler for the Test Collector command groups.
+
+    There is no authentication on this interface.
+
+    POST with a name query parameter and a body of {"sourceIds": [...]}
+    defines the group, or removes it if the list is empty; GET returns
+    every group's members.
+    '''
+    if environ.get('REQUEST_METHOD') == 'GET':
+        start_response('200 OK', [('Content-type', 'application/json')])
+        yield json.dumps(command_store.get_groups())
+        return
+
+    query = urlparse.parse_qs(environ.get('QUERY_STRING', ''))
+    name = query.get('name', [''])[0]
+    try:
+        length = int(environ.get('CONTENT_LENGTH') or '0')
+        source_ids = json.loads(environ['wsgi.input'].read(length))['sourceIds']
+        if not name or not isinstance(source_ids, list):
+            raise ValueError('needs a name and a sourceIds array')
+    except Exception as e:
+        yield bad_request(start_response,
+                          'Not a command group: {0}'.format(e))
+        return
+    command_store.set_group(name, source_ids)
+    logger.info('Command group {0}: {1} agents'.format(name, len(source_ids)))
+    start_response('202 Accepted', [])
+    yield ''
+
+def stream_listener(environ, start_response):
+    '''
+    Handler for /eventStream: a Server-Sent Events stream of what this
+    process saves, for live views that shouldn't poll influxdb.  There is no
+    authentication on this interface.
+
+    The type query parameter picks events (the default), each event saved,
+    as "event" messages; points, each point written to influxdb, as "point"
+    messages of measurement, tags, fields and timestamp; or rollups, each
+    rollup point written, as "rollup" messages with their window's
+    retention policy.  domain, source (sourceName or sourceId, or the
+    system tag of points) and measurement narrow what is sent, and may be
+    repeated or comma-separated.
+
+    A subscriber that falls buffer items behind is sent a "dropped" message
+    and disconnected.  With several processes each stream carries the
+    events of the process it reached.
+    '''
+    query = urlparse.parse_qs(environ.get('QUERY_STRING', ''))
+    kind = query.get('type', ['events'])[0]
+    if kind not in EventStream.KINDS:
+        yield bad_request(start_response,
+                          'type must be one of {0}'.format(
+                                             ', '.join(EventStream.KINDS)))
+        return
+    subscriber = event_stream.subscribe(kind,
+                                        query_list(query, 'domain'),
+                                        query_list(query, 'source'),
+                                        query_list(query, 'measurement'))
+    if subscriber is None:
+        start_response('503 Service Unavailable', [('Retry-After', '60')])
+        yield ''
+        return
+
+    logger.info('Stream subscriber for {0}: {1}'.format(
+                                     kind, environ.get('QUERY_STRING', '')))
+    start_response('200 OK', [('Content-type', 'text/event-stream'),
+                              ('Cache-Control', 'no-cache')])
+    try:
+        yield 'retry: 5000\n\n'
+        while not subscriber.dropped:
+            try:
+                message, data = subscriber.queue.get(timeout=15)
+            except Queue.Empty:
+                yield ': keep-alive\n\n'
+                continue
+            yield 'event: {0}\ndata: {1}\n\n'.format(message, data)
+        yield 'event: dropped\ndata: {}\n\n'
+    finally:
+        event_stream.unsubscribe(subscriber)
+        logger.info('Stream subscriber for {0} gone'.format(kind))
+
+def query_list(query, name):
+    '''
+    The values of a query parameter that may be repeated or comma-separated.
+    '''
+    return [value for values in query.get(name, [])
+            for value in values.split(',') if value]
+
 def main(argv=None):
     '''
     Main function for the collector start-up.
@@ -561,12 +3107,18 @@ USAGE
                             default='default',
                             metavar='<section>',
                             help='section to use in the config file')
+        parser.add_argument('-k', '--kafka-consumer',
+                            dest='kafka_consumer',
+                            action='store_true',
+                            help='save events from kafka_sink to influxdb '
+                                 'rather than listening for them')
 
         #----------------------------------------------------------------------
         # Process arguments received.
         #----------------------------------------------------------------------
         args = parser.parse_args()
-        verbose = args.verbose
+        global verbose
+        verbose = args.verbose or 0
         api_version = args.api_version
         config_file = args.config
         config_section = args.section
@@ -578,7 +3130,50 @@ USAGE
         defaults = {'log_file': 'collector.log',
                     'vel_port': '12233',
                     'vel_path': '',
-                    'vel_topic_name': ''
+                    'vel_topic_name': '',
+                    'influxdb_batch_points': '5000',
+                    'influxdb_batch_ms': '200',
+                    'validate_sample': '1',
+                    'ingest_queue_size': '1000',
+                    'ingest_workers': '2',
+                    'ingest_retry_after': '1',
+                    'ingest_stats_interval': '10',
+                    'processes': '1',
+                    'batch_max_events': '1000',
+                    'max_inflated_bytes': '16777216',
+                    'kafka_sink': '',
+                    'kafka_topic_prefix': 'ves_',
+                    'kafka_batch_bytes': '65536',
+                    'kafka_linger_ms': '50',
+                    'kafka_compression': 'gzip',
+                    'kafka_consumer_group': 'ves-influxdb',
+                    'metrics_port': '0',
+                    'spool_dir': '',
+                    'spool_segment_bytes': '1048576',
+                    'spool_max_bytes': '1073741824',
+                    'spool_replay_rate': '5000',
+                    'rollups': '60,300',
+                    'rollup_retention': '30d,365d',
+                    'rollup_grace': '30',
+                    'command_state_file': '',
+                    'command_ttl': '300',
+                    'overload_control': '0',
+                    'overload_source_rate': '1',
+                    'overload_source_burst': '20',
+                    'overload_high_water': '0.7',
+                    'overload_low_water': '0.3',
+                    'overload_cpu_budget': '0',
+                    'overload_interval': '5',
+                    'overload_throttle_count': '5',
+                    'overload_hold': '60',
+                    'overload_measurement_interval': '60',
+                    'overload_normal_interval': '10',
+                    'overload_suppress_fields': '',
+                    'dedup_window': '300',
+                    'dedup_capacity': '1000000',
+                    'dedup_fp_rate': '0.0001',
+                    'stream_max_subscribers': '20',
+                    'stream_buffer': '1000'
                    }
         overrides = {}
         config = ConfigParser.SafeConfigParser(defaults)
@@ -592,6 +3187,89 @@ USAGE
         global vel_password
         global vel_topic_name
         influxdb = config.get(config_section, 'influxdb', vars=overrides)
+        influxdb_batch_points = config.getint(config_section,
+                                              'influxdb_batch_points')
+        influxdb_batch_ms = config.getint(config_section, 'influxdb_batch_ms')
+        ingest_queue_size = config.getint(config_section,
+                                          'ingest_queue_size')
+        ingest_workers = config.getint(config_section, 'ingest_workers')
+        ingest_stats_interval = config.getint(config_section,
+                                              'ingest_stats_interval')
+        processes = max(1, config.getint(config_section, 'processes'))
+        global batch_max_events
+        batch_max_events = config.getint(config_section, 'batch_max_events')
+        global max_inflated_bytes
+        max_inflated_bytes = config.getint(config_section,
+                                           'max_inflated_bytes')
+        global ingest_retry_after
+        ingest_retry_after = config.getint(config_section,
+                                           'ingest_retry_after')
+        global validate_sample
+        validate_sample = max(1, config.getint(config_section,
+                                               'validate_sample'))
+        kafka_servers = config.get(config_section, 'kafka_sink')
+        kafka_topic_prefix = config.get(config_section, 'kafka_topic_prefix')
+        kafka_batch_bytes = config.getint(config_section, 'kafka_batch_bytes')
+        kafka_linger_ms = config.getint(config_section, 'kafka_linger_ms')
+        kafka_compression = config.get(config_section, 'kafka_compression')
+        kafka_consumer_group = config.get(config_section,
+                                          'kafka_consumer_group')
+        metrics_port = config.getint(config_section, 'metrics_port')
+        spool_config = None
+        if config.get(config_section, 'spool_dir'):
+            spool_config = {
+                'directory': config.get(config_section, 'spool_dir'),
+                'segment_bytes': config.getint(config_section,
+                                               'spool_segment_bytes'),
+                'max_bytes': config.getint(config_section, 'spool_max_bytes'),
+                'replay_rate': config.getint(config_section,
+                                             'spool_replay_rate')}
+        command_state_file = config.get(config_section,
+                                        'command_state_file') or None
+        command_ttl = config.getint(config_section, 'command_ttl')
+        overload_config = None
+        if config.getboolean(config_section, 'overload_control'):
+            overload_config = {
+                'source_rate': config.getfloat(config_section,
+                                               'overload_source_rate'),
+                'burst': config.getint(config_section,
+                                       'overload_source_burst'),
+                'high_water': config.getfloat(config_section,
+                                              'overload_high_water'),
+                'low_water': config.getfloat(config_section,
+                                             'overload_low_water'),
+                'cpu_budget': config.getfloat(config_section,
+                                              'overload_cpu_budget'),
+                'interval': config.getint(config_section,
+                                          'overload_interval'),
+                'throttle_count': config.getint(config_section,
+                                                'overload_throttle_count'),
+                'hold': config.getint(config_section, 'overload_hold'),
+                'throttled_interval': config.getint(config_section,
+                                               'overload_measurement_interval'),
+                'normal_interval': config.getint(config_section,
+                                                 'overload_normal_interval'),
+                'suppress_fields': [field.strip() for field in
+                                    config.get(config_section,
+                                          'overload_suppress_fields').split(',')
+                                    if field.strip()]}
+        dedup_window = config.getint(config_section, 'dedup_window')
+        dedup_capacity = config.getint(config_section, 'dedup_capacity')
+        dedup_fp_rate = config.getfloat(config_section, 'dedup_fp_rate')
+        stream_max_subscribers = config.getint(config_section,
+                                               'stream_max_subscribers')
+        stream_buffer = config.getint(config_section, 'stream_buffer')
+        rollup_config = None
+        rollup_windows = config.get(config_section, 'rollups')
+        if rollup_windows.strip():
+            rollup_config = {
+                'windows': [int(window) for window in
+                            rollup_windows.split(',')],
+                'retention': [duration.strip() for duration in
+                              config.get(config_section,
+                                         'rollup_retention').split(',')],
+                'grace': config.getint(config_section, 'rollup_grace'),
+                'per_worker': processes > 1}
         log_file = config.get(config_section, 'log_file', vars=overrides)
         vel_port = config.get(config_section, 'vel_port', vars=overrides)
         vel_path = config.get(config_section, 'vel_path', vars=overrides)
@@ -648,6 +3326,8 @@ USAGE
         #----------------------------------------------------------------------
         logger.debug('Log file = {0}'.format(log_file))
         logger.debug('Influxdb server = {0}'.format(influxdb))
+        logger.debug('Influxdb batch = {0} points or {1} ms'.format(
+                                      influxdb_batch_points, influxdb_batch_ms))
         logger.debug('Event Listener Port = {0}'.format(vel_port))
         logger.debug('Event Listener Path = {0}'.format(vel_path))
         logger.debug('Event Listener Topic = {0}'.format(vel_topic_name))
@@ -660,10 +3340,29 @@ USAGE
                                                          throttle_schema_file))
         logger.debug('Test Control JSON Schema File = {0}'.format(
                                                      test_control_schema_file))
+        logger.debug('Validating 1 in {0} events per source'.format(
+                                                              validate_sample))
+        logger.debug('Ingest queue = {0} events, {1} workers'.format(
+                                            ingest_queue_size, ingest_workers))
+        logger.debug('Collector processes = {0}'.format(processes))
+        logger.debug('Kafka sink = {0}'.format(kafka_servers or 'none'))
+        logger.debug('Rollups = {0}'.format(
+                     ', '.join(rollup_policy(window) for window in
+                               rollup_config['windows'])
+                     if rollup_config else 'none'))
+        logger.debug('Influxdb spool = {0}'.format(
+                     spool_config['directory'] if spool_config else 'none'))
 
         #----------------------------------------------------------------------
         # Perform some basic error checking on the config.
         #----------------------------------------------------------------------
+        if (kafka_servers or args.kafka_consumer) and KafkaProducer is None:
+            logger.error('kafka_sink needs the kafka-python package')
+            raise RuntimeError('kafka_sink needs the kafka-python package')
+        if args.kafka_consumer and not kafka_servers:
+            logger.error('--kafka-consumer needs kafka_sink to be set')
+            raise RuntimeError('--kafka-consumer needs kafka_sink to be set')
+
         if (int(vel_port) < 1024 or int(vel_port) > 65535):
             logger.error('Invalid Vendor Event Listener port ({0}) '
                          'specified'.format(vel_port))
@@ -722,6 +3421,21 @@ USAGE
                 vel_schema.update(base_schema)
                 logger.debug('Updated the JSON schema file')
 
+        #----------------------------------------------------------------------
+        # Compile the validators once, now that the schemas are complete.
+        #----------------------------------------------------------------------
+        global vel_validator
+        global throttle_validator
+        global test_control_validator
+        vel_validator = compile_validator('Event Listener', vel_schema,
+                                          validate_sample)
+        throttle_validator = compile_validator('Throttle', throttle_schema)
+        test_control_validator = compile_validator('Test Control',
+                                                   test_control_schema)
+        if vel_validator is not None:
+            logger.debug('Domain validators: {0}'.format(
+                                    ', '.join(sorted(vel_validator.domains))))
+
         #----------------------------------------------------------------------
         # We are now ready to get started with processing. Start-up the various
         # components of the system in order:
@@ -740,10 +3454,15 @@ USAGE
                        format(vel_path, api_version)
         set_404_content(root_url)
         dispatcher = PathDispatcher()
-        vendor_event_listener = partial(listener, schema = vel_schema)
+        vendor_event_listener = partial(listener, validator = vel_validator)
         dispatcher.register('GET', root_url, vendor_event_listener)
         dispatcher.register('POST', root_url, vendor_event_listener)
-        vendor_throttle_listener = partial(listener, schema = throttle_schema)
+        vendor_batch_listener = partial(batch_listener,
+                                        validator = vel_validator)
+        dispatcher.register('POST', root_url + '/eventBatch',
+                            vendor_batch_listener)
+        vendor_throttle_listener = partial(listener,
+                                           validator = throttle_validator)
         dispatcher.register('GET', throttle_url, vendor_throttle_listener)
         dispatcher.register('POST', throttle_url, vendor_throttle_listener)
 
@@ -753,13 +3472,100 @@ USAGE
         #----------------------------------------------------------------------
         test_control_url = '/testControl/v{0}/commandList'.format(api_version)
         test_control_listener = partial(test_listener,
-                                        schema = test_control_schema)
+                                        validator = test_control_validator)
         dispatcher.register('POST', test_control_url, test_control_listener)
         dispatcher.register('GET', test_control_url, test_control_listener)
+        command_group_url = '/testControl/v{0}/commandGroup'.format(
+                                                                 api_version)
+        dispatcher.register('POST', command_group_url, group_listener)
+        dispatcher.register('GET', command_group_url, group_listener)
 
-        httpd = make_server('', int(vel_port), dispatcher)
-        print('Serving on port {0}...'.format(vel_port))
-        httpd.serve_forever()
+        #----------------------------------------------------------------------
+        # And the collector's own metrics, for Prometheus to scrape.
+        #----------------------------------------------------------------------
+        dispatcher.register('GET', '/metrics', metrics_listener)
+
+        #----------------------------------------------------------------------
+        # And a live stream of what is saved, unless turned off.
+        #----------------------------------------------------------------------
+        if stream_max_subscribers > 0:
+            global event_stream
+            event_stream = EventStream(stream_max_subscribers, stream_buffer)
+            dispatcher.register('GET', '/eventStream', stream_listener)
+
+        #----------------------------------------------------------------------
+        # Suppress duplicate events, if configured.  Each collector process
+        # has its own filter, so with processes > 1 a retry that reaches a
+        # different process than the original is not dropped here; the
+        # Kafka consumer, which gets all of a source's events, drops it if
+        # events go through Kafka.
+        #----------------------------------------------------------------------
+        if dedup_window > 0:
+            global deduplicator
+            deduplicator = Deduplicator(dedup_window, dedup_capacity,
+                                        dedup_fp_rate)
+            logger.info('Dropping duplicate events within {0}s, {1} bytes '
+                        'of filters, {2} hashes'.format(dedup_window,
+                                                       2 * deduplicator.size,
+                                                       deduplicator.hashes))
+
+        influx_url = 'http://{}/write?db=veseventsdb&precision=u'.format(
+                                                                     influxdb)
+        if rollup_config is not None and (args.kafka_consumer or
+                                          not kafka_servers):
+            create_rollup_policies(influxdb, rollup_config)
+        if args.kafka_consumer:
+            kafka_consume(kafka_servers, kafka_topic_prefix,
+                          kafka_consumer_group, influx_url,
+                          influxdb_batch_points,
+                          make_spool(spool_config, 'consumer'),
+                          rollup_config, spool_config)
+            return 0
+
+        kafka_config = None
+        if kafka_servers:
+            kafka_config = {'servers': kafka_servers,
+                            'topic_prefix': kafka_topic_prefix,
+                            'batch_bytes': kafka_batch_bytes,
+                            'linger_ms': kafka_linger_ms,
+                            'compression': kafka_compression}
+        serve_args = (int(vel_port), dispatcher, ThreadingWSGIServer,
+                      influx_url, influxdb_batch_points, influxdb_batch_ms,
+                      ingest_queue_size, ingest_workers, ingest_stats_interval,
+                      kafka_config, metrics_port, spool_config,
+                      rollup_config, overload_config)
+        global command_store
+        if processes == 1:
+            command_store = CommandStore(command_state_file, command_ttl)
+            serve(0, *serve_args)
+        else:
+            #------------------------------------------------------------------
+            # Several processes, each with its own listening socket on the
+            # same port, sharing one CommandStore held by a manager process.
+            #------------------------------------------------------------------
+            manager = CommandManager()
+            manager.start()
+            command_store = manager.CommandStore(command_state_file,
+                                                 command_ttl)
+            serve_args = serve_args[:2] + (ReusePortWSGIServer,) + \
+                         serve_args[3:]
+            children = []
+            for worker in range(processes):
+                child = multiprocessing.Process(target=serve_process,
+                                                args=(worker,) + serve_args,
+                                                name='collector-{0}'.format(
+                                                                       worker))
+                child.start()
+                children.append(child)
+            logger.info('Started {0} collector processes'.format(processes))
+            try:
+                for child in children:
+                    child.join()
+            finally:
+                for child in children:
+                    if child.is_alive():
+                        child.terminate()
+                manager.shutdown()
 
         logger.error('Main loop exited unexpectedly!')
         return 0
@@ -35,6 +35,40 @@ sed -i -- "s~vel_topic_name = example_vnf~vel_topic_name = $ves_topic~g" \
   evel-test-collector/config/collector.conf
 sed -i -- "/vel_topic_name = /a influxdb = $ves_influxdb_host:$ves_influxdb_port" \
   evel-test-collector/config/collector.conf
+if [[ "$ves_validate_sample" != "" ]]; then
+  sed -i -- "/vel_topic_name = /a validate_sample = $ves_validate_sample" \
+    evel-test-collector/config/collector.conf
+fi
+if [[ "$ves_processes" != "" ]]; then
+  sed -i -- "/vel_topic_name = /a processes = $ves_processes" \
+    evel-test-collector/config/collector.conf
+fi
+if [[ "$ves_kafka_sink" != "" ]]; then
+  sed -i -- "/vel_topic_name = /a kafka_sink = $ves_kafka_sink" \
+    evel-test-collector/config/collector.conf
+fi
+if [[ "$ves_metrics_port" != "" ]]; then
+  sed -i -- "/vel_topic_name = /a metrics_port = $ves_metrics_port" \
+    evel-test-collector/config/collector.conf
+fi
+if [[ "$ves_spool_dir" != "" ]]; then
+  sed -i -- "/vel_topic_name = /a spool_dir = $ves_spool_dir" \
+    evel-test-collector/config/collector.conf
+fi
+if [[ "$ves_rollups" != "" ]]; then
+  sed -i -- "/vel_topic_name = /a rollups = $ves_rollups" \
+    evel-test-collector/config/collector.conf
+fi
+if [[ "$ves_overload_control" != "" ]]; then
+  sed -i -- "/vel_topic_name = /a overload_control = $ves_overload_control" \
+    evel-test-collector/config/collector.conf
+fi
+if [[ "$ves_stream_max_subscribers" != "" ]]; then
+  sed -i -- "/vel_topic_name = /a stream_max_subscribers = $ves_stream_max_subscribers" \
+    evel-test-collector/config/collector.conf
+fi
+sed -i -- "/vel_topic_name = /a command_state_file = /opt/ves/commands.json" \
+  evel-test-collector/config/collector.conf
 
 echo; echo "evel-test-collector/config/collector.conf"
 cat evel-test-collector/config/collector.conf
@@ -84,6 +118,14 @@ curl -H "Accept: application/json" -H "Content-type: application/json" \
   -X POST -d @/opt/ves/Dashboard.json \
   http://$ves_grafana_auth@$ves_grafana_host:$ves_grafana_port/api/dashboards/db	
 
+if [[ "$ves_kafka_sink" != "" ]]; then
+  echo; echo "start the Kafka consumer saving events to InfluxDB"
+  python /opt/ves/evel-test-collector/code/collector/monitor.py \
+    --config /opt/ves/evel-test-collector/config/collector.conf \
+    --influxdb $ves_influxdb_host:$ves_influxdb_port \
+    --section default --kafka-consumer > /opt/ves/consumer.log 2>&1 &
+fi
+
 if [[ "$ves_loglevel" != "" ]]; then 
   python /opt/ves/evel-test-collector/code/collector/monitor.py \
     --config /opt/ves/evel-test-collector/config/collector.conf \
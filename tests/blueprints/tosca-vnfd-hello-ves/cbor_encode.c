@@ -0,0 +1,532 @@
+/**************************************************************************//**
+ * @file
+ * CBOR (RFC 7049) encoding of VES events.
+ *
+ * A single-pass recursive-descent transcoder: each JSON value is parsed and
+ * its CBOR written straight to the output buffer.  Strings are scanned once
+ * to find their unescaped length, which CBOR needs up front, and once more
+ * to copy them.  Nothing is allocated.
+ *
+ * Copyright 2017 AT&T Intellectual Property, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "cbor_encode.h"
+
+/**************************************************************************//**
+ * CBOR major types, and the initial bytes used for other items.
+ *****************************************************************************/
+#define CBOR_UNSIGNED 0
+#define CBOR_NEGATIVE 1
+#define CBOR_TEXT 3
+#define CBOR_FALSE 0xf4
+#define CBOR_TRUE 0xf5
+#define CBOR_NULL 0xf6
+#define CBOR_FLOAT32 0xfa
+#define CBOR_FLOAT64 0xfb
+#define CBOR_MAP_START 0xbf
+#define CBOR_ARRAY_START 0x9f
+#define CBOR_BREAK 0xff
+
+/**************************************************************************//**
+ * Longest JSON number accepted.
+ *****************************************************************************/
+#define CBOR_MAX_NUMBER 64
+
+/**************************************************************************//**
+ * Transcoding state.
+ *****************************************************************************/
+typedef struct cbor_writer {
+  const char * in;
+  const char * end;
+  unsigned char * out;
+  unsigned char * out_end;
+} CBOR_WRITER;
+
+static int cbor_value(CBOR_WRITER * w, const int depth);
+
+static void cbor_skip_space(CBOR_WRITER * w)
+{
+  while (w->in < w->end &&
+         (*w->in == ' ' || *w->in == '\t' || *w->in == '\n' || *w->in == '\r'))
+  {
+    w->in++;
+  }
+}
+
+static int cbor_put(CBOR_WRITER * w, const unsigned char byte)
+{
+  if (w->out >= w->out_end)
+  {
+    return -1;
+  }
+  *w->out++ = byte;
+  return 0;
+}
+
+/**************************************************************************//**
+ * Write an item's initial byte and its argument in the fewest bytes.
+ *****************************************************************************/
+static int cbor_head(CBOR_WRITER * w, const int major, const uint64_t value)
+{
+  int bytes;
+  int i;
+
+  if (value < 24)
+  {
+    return cbor_put(w, (major << 5) | value);
+  }
+  if (value <= 0xff)
+  {
+    bytes = 1;
+  }
+  else if (value <= 0xffff)
+  {
+    bytes = 2;
+  }
+  else if (value <= 0xffffffffULL)
+  {
+    bytes = 4;
+  }
+  else
+  {
+    bytes = 8;
+  }
+  if (w->out_end - w->out < bytes + 1)
+  {
+    return -1;
+  }
+  *w->out++ = (major << 5) | (bytes == 1 ? 24 : bytes == 2 ? 25 :
+                              bytes == 4 ? 26 : 27);
+  for (i = bytes - 1; i >= 0; i--)
+  {
+    *w->out++ = (value >> (8 * i)) & 0xff;
+  }
+  return 0;
+}
+
+/**************************************************************************//**
+ * Parse the four hex digits of a \\u escape.
+ *****************************************************************************/
+static int cbor_hex4(const char * p, const char * end, unsigned long * code)
+{
+  int i;
+
+  *code = 0;
+  if (end - p < 4)
+  {
+    return -1;
+  }
+  for (i = 0; i < 4; i++)
+  {
+    *code <<= 4;
+    if (p[i] >= '0' && p[i] <= '9')
+    {
+      *code |= p[i] - '0';
+    }
+    else if (p[i] >= 'a' && p[i] <= 'f')
+    {
+      *code |= p[i] - 'a' + 10;
+    }
+    else if (p[i] >= 'A' && p[i] <= 'F')
+    {
+      *code |= p[i] - 'A' + 10;
+    }
+    else
+    {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**************************************************************************//**
+ * Decode the escape at p (just after the backslash) to a code point.
+ *
+ * @returns Number of input characters consumed, or 0 if malformed.
+ *****************************************************************************/
+static int cbor_escape(const char * p, const char * end, unsigned long * code)
+{
+  unsigned long low;
+
+  if (p >= end)
+  {
+    return 0;
+  }
+  switch (*p)
+  {
+    case '"':  *code = '"';  return 1;
+    case '\\': *code = '\\'; return 1;
+    case '/':  *code = '/';  return 1;
+    case 'b':  *code = '\b'; return 1;
+    case 'f':  *code = '\f'; return 1;
+    case 'n':  *code = '\n'; return 1;
+    case 'r':  *code = '\r'; return 1;
+    case 't':  *code = '\t'; return 1;
+    case 'u':
+      if (cbor_hex4(p + 1, end, code) != 0)
+      {
+        return 0;
+      }
+      if (*code < 0xd800 || *code > 0xdfff)
+      {
+        return 5;
+      }
+      if (*code > 0xdbff || end - p < 11 || p[5] != '\\' || p[6] != 'u' ||
+          cbor_hex4(p + 7, end, &low) != 0 || low < 0xdc00 || low > 0xdfff)
+      {
+        return 0;
+      }
+      *code = 0x10000 + ((*code - 0xd800) << 10) + (low - 0xdc00);
+      return 11;
+    default:
+      return 0;
+  }
+}
+
+static int cbor_utf8_length(const unsigned long code)
+{
+  return (code < 0x80) ? 1 : (code < 0x800) ? 2 : (code < 0x10000) ? 3 : 4;
+}
+
+static void cbor_utf8_put(unsigned char * out, const unsigned long code)
+{
+  switch (cbor_utf8_length(code))
+  {
+    case 1:
+      out[0] = code;
+      break;
+    case 2:
+      out[0] = 0xc0 | (code >> 6);
+      out[1] = 0x80 | (code & 0x3f);
+      break;
+    case 3:
+      out[0] = 0xe0 | (code >> 12);
+      out[1] = 0x80 | ((code >> 6) & 0x3f);
+      out[2] = 0x80 | (code & 0x3f);
+      break;
+    default:
+      out[0] = 0xf0 | (code >> 18);
+      out[1] = 0x80 | ((code >> 12) & 0x3f);
+      out[2] = 0x80 | ((code >> 6) & 0x3f);
+      out[3] = 0x80 | (code & 0x3f);
+      break;
+  }
+}
+
+/**************************************************************************//**
+ * Transcode a string, w->in being at its opening quote.
+ *****************************************************************************/
+static int cbor_string(CBOR_WRITER * w)
+{
+  const char * p = w->in + 1;
+  const char * start = p;
+  unsigned long code;
+  size_t length = 0;
+  int used;
+
+  /***************************************************************************/
+  /* Find the end of the string and its length once unescaped.               */
+  /***************************************************************************/
+  while (p < w->end && *p != '"')
+  {
+    if ((unsigned char)*p < 0x20)
+    {
+      return -1;
+    }
+    if (*p == '\\')
+    {
+      used = cbor_escape(p + 1, w->end, &code);
+      if (used == 0)
+      {
+        return -1;
+      }
+      length += cbor_utf8_length(code);
+      p += 1 + used;
+    }
+    else
+    {
+      length++;
+      p++;
+    }
+  }
+  if (p >= w->end)
+  {
+    return -1;
+  }
+
+  if (cbor_head(w, CBOR_TEXT, length) != 0 ||
+      (size_t)(w->out_end - w->out) < length)
+  {
+    return -1;
+  }
+
+  /***************************************************************************/
+  /* Copy it, unescaping as we go.  Runs without escapes are copied whole.   */
+  /***************************************************************************/
+  while (start < p)
+  {
+    const char * run = start;
+
+    while (run < p && *run != '\\')
+    {
+      run++;
+    }
+    memcpy(w->out, start, run - start);
+    w->out += run - start;
+    if (run < p)
+    {
+      used = cbor_escape(run + 1, p, &code);
+      cbor_utf8_put(w->out, code);
+      w->out += cbor_utf8_length(code);
+      run += 1 + used;
+    }
+    start = run;
+  }
+  w->in = p + 1;
+  return 0;
+}
+
+/**************************************************************************//**
+ * Transcode a number.
+ *****************************************************************************/
+static int cbor_number(CBOR_WRITER * w)
+{
+  char text[CBOR_MAX_NUMBER];
+  const char * p = w->in;
+  int is_integer = 1;
+  size_t length;
+  char * tail;
+  double real;
+  float single;
+  uint64_t bits;
+  uint32_t bits32;
+  int i;
+
+  while (p < w->end &&
+         ((*p >= '0' && *p <= '9') || *p == '-' || *p == '+' ||
+          *p == '.' || *p == 'e' || *p == 'E'))
+  {
+    if (*p == '.' || *p == 'e' || *p == 'E')
+    {
+      is_integer = 0;
+    }
+    p++;
+  }
+  length = p - w->in;
+  if (length == 0 || length >= sizeof(text))
+  {
+    return -1;
+  }
+  memcpy(text, w->in, length);
+  text[length] = '\0';
+  w->in = p;
+
+  if (is_integer)
+  {
+    errno = 0;
+    if (text[0] == '-')
+    {
+      long long value = strtoll(text, &tail, 10);
+      if (errno == 0 && *tail == '\0')
+      {
+        return (value < 0) ?
+               cbor_head(w, CBOR_NEGATIVE, (uint64_t)(-1 - value)) :
+               cbor_head(w, CBOR_UNSIGNED, (uint64_t)value);
+      }
+    }
+    else
+    {
+      unsigned long long value = strtoull(text, &tail, 10);
+      if (errno == 0 && *tail == '\0')
+      {
+        return cbor_head(w, CBOR_UNSIGNED, value);
+      }
+    }
+  }
+
+  /***************************************************************************/
+  /* Not an integer, or too big to be a CBOR one.                            */
+  /***************************************************************************/
+  real = strtod(text, &tail);
+  if (*tail != '\0')
+  {
+    return -1;
+  }
+  single = (float)real;
+  if ((double)single == real)
+  {
+    memcpy(&bits32, &single, sizeof(bits32));
+    if (cbor_put(w, CBOR_FLOAT32) != 0 || w->out_end - w->out < 4)
+    {
+      return -1;
+    }
+    for (i = 3; i >= 0; i--)
+    {
+      *w->out++ = (bits32 >> (8 * i)) & 0xff;
+    }
+    return 0;
+  }
+  memcpy(&bits, &real, sizeof(bits));
+  if (cbor_put(w, CBOR_FLOAT64) != 0 || w->out_end - w->out < 8)
+  {
+    return -1;
+  }
+  for (i = 7; i >= 0; i--)
+  {
+    *w->out++ = (bits >> (8 * i)) & 0xff;
+  }
+  return 0;
+}
+
+/**************************************************************************//**
+ * Transcode a literal: true, false or null.
+ *****************************************************************************/
+static int cbor_literal(CBOR_WRITER * w,
+                        const char * literal,
+                        const unsigned char byte)
+{
+  const size_t length = strlen(literal);
+
+  if ((size_t)(w->end - w->in) < length ||
+      memcmp(w->in, literal, length) != 0)
+  {
+    return -1;
+  }
+  w->in += length;
+  return cbor_put(w, byte);
+}
+
+/**************************************************************************//**
+ * Transcode the members of an object or the elements of an array, w->in
+ * being just after the opening bracket.
+ *****************************************************************************/
+static int cbor_container(CBOR_WRITER * w, const int depth, const char close)
+{
+  int first = 1;
+
+  if (depth >= CBOR_MAX_DEPTH ||
+      cbor_put(w, close == '}' ? CBOR_MAP_START : CBOR_ARRAY_START) != 0)
+  {
+    return -1;
+  }
+  for (;;)
+  {
+    cbor_skip_space(w);
+    if (w->in >= w->end)
+    {
+      return -1;
+    }
+    if (*w->in == close)
+    {
+      w->in++;
+      return cbor_put(w, CBOR_BREAK);
+    }
+    if (!first)
+    {
+      if (*w->in != ',')
+      {
+        return -1;
+      }
+      w->in++;
+      cbor_skip_space(w);
+    }
+    first = 0;
+
+    if (close == '}')
+    {
+      if (w->in >= w->end || *w->in != '"' || cbor_string(w) != 0)
+      {
+        return -1;
+      }
+      cbor_skip_space(w);
+      if (w->in >= w->end || *w->in != ':')
+      {
+        return -1;
+      }
+      w->in++;
+    }
+    if (cbor_value(w, depth + 1) != 0)
+    {
+      return -1;
+    }
+  }
+}
+
+static int cbor_value(CBOR_WRITER * w, const int depth)
+{
+  cbor_skip_space(w);
+  if (w->in >= w->end)
+  {
+    return -1;
+  }
+  switch (*w->in)
+  {
+    case '{':
+      w->in++;
+      return cbor_container(w, depth, '}');
+    case '[':
+      w->in++;
+      return cbor_container(w, depth, ']');
+    case '"':
+      return cbor_string(w);
+    case 't':
+      return cbor_literal(w, "true", CBOR_TRUE);
+    case 'f':
+      return cbor_literal(w, "false", CBOR_FALSE);
+    case 'n':
+      return cbor_literal(w, "null", CBOR_NULL);
+    default:
+      return cbor_number(w);
+  }
+}
+
+/**************************************************************************//**
+ * Transcode a JSON document to CBOR.
+ *
+ * @param[in] json      The JSON document.
+ * @param[in] length    Length of the document.
+ * @param[out] out      Buffer for the CBOR.
+ * @param[in] out_size  Size of the buffer.
+ * @returns Length of the CBOR, or 0 if the JSON is malformed or the CBOR
+ *          doesn't fit.
+ *****************************************************************************/
+size_t cbor_from_json(const char * json,
+                      size_t length,
+                      unsigned char * out,
+                      size_t out_size)
+{
+  CBOR_WRITER w;
+
+  w.in = json;
+  w.end = json + length;
+  w.out = out;
+  w.out_end = out + out_size;
+  if (cbor_value(&w, 0) != 0)
+  {
+    return 0;
+  }
+  cbor_skip_space(&w);
+  if (w.in != w.end)
+  {
+    return 0;
+  }
+  return w.out - out;
+}
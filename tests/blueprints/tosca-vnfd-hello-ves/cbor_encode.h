@@ -0,0 +1,59 @@
+#ifndef CBOR_ENCODE_INCLUDED
+#define CBOR_ENCODE_INCLUDED
+/**************************************************************************//**
+ * @file
+ * CBOR (RFC 7049) encoding of VES events.
+ *
+ * Transcodes the JSON produced by evel_json_encode_event() into CBOR, item
+ * for item, so the event keeps exactly the VES data model and field names
+ * but is smaller and much cheaper to decode.  It depends on nothing but the
+ * C library, so any reporter can use it.
+ *
+ * Copyright 2017 AT&T Intellectual Property, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************/
+
+#include <stddef.h>
+
+/**************************************************************************//**
+ * Media type of a CBOR event body.
+ *****************************************************************************/
+#define CBOR_CONTENT_TYPE "application/cbor"
+
+/**************************************************************************//**
+ * Deepest nesting of objects and arrays accepted.
+ *****************************************************************************/
+#define CBOR_MAX_DEPTH 32
+
+/**************************************************************************//**
+ * Transcode a JSON document to CBOR.
+ *
+ * Objects and arrays become indefinite-length maps and arrays, so the input
+ * is read once.  Integers that fit in 64 bits become CBOR integers; other
+ * numbers become single-precision floats if that is exact, otherwise double.
+ *
+ * @param[in] json      The JSON document.
+ * @param[in] length    Length of the document.
+ * @param[out] out      Buffer for the CBOR.
+ * @param[in] out_size  Size of the buffer.
+ * @returns Length of the CBOR, or 0 if the JSON is malformed or the CBOR
+ *          doesn't fit.
+ *****************************************************************************/
+size_t cbor_from_json(const char * json,
+                      size_t length,
+                      unsigned char * out,
+                      size_t out_size);
+
+#endif
@@ -20,16 +20,21 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <sys/signal.h>
 #include <pthread.h>
 #include <mcheck.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "evel.h"
 #include "evel_demo.h"
 #include "evel_test_control.h"
+#include "syslog_ingest.h"
+#include "gzip_post.h"
+#include "cbor_encode.h"
 
 /**************************************************************************//**
  * Definition of long options to the program.
@@ -49,13 +54,20 @@ static const struct option long_options[] = {
     {"username", required_argument, 0, 'u'},
     {"password", required_argument, 0, 'w'},
     {"nothrott", no_argument,       0, 'x'},
+    {"bench",    required_argument, 0, 'b'},
+    {"latency",  required_argument, 0, 'l'},
+    {"syslog-socket", required_argument, 0, 'k'},
+    {"syslog-udp",    required_argument, 0, 'y'},
+    {"syslog-rate",   required_argument, 0, 'r'},
+    {"gzip",     required_argument, 0, 'z'},
+    {"cbor",     no_argument,       0, 'e'},
     {0, 0, 0, 0}
   };
 
 /**************************************************************************//**
  * Definition of short options to the program.
  *****************************************************************************/
-static const char* short_options = "hi:f:n:p:t:sc:u:w:vx";
+static const char* short_options = "hi:f:n:p:t:sc:u:w:vxb:l:k:y:r:z:e";
 
 /**************************************************************************//**
  * Basic user help text describing the usage of the application.
@@ -72,6 +84,13 @@ static const char* usage_text =
 "          [--https]\n"
 "          [--cycles <cycles>]\n"
 "          [--nothrott]\n"
+"          [--bench <iterations>]\n"
+"          [--latency <heartbeat_ms>]\n"
+"          [--syslog-socket <path>]\n"
+"          [--syslog-udp <port>]\n"
+"          [--syslog-rate <messages_per_second>]\n"
+"          [--gzip <threshold_bytes>]\n"
+"          [--cbor]\n"
 "\n"
 "Demonstrate use of the ECOMP Vendor Event Listener API.\n"
 "\n"
@@ -109,7 +128,45 @@ static const char* usage_text =
 "  --verbose\n"
 "\n"
 "  -x         Exclude throttling commands from demonstration.\n"
-"  --nothrott\n";
+"  --nothrott\n"
+"\n"
+"  -b         Run each demo_* builder <iterations> times, encoding the events\n"
+"  --bench    locally rather than posting them, and print a per-builder\n"
+"             summary of events, JSON size and (in builds with\n"
+"             EVEL_DEMO_MEMSTATS defined) heap allocations on exit.  The\n"
+"             --fqdn and --port options are not required in this mode.\n"
+"\n"
+"  -l         Measure how long throttling commands take to change the agent's\n"
+"  --latency  behavior.  Each cycle issues the next testControl command and\n"
+"             posts a heartbeat every <heartbeat_ms> until the command has\n"
+"             been applied: the measurement interval changes, or for a\n"
+"             suppress or reset, an interval change queued behind it is\n"
+"             seen and the affected domain's encoded size is checked.\n"
+"             The distribution of delays is printed on exit.  The collector\n"
+"             must send commands posted before the agent's next event\n"
+"             together, as the vHello_VES monitor.py and ves-collector do.\n"
+"\n"
+"  -k         Receive syslog messages on a Unix datagram socket at <path>,\n"
+"  --syslog-socket  e.g. /dev/log, and post them as syslog events.\n"
+"\n"
+"  -y         Receive syslog messages on UDP <port>, e.g. 514.\n"
+"  --syslog-udp\n"
+"\n"
+"  -r         Maximum syslog events posted per second for any one source,\n"
+"  --syslog-rate  with bursts of five times that.  The total across all\n"
+"             sources is limited to ten times that.  Default = 10.\n"
+"\n"
+"  -z         Post events whose JSON is <threshold_bytes> or more gzipped,\n"
+"  --gzip     with Content-Encoding: gzip, e.g. 1024.  Smaller events are\n"
+"             posted as normal.  Commands in the collector's responses to\n"
+"             gzipped posts are not acted on, but heartbeats are always\n"
+"             posted as normal so that commands still arrive.  With\n"
+"             --bench, report the gzipped size of every event instead.\n"
+"\n"
+"  -e         Post every event as CBOR (Content-Type: application/cbor)\n"
+"  --cbor     rather than JSON; with --gzip, events over the threshold are\n"
+"             gzipped CBOR.  Heartbeats are always posted as JSON by the\n"
+"             library, so that the collector's commands still arrive.\n";
 
 #define DEFAULT_SLEEP_SECONDS 3
 #define MINIMUM_SLEEP_SECONDS 1
@@ -137,6 +194,224 @@ static void demo_signaling(void);
 static void demo_state_change(void);
 static void demo_syslog(void);
 static void demo_other(void);
+static void demo_measurement_default(void);
+static EVEL_ERR_CODES demo_post_event(EVENT_HEADER * event);
+static void demo_progress(const char * text);
+static void demo_bench(const int iterations);
+static void demo_report_builders(void);
+static void demo_throttle_latency(const int cycles, const int heartbeat_ms);
+static void demo_report_latency(void);
+
+/**************************************************************************//**
+ * Per-builder accounting.
+ *
+ * Each demo_* builder is listed along with the VES domain it produces.  When
+ * a builder is run through ::demo_run_builder it becomes the current builder
+ * and the events it hands to ::demo_post_event, together with their encoded
+ * JSON size, are attributed to it.  In builds with EVEL_DEMO_MEMSTATS defined
+ * the heap allocations made on the builder's thread are attributed too.
+ *****************************************************************************/
+typedef struct demo_builder {
+  const char * name;
+  const char * domain;
+  void (* run)(void);
+  unsigned long long runs;
+  unsigned long long events;
+  unsigned long long json_bytes;
+  unsigned long long gzip_bytes;
+  unsigned long long cbor_bytes;
+  unsigned long long allocs;
+  unsigned long long frees;
+  unsigned long long alloc_bytes;
+} DEMO_BUILDER;
+
+static void demo_run_builder(DEMO_BUILDER * builder);
+
+static DEMO_BUILDER demo_builders[] = {
+  {"demo_heartbeat",    "heartbeat",                demo_heartbeat},
+  {"demo_fault",        "fault",                    demo_fault},
+  {"demo_measurement",  "measurementsForVfScaling", demo_measurement_default},
+  {"demo_mobile_flow",  "mobileFlow",               demo_mobile_flow},
+  {"demo_service",      "serviceEvents",            demo_service},
+  {"demo_signaling",    "signaling",                demo_signaling},
+  {"demo_state_change", "stateChange",              demo_state_change},
+  {"demo_syslog",       "syslog",                   demo_syslog},
+  {"demo_other",        "other",                    demo_other},
+  {NULL, NULL, NULL}
+};
+
+/**************************************************************************//**
+ * The builder currently running, and whether its events are to be encoded
+ * locally and freed rather than posted to the collector.
+ *****************************************************************************/
+static DEMO_BUILDER * demo_current = NULL;
+static int demo_encode_locally = 0;
+
+/**************************************************************************//**
+ * Buffer into which events are encoded to measure their serialized size.
+ *****************************************************************************/
+#define DEMO_MAX_JSON_BODY 65536
+static char demo_json_buffer[DEMO_MAX_JSON_BODY];
+
+/**************************************************************************//**
+ * Encoder and buffer used to measure the gzipped size of locally encoded
+ * events, when the encoder has been initialized.
+ *****************************************************************************/
+static GZIP_ENCODER demo_gzip;
+static char demo_gzip_buffer[DEMO_MAX_JSON_BODY];
+
+/**************************************************************************//**
+ * Buffer into which locally encoded events are transcoded to CBOR.
+ *****************************************************************************/
+static unsigned char demo_cbor_buffer[DEMO_MAX_JSON_BODY];
+
+#ifdef EVEL_DEMO_ENCODE_BENCH
+/**************************************************************************//**
+ * Phase timing for the encoding benchmark.
+ *
+ * Time spent in a builder up to the point it hands an event over counts as
+ * construction, then the encode and the free are timed separately.  The
+ * totals cover one run of one builder, so multi-event builders sum over
+ * their events.
+ *****************************************************************************/
+typedef enum {
+  DEMO_PHASE_CONSTRUCT,
+  DEMO_PHASE_ENCODE,
+  DEMO_PHASE_CBOR,
+  DEMO_PHASE_GZIP,
+  DEMO_PHASE_FREE,
+  DEMO_PHASE_MAX
+} DEMO_PHASE;
+
+static const char * demo_phase_names[DEMO_PHASE_MAX] = {
+  "construct_ns",
+  "encode_ns",
+  "cbor_ns",
+  "gzip_ns",
+  "free_ns"
+};
+
+static int demo_timing = 0;
+static struct timespec demo_mark;
+static unsigned long long demo_phase_ns[DEMO_PHASE_MAX];
+
+static unsigned long long demo_elapsed_ns(const struct timespec * from,
+                                          const struct timespec * to)
+{
+  return (to->tv_sec - from->tv_sec) * 1000000000ULL + to->tv_nsec -
+                                                                from->tv_nsec;
+}
+
+/**************************************************************************//**
+ * Directory the JSON and CBOR of each locally encoded event are written to,
+ * if any, for checking that the collector decodes the CBOR to the same
+ * document as the JSON.
+ *****************************************************************************/
+static const char * demo_dump_dir = NULL;
+
+/**************************************************************************//**
+ * Write the event just encoded into ::demo_json_buffer and
+ * ::demo_cbor_buffer to <dir>/<builder>-<n>.json and .cbor.
+ *
+ * @param[in] json_size   Length of the JSON.
+ * @param[in] cbor_size   Length of the CBOR.
+ *****************************************************************************/
+static void demo_dump_event(const int json_size, const size_t cbor_size)
+{
+  static const char * suffixes[] = {"json", "cbor"};
+  const void * buffers[] = {demo_json_buffer, demo_cbor_buffer};
+  const size_t sizes[] = {json_size, cbor_size};
+  char path[1024];
+  FILE * fp;
+  int i;
+
+  for (i = 0; i < 2; i++)
+  {
+    snprintf(path, sizeof(path), "%s/%s-%llu.%s", demo_dump_dir,
+             demo_current->name, demo_current->events, suffixes[i]);
+    fp = fopen(path, "wb");
+    if (fp == NULL || fwrite(buffers[i], 1, sizes[i], fp) != sizes[i])
+    {
+      fprintf(stderr, "Failed to write %s.\n", path);
+    }
+    if (fp != NULL)
+    {
+      fclose(fp);
+    }
+  }
+}
+
+#define DEMO_MAIN demo_main
+#else
+#define DEMO_MAIN main
+#endif
+
+#ifdef EVEL_DEMO_MEMSTATS
+/**************************************************************************//**
+ * Interposed allocator.
+ *
+ * These definitions take precedence over the C library's for the whole
+ * process, the EVEL library included, and forward to the real glibc
+ * implementation.  Only allocations made on a thread that is currently
+ * running a builder are counted, so the EVEL event handler thread does not
+ * pollute the figures.
+ *****************************************************************************/
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t nmemb, size_t size);
+extern void * __libc_realloc(void * ptr, size_t size);
+extern void __libc_free(void * ptr);
+
+static __thread int demo_memstats_active = 0;
+
+void * malloc(size_t size)
+{
+  void * ptr = __libc_malloc(size);
+
+  if (demo_memstats_active && ptr != NULL)
+  {
+    demo_current->allocs++;
+    demo_current->alloc_bytes += size;
+  }
+  return ptr;
+}
+
+void * calloc(size_t nmemb, size_t size)
+{
+  void * ptr = __libc_calloc(nmemb, size);
+
+  if (demo_memstats_active && ptr != NULL)
+  {
+    demo_current->allocs++;
+    demo_current->alloc_bytes += nmemb * size;
+  }
+  return ptr;
+}
+
+void * realloc(void * ptr, size_t size)
+{
+  void * new_ptr = __libc_realloc(ptr, size);
+
+  if (demo_memstats_active && new_ptr != NULL)
+  {
+    if (ptr != NULL)
+    {
+      demo_current->frees++;
+    }
+    demo_current->allocs++;
+    demo_current->alloc_bytes += size;
+  }
+  return new_ptr;
+}
+
+void free(void * ptr)
+{
+  if (demo_memstats_active && ptr != NULL)
+  {
+    demo_current->frees++;
+  }
+  __libc_free(ptr);
+}
+#endif
 
 /**************************************************************************//**
  * Global flags related the applicaton.
@@ -295,7 +570,7 @@ void measure_traffic() {
 //      evel_measurement_agg_cpu_use_set(measurement, loadavg);
 //      evel_measurement_cpu_use_add(measurement, "cpu0", loadavg);
 
-      evel_rc = evel_post_event((EVENT_HEADER *)measurement);
+      evel_rc = gzip_post_event((EVENT_HEADER *)measurement);
       if (evel_rc != EVEL_SUCCESS) {
         EVEL_ERROR("Post Measurement failed %d (%s)",
                     evel_rc,
@@ -335,7 +610,7 @@ static void show_usage(FILE* fp)
  * @param[in] argc  Argument count.
  * @param[in] argv  Argument vector - for usage see usage_text.
  *****************************************************************************/
-int main(int argc, char ** argv)
+int DEMO_MAIN(int argc, char ** argv)
 {
   sigset_t sig_set;
   pthread_t thread_id;
@@ -348,6 +623,18 @@ int main(int argc, char ** argv)
   char * api_password = "";
   int verbose_mode = 0;
   int exclude_throttling = 0;
+  int bench_iterations = 0;
+  int latency_heartbeat_ms = 0;
+  int gzip_threshold = 0;
+  int cbor = 0;
+  SYSLOG_INGEST_CONFIG syslog_config = {
+    NULL,
+    0,
+    SYSLOG_DEFAULT_SOURCE_RATE,
+    SYSLOG_DEFAULT_SOURCE_BURST,
+    SYSLOG_DEFAULT_GLOBAL_RATE,
+    SYSLOG_DEFAULT_GLOBAL_BURST
+  };
   int cycles = 2147483647;
   int cycle;
   int measurement_interval = EVEL_MEASUREMENT_INTERVAL_UKNOWN;
@@ -356,8 +643,12 @@ int main(int argc, char ** argv)
 
   /***************************************************************************/
   /* We're very interested in memory management problems so check behavior.  */
+  /* The mcheck hooks and the interposed allocator used for per-builder       */
+  /* accounting don't mix, so memstats builds go without.                    */
   /***************************************************************************/
+#ifndef EVEL_DEMO_MEMSTATS
   mcheck(NULL);
+#endif
 
   if (argc < 2)
   {
@@ -421,6 +712,37 @@ int main(int argc, char ** argv)
         exclude_throttling = 1;
         break;
 
+      case 'b':
+        bench_iterations = atoi(optarg);
+        break;
+
+      case 'l':
+        latency_heartbeat_ms = atoi(optarg);
+        break;
+
+      case 'k':
+        syslog_config.unix_path = optarg;
+        break;
+
+      case 'y':
+        syslog_config.udp_port = atoi(optarg);
+        break;
+
+      case 'r':
+        syslog_config.source_rate = atof(optarg);
+        syslog_config.source_burst = 5 * syslog_config.source_rate;
+        syslog_config.global_rate = 10 * syslog_config.source_rate;
+        syslog_config.global_burst = 50 * syslog_config.source_rate;
+        break;
+
+      case 'z':
+        gzip_threshold = atoi(optarg);
+        break;
+
+      case 'e':
+        cbor = 1;
+        break;
+
       case '?':
         /*********************************************************************/
         /* Unrecognized parameter - getopt_long already printed an error     */
@@ -443,6 +765,22 @@ int main(int argc, char ** argv)
                         &option_index);
   }
 
+  /***************************************************************************/
+  /* In benchmark mode nothing is posted, so the API server need not be      */
+  /* given - but the EVEL library still wants something to initialize with. */
+  /***************************************************************************/
+  if (bench_iterations > 0)
+  {
+    if (api_fqdn == NULL)
+    {
+      api_fqdn = "127.0.0.1";
+    }
+    if (api_port == 0)
+    {
+      api_port = 30000;
+    }
+  }
+
   /***************************************************************************/
   /* All the command-line has parsed cleanly, so now check that the options  */
   /* are meaningful.                                                         */
@@ -512,6 +850,73 @@ int main(int argc, char ** argv)
     EVEL_INFO("Initialization completed");
   }
 
+  /***************************************************************************/
+  /* Print the per-builder summary on the way out, however we leave.         */
+  /***************************************************************************/
+  atexit(demo_report_builders);
+
+  if (bench_iterations > 0)
+  {
+    if (gzip_threshold > 0 &&
+        gzip_encoder_init(&demo_gzip, GZIP_POST_DEFAULT_LEVEL) != 0)
+    {
+      fprintf(stderr, "Failed to initialize zlib.\n");
+      exit(1);
+    }
+    demo_bench(bench_iterations);
+    evel_terminate();
+    return 0;
+  }
+
+  /***************************************************************************/
+  /* Gzip the bigger events, and/or send events as CBOR, if asked to.        */
+  /***************************************************************************/
+  if (gzip_threshold > 0 || cbor)
+  {
+    GZIP_POST_CONFIG gzip_config = {
+      api_fqdn,
+      api_port,
+      api_path,
+      api_topic,
+      api_secure,
+      api_username,
+      api_password,
+      gzip_threshold,
+      GZIP_POST_DEFAULT_LEVEL,
+      cbor
+    };
+    if (gzip_post_initialize(&gzip_config) != 0)
+    {
+      fprintf(stderr, "Failed to initialize gzip posting.\n");
+      exit(1);
+    }
+  }
+
+  if (latency_heartbeat_ms > 0)
+  {
+    atexit(demo_report_latency);
+    demo_throttle_latency(cycles, latency_heartbeat_ms);
+    evel_terminate();
+    return 0;
+  }
+
+  /***************************************************************************/
+  /* Relay real syslog traffic alongside the demo events, if asked to.       */
+  /***************************************************************************/
+  if (syslog_config.unix_path != NULL || syslog_config.udp_port > 0)
+  {
+    if (syslog_config.source_rate <= 0)
+    {
+      fprintf(stderr, "Syslog rate must be greater than zero.\n");
+      exit(1);
+    }
+    if (syslog_ingest_start(&syslog_config) != 0)
+    {
+      fprintf(stderr, "Failed to start syslog ingestion.\n");
+      exit(1);
+    }
+  }
+
   /***************************************************************************/
   /* Work out a start time for measurements, and sleep for initial period.   */
   /***************************************************************************/
@@ -712,6 +1117,8 @@ int main(int argc, char ** argv)
   /* We are exiting, but allow the final set of events to be dispatched      */
   /* properly first.                                                         */
   /***************************************************************************/
+  syslog_ingest_stop();
+  gzip_post_terminate();
   sleep(2);
   printf("All done - exiting!\n");
   return 0;
@@ -762,6 +1169,8 @@ void *signal_watcher(void *void_sig_set)
     }
   }
 
+  syslog_ingest_stop();
+  gzip_post_terminate();
   evel_terminate();
   exit(0);
   return(NULL);
@@ -781,7 +1190,7 @@ void demo_heartbeat(void)
   heartbeat = evel_new_heartbeat();
   if (heartbeat != NULL)
   {
-    evel_rc = evel_post_event(heartbeat);
+    evel_rc = demo_post_event(heartbeat);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -791,7 +1200,7 @@ void demo_heartbeat(void)
   {
     EVEL_ERROR("New Heartbeat failed");
   }
-  printf("   Processed Heartbeat\n");
+  demo_progress("   Processed Heartbeat\n");
 }
 
 /**************************************************************************//**
@@ -811,7 +1220,7 @@ void demo_fault(void)
                          EVEL_SEVERITY_MAJOR);
   if (fault != NULL)
   {
-    evel_rc = evel_post_event((EVENT_HEADER *)fault);
+    evel_rc = demo_post_event((EVENT_HEADER *)fault);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -821,7 +1230,7 @@ void demo_fault(void)
   {
     EVEL_ERROR("New Fault failed");
   }
-  printf("   Processed empty Fault\n");
+  demo_progress("   Processed empty Fault\n");
 
   fault = evel_new_fault("Another alarm condition",
                          "It broke badly",
@@ -831,7 +1240,7 @@ void demo_fault(void)
   {
     evel_fault_type_set(fault, "Bad things happening");
     evel_fault_interface_set(fault, "An Interface Card");
-    evel_rc = evel_post_event((EVENT_HEADER *)fault);
+    evel_rc = demo_post_event((EVENT_HEADER *)fault);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -841,7 +1250,7 @@ void demo_fault(void)
   {
     EVEL_ERROR("New Fault failed");
   }
-  printf("   Processed partial Fault\n");
+  demo_progress("   Processed partial Fault\n");
 
   fault = evel_new_fault("My alarm condition",
                          "It broke very badly",
@@ -853,7 +1262,7 @@ void demo_fault(void)
     evel_fault_interface_set(fault, "My Interface Card");
     evel_fault_addl_info_add(fault, "name1", "value1");
     evel_fault_addl_info_add(fault, "name2", "value2");
-    evel_rc = evel_post_event((EVENT_HEADER *)fault);
+    evel_rc = demo_post_event((EVENT_HEADER *)fault);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -863,7 +1272,7 @@ void demo_fault(void)
   {
     EVEL_ERROR("New Fault failed");
   }
-  printf("   Processed full Fault\n");
+  demo_progress("   Processed full Fault\n");
 }
 
 /**************************************************************************//**
@@ -956,7 +1365,7 @@ void demo_measurement(const int interval)
     evel_reporting_entity_name_set(&measurement->header, "measurer");
     evel_reporting_entity_id_set(&measurement->header, "measurer_id");
 
-    evel_rc = evel_post_event((EVENT_HEADER *)measurement);
+    evel_rc = demo_post_event((EVENT_HEADER *)measurement);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post Measurement failed %d (%s)",
@@ -968,7 +1377,7 @@ void demo_measurement(const int interval)
   {
     EVEL_ERROR("New Measurement failed");
   }
-  printf("   Processed Measurement\n");
+  demo_progress("   Processed Measurement\n");
 }
 
 /**************************************************************************//**
@@ -1025,7 +1434,7 @@ void demo_mobile_flow(void)
                                        4321);
     if (mobile_flow != NULL)
     {
-      evel_rc = evel_post_event((EVENT_HEADER *)mobile_flow);
+      evel_rc = demo_post_event((EVENT_HEADER *)mobile_flow);
       if (evel_rc != EVEL_SUCCESS)
       {
         EVEL_ERROR("Post Mobile Flow failed %d (%s)",
@@ -1037,12 +1446,12 @@ void demo_mobile_flow(void)
     {
       EVEL_ERROR("New Mobile Flow failed");
     }
-    printf("   Processed empty Mobile Flow\n");
+    demo_progress("   Processed empty Mobile Flow\n");
   }
   else
   {
     EVEL_ERROR("New GTP Per Flow Metrics failed - skipping Mobile Flow");
-    printf("   Skipped empty Mobile Flow\n");
+    demo_progress("   Skipped empty Mobile Flow\n");
   }
 
   metrics = evel_new_mobile_gtp_flow_metrics(132.0001,
@@ -1112,7 +1521,7 @@ void demo_mobile_flow(void)
       evel_mobile_flow_tunnel_id_set(mobile_flow, "Tunnel 1");
       evel_mobile_flow_vlan_id_set(mobile_flow, "15");
 
-      evel_rc = evel_post_event((EVENT_HEADER *)mobile_flow);
+      evel_rc = demo_post_event((EVENT_HEADER *)mobile_flow);
       if (evel_rc != EVEL_SUCCESS)
       {
         EVEL_ERROR("Post Mobile Flow failed %d (%s)",
@@ -1124,12 +1533,12 @@ void demo_mobile_flow(void)
     {
       EVEL_ERROR("New Mobile Flow failed");
     }
-    printf("   Processed partial Mobile Flow\n");
+    demo_progress("   Processed partial Mobile Flow\n");
   }
   else
   {
     EVEL_ERROR("New GTP Per Flow Metrics failed - skipping Mobile Flow");
-    printf("   Skipped partial Mobile Flow\n");
+    demo_progress("   Skipped partial Mobile Flow\n");
   }
 
   metrics = evel_new_mobile_gtp_flow_metrics(12.32,
@@ -1222,7 +1631,7 @@ void demo_mobile_flow(void)
       evel_mobile_flow_tunnel_id_set(mobile_flow, "Tunnel 2");
       evel_mobile_flow_vlan_id_set(mobile_flow, "4096");
 
-      evel_rc = evel_post_event((EVENT_HEADER *)mobile_flow);
+      evel_rc = demo_post_event((EVENT_HEADER *)mobile_flow);
       if (evel_rc != EVEL_SUCCESS)
       {
         EVEL_ERROR("Post Mobile Flow failed %d (%s)",
@@ -1234,12 +1643,12 @@ void demo_mobile_flow(void)
     {
       EVEL_ERROR("New Mobile Flow failed");
     }
-    printf("   Processed full Mobile Flow\n");
+    demo_progress("   Processed full Mobile Flow\n");
   }
   else
   {
     EVEL_ERROR("New GTP Per Flow Metrics failed - skipping Mobile Flow");
-    printf("   Skipped full Mobile Flow\n");
+    demo_progress("   Skipped full Mobile Flow\n");
   }
 }
 
@@ -1311,7 +1720,7 @@ void demo_service_event(const SERVICE_EVENT service_event)
         break;
     }
 
-    evel_rc = evel_post_event((EVENT_HEADER *) event);
+    evel_rc = demo_post_event((EVENT_HEADER *) event);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -1321,7 +1730,7 @@ void demo_service_event(const SERVICE_EVENT service_event)
   {
     EVEL_ERROR("New Service failed");
   }
-  printf("   Processed Service Events\n");
+  demo_progress("   Processed Service Events\n");
 }
 
 /**************************************************************************//**
@@ -1346,7 +1755,7 @@ void demo_signaling(void)
     evel_signaling_remote_port_set(event, "5330");
     evel_signaling_compressed_sip_set(event, "compressed_sip");
     evel_signaling_summary_sip_set(event, "summary_sip");
-    evel_rc = evel_post_event((EVENT_HEADER *) event);
+    evel_rc = demo_post_event((EVENT_HEADER *) event);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -1356,7 +1765,7 @@ void demo_signaling(void)
   {
     EVEL_ERROR("New Signaling failed");
   }
-  printf("   Processed Signaling\n");
+  demo_progress("   Processed Signaling\n");
 }
 
 /**************************************************************************//**
@@ -1378,7 +1787,7 @@ void demo_state_change(void)
     evel_state_change_type_set(state_change, "State Change");
     evel_state_change_addl_field_add(state_change, "Name1", "Value1");
     evel_state_change_addl_field_add(state_change, "Name2", "Value2");
-    evel_rc = evel_post_event((EVENT_HEADER *)state_change);
+    evel_rc = demo_post_event((EVENT_HEADER *)state_change);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -1388,7 +1797,7 @@ void demo_state_change(void)
   {
     EVEL_ERROR("New State Change failed");
   }
-  printf("   Processed State Change\n");
+  demo_progress("   Processed State Change\n");
 }
 
 /**************************************************************************//**
@@ -1407,7 +1816,7 @@ void demo_syslog(void)
                            "EVEL");
   if (syslog != NULL)
   {
-    evel_rc = evel_post_event((EVENT_HEADER *)syslog);
+    evel_rc = demo_post_event((EVENT_HEADER *)syslog);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -1417,7 +1826,7 @@ void demo_syslog(void)
   {
     EVEL_ERROR("New Syslog failed");
   }
-  printf("   Processed empty Syslog\n");
+  demo_progress("   Processed empty Syslog\n");
 
   syslog = evel_new_syslog(EVEL_SOURCE_VIRTUAL_MACHINE,
                            "EVEL library message",
@@ -1433,7 +1842,7 @@ void demo_syslog(void)
     evel_syslog_addl_field_add(syslog, "Name2", "Value2");
     evel_syslog_addl_field_add(syslog, "Name3", "Value3");
     evel_syslog_addl_field_add(syslog, "Name4", "Value4");
-    evel_rc = evel_post_event((EVENT_HEADER *)syslog);
+    evel_rc = demo_post_event((EVENT_HEADER *)syslog);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -1443,7 +1852,7 @@ void demo_syslog(void)
   {
     EVEL_ERROR("New Syslog failed");
   }
-  printf("   Processed full Syslog\n");
+  demo_progress("   Processed full Syslog\n");
 }
 
 /**************************************************************************//**
@@ -1460,7 +1869,7 @@ void demo_other(void)
   other = evel_new_other();
   if (other != NULL)
   {
-    evel_rc = evel_post_event((EVENT_HEADER *)other);
+    evel_rc = demo_post_event((EVENT_HEADER *)other);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -1470,7 +1879,7 @@ void demo_other(void)
   {
     EVEL_ERROR("New Other failed");
   }
-  printf("   Processed empty Other\n");
+  demo_progress("   Processed empty Other\n");
 
   other = evel_new_other();
   if (other != NULL)
@@ -1478,7 +1887,7 @@ void demo_other(void)
     evel_other_field_add(other,
                          "Other field 1",
                          "Other value 1");
-    evel_rc = evel_post_event((EVENT_HEADER *)other);
+    evel_rc = demo_post_event((EVENT_HEADER *)other);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -1488,7 +1897,7 @@ void demo_other(void)
   {
     EVEL_ERROR("New Other failed");
   }
-  printf("   Processed small Other\n");
+  demo_progress("   Processed small Other\n");
 
   other = evel_new_other();
   if (other != NULL)
@@ -1502,7 +1911,7 @@ void demo_other(void)
     evel_other_field_add(other,
                          "Other field C",
                          "Other value C");
-    evel_rc = evel_post_event((EVENT_HEADER *)other);
+    evel_rc = demo_post_event((EVENT_HEADER *)other);
     if (evel_rc != EVEL_SUCCESS)
     {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
@@ -1512,5 +1921,944 @@ void demo_other(void)
   {
     EVEL_ERROR("New Other failed");
   }
-  printf("   Processed large Other\n");
+  demo_progress("   Processed large Other\n");
+}
+
+/**************************************************************************//**
+ * Measurement builder with the default interval, for the builder table.
+ *****************************************************************************/
+void demo_measurement_default(void)
+{
+  demo_measurement(DEFAULT_SLEEP_SECONDS);
+}
+
+/**************************************************************************//**
+ * Hand an event built by one of the demo_* builders on.
+ *
+ * Normally the event is simply posted, gzipped if --gzip applies.  When it
+ * is to be encoded locally, it is serialized into ::demo_json_buffer and then
+ * freed, and the event and its JSON size, CBOR size, and gzipped size if
+ * ::demo_gzip is in use, are attributed to the current builder.
+ *
+ * @param[in] event   The event to post or encode.
+ * @returns Status code from posting the event.
+ *****************************************************************************/
+EVEL_ERR_CODES demo_post_event(EVENT_HEADER * event)
+{
+  EVEL_ERR_CODES evel_rc = EVEL_SUCCESS;
+  int json_size = 0;
+  size_t gzip_size = 0;
+  size_t cbor_size = 0;
+
+#ifdef EVEL_DEMO_ENCODE_BENCH
+  struct timespec encode_start;
+  struct timespec encode_end;
+  struct timespec cbor_end;
+  struct timespec gzip_end;
+
+  if (demo_timing)
+  {
+    clock_gettime(CLOCK_MONOTONIC, &encode_start);
+    demo_phase_ns[DEMO_PHASE_CONSTRUCT] += demo_elapsed_ns(&demo_mark,
+                                                           &encode_start);
+    json_size = evel_json_encode_event(demo_json_buffer,
+                                       DEMO_MAX_JSON_BODY,
+                                       event);
+    clock_gettime(CLOCK_MONOTONIC, &encode_end);
+    demo_phase_ns[DEMO_PHASE_ENCODE] += demo_elapsed_ns(&encode_start,
+                                                        &encode_end);
+    cbor_size = cbor_from_json(demo_json_buffer,
+                               json_size,
+                               demo_cbor_buffer,
+                               DEMO_MAX_JSON_BODY);
+    clock_gettime(CLOCK_MONOTONIC, &cbor_end);
+    demo_phase_ns[DEMO_PHASE_CBOR] += demo_elapsed_ns(&encode_end,
+                                                      &cbor_end);
+    gzip_size = gzip_encode(&demo_gzip,
+                            demo_json_buffer,
+                            json_size,
+                            demo_gzip_buffer,
+                            DEMO_MAX_JSON_BODY);
+    clock_gettime(CLOCK_MONOTONIC, &gzip_end);
+    demo_phase_ns[DEMO_PHASE_GZIP] += demo_elapsed_ns(&cbor_end,
+                                                      &gzip_end);
+    evel_free_event(event);
+
+    /*************************************************************************/
+    /* Anything the builder does from here until its next event counts as    */
+    /* construction of that event.                                           */
+    /*************************************************************************/
+    clock_gettime(CLOCK_MONOTONIC, &demo_mark);
+    demo_phase_ns[DEMO_PHASE_FREE] += demo_elapsed_ns(&gzip_end,
+                                                      &demo_mark);
+  }
+  else
+#endif
+  if (demo_encode_locally)
+  {
+    json_size = evel_json_encode_event(demo_json_buffer,
+                                       DEMO_MAX_JSON_BODY,
+                                       event);
+    cbor_size = cbor_from_json(demo_json_buffer,
+                               json_size,
+                               demo_cbor_buffer,
+                               DEMO_MAX_JSON_BODY);
+    gzip_size = gzip_encode(&demo_gzip,
+                            demo_json_buffer,
+                            json_size,
+                            demo_gzip_buffer,
+                            DEMO_MAX_JSON_BODY);
+#ifdef EVEL_DEMO_ENCODE_BENCH
+    if (demo_dump_dir != NULL && demo_current != NULL)
+    {
+      demo_dump_event(json_size, cbor_size);
+    }
+#endif
+    evel_free_event(event);
+  }
+  else
+  {
+    evel_rc = gzip_post_event(event);
+  }
+
+  if (demo_current != NULL)
+  {
+    demo_current->events++;
+    demo_current->json_bytes += json_size;
+    demo_current->gzip_bytes += gzip_size;
+    demo_current->cbor_bytes += cbor_size;
+  }
+  return evel_rc;
+}
+
+/**************************************************************************//**
+ * Print a builder progress line, unless builders are being run in a loop.
+ *
+ * @param[in] text    The line to print.
+ *****************************************************************************/
+void demo_progress(const char * text)
+{
+  if (!demo_encode_locally)
+  {
+    fputs(text, stdout);
+  }
+}
+
+/**************************************************************************//**
+ * Run one builder with accounting attributed to it.
+ *
+ * @param[in] builder The builder to run.
+ *****************************************************************************/
+void demo_run_builder(DEMO_BUILDER * builder)
+{
+  demo_current = builder;
+#ifdef EVEL_DEMO_MEMSTATS
+  demo_memstats_active = 1;
+#endif
+  builder->run();
+#ifdef EVEL_DEMO_MEMSTATS
+  demo_memstats_active = 0;
+#endif
+  builder->runs++;
+  demo_current = NULL;
+}
+
+/**************************************************************************//**
+ * Run every builder in a loop, encoding the events locally.
+ *
+ * @param[in] iterations  Number of times to run each builder.
+ *****************************************************************************/
+void demo_bench(const int iterations)
+{
+  DEMO_BUILDER * builder;
+  int iteration;
+
+  printf("Running each builder %d times...\n", iterations);
+  demo_encode_locally = 1;
+  for (builder = demo_builders; builder->name != NULL; builder++)
+  {
+    for (iteration = 0; iteration < iterations; iteration++)
+    {
+      demo_run_builder(builder);
+    }
+  }
+  demo_encode_locally = 0;
+}
+
+/**************************************************************************//**
+ * Print the per-builder summary table.
+ *
+ * Only builders that have been run through ::demo_run_builder appear.  Sizes
+ * are only known for events that were encoded locally.
+ *****************************************************************************/
+void demo_report_builders(void)
+{
+  DEMO_BUILDER * builder;
+  unsigned long long events;
+
+  for (builder = demo_builders; builder->name != NULL; builder++)
+  {
+    if (builder->runs > 0)
+    {
+      break;
+    }
+  }
+  if (builder->name == NULL)
+  {
+    return;
+  }
+
+  printf("\n%-18s %-25s %8s %8s %10s %10s %10s %12s %10s %10s %12s\n",
+         "Builder", "Domain", "Runs", "Events", "JSON/event", "CBOR/event",
+         "Gzip/event", "Allocs/run", "Frees/run", "Bytes/run", "Bytes/event");
+  for (builder = demo_builders; builder->name != NULL; builder++)
+  {
+    if (builder->runs == 0)
+    {
+      continue;
+    }
+    events = (builder->events > 0) ? builder->events : 1;
+    printf("%-18s %-25s %8llu %8llu %10llu %10llu %10llu %12.1f %10.1f "
+           "%10.1f %12.1f\n",
+           builder->name,
+           builder->domain,
+           builder->runs,
+           builder->events,
+           builder->json_bytes / events,
+           builder->cbor_bytes / events,
+           builder->gzip_bytes / events,
+           (double)builder->allocs / builder->runs,
+           (double)builder->frees / builder->runs,
+           (double)builder->alloc_bytes / builder->runs,
+           (double)builder->alloc_bytes / events);
+  }
+#ifndef EVEL_DEMO_MEMSTATS
+  printf("(allocation figures need a build with EVEL_DEMO_MEMSTATS defined)\n");
+#endif
+  if (!demo_gzip.initialized)
+  {
+    printf("(gzip figures need --gzip)\n");
+  }
+  fflush(stdout);
+}
+
+/**************************************************************************//**
+ * Throttle-reaction latency measurement.
+ *
+ * Each step issues one testControl command and names what should change in
+ * the agent as a result: the measurement interval, or the encoded size of the
+ * events from one builder (smaller when the domain is suppressed; a reset
+ * takes new unthrottled sizes).
+ *
+ * The library replaces its throttling specifications on its event handler
+ * thread, under no lock a client can take, so the encoded sizes are only
+ * probed when no command is outstanding.  Suppress and reset commands are
+ * followed by a measurement interval change to a fence value, which the
+ * collector delivers in the same commandList or a later one.  The library
+ * applies commands in order, so once evel_get_measurement_interval() reads
+ * the fence back, the command before it has been applied and nothing else is
+ * pending.
+ *****************************************************************************/
+typedef enum {
+  DEMO_EXPECT_INTERVAL,
+  DEMO_EXPECT_SUPPRESSED,
+  DEMO_EXPECT_RESTORED
+} DEMO_EXPECTATION;
+
+typedef struct demo_control_step {
+  const char * description;
+  DEMO_EXPECTATION expect;
+  int interval;
+  EVEL_TEST_CONTROL_SCENARIO scenario;
+  const char * probe;
+} DEMO_CONTROL_STEP;
+
+static const DEMO_CONTROL_STEP demo_control_steps[] = {
+  {"reset all domains",    DEMO_EXPECT_RESTORED,   0,
+                          TC_RESET_ALL_DOMAINS,                 NULL},
+  {"interval 2s",          DEMO_EXPECT_INTERVAL,   2,
+                          TC_RESET_ALL_DOMAINS,                 NULL},
+  {"suppress fault",       DEMO_EXPECT_SUPPRESSED, 0,
+                          TC_FAULT_SUPPRESS_FIELDS_AND_PAIRS,   "demo_fault"},
+  {"suppress measurement", DEMO_EXPECT_SUPPRESSED, 0,
+                          TC_MEAS_SUPPRESS_FIELDS_AND_PAIRS,    "demo_measurement"},
+  {"interval 5s",          DEMO_EXPECT_INTERVAL,   5,
+                          TC_RESET_ALL_DOMAINS,                 NULL},
+  {"suppress mobile flow", DEMO_EXPECT_SUPPRESSED, 0,
+                          TC_MOBILE_SUPPRESS_FIELDS_AND_PAIRS,  "demo_mobile_flow"},
+  {"suppress state change",DEMO_EXPECT_SUPPRESSED, 0,
+                          TC_STATE_SUPPRESS_FIELDS_AND_PAIRS,   "demo_state_change"},
+  {"suppress signaling",   DEMO_EXPECT_SUPPRESSED, 0,
+                          TC_SIGNALING_SUPPRESS_FIELDS,         "demo_signaling"},
+  {"suppress service",     DEMO_EXPECT_SUPPRESSED, 0,
+                          TC_SERVICE_SUPPRESS_FIELDS_AND_PAIRS, "demo_service"},
+  {"interval 20s",         DEMO_EXPECT_INTERVAL,   20,
+                          TC_RESET_ALL_DOMAINS,                 NULL},
+  {"suppress syslog",      DEMO_EXPECT_SUPPRESSED, 0,
+                          TC_SYSLOG_SUPPRESS_FIELDS_AND_PAIRS,  "demo_syslog"},
+  {"interval 10s",         DEMO_EXPECT_INTERVAL,   10,
+                          TC_RESET_ALL_DOMAINS,                 NULL},
+  {NULL, 0, 0, 0, NULL}
+};
+
+/**************************************************************************//**
+ * How long to wait for a command to take effect, and how often to look.
+ *****************************************************************************/
+#define DEMO_LATENCY_TIMEOUT_MS 60000
+#define DEMO_LATENCY_POLL_MS 10
+#define DEMO_MAX_LATENCY_SAMPLES 4096
+
+/**************************************************************************//**
+ * Fence intervals start here, well above any real measurement interval, and
+ * each is one more than the last so that it always changes the interval.
+ *
+ * A fence is posted straight after the command it follows, and relies on the
+ * collector sending both in one commandList rather than only the last.
+ *****************************************************************************/
+#define DEMO_FENCE_INTERVAL 100000
+
+/**************************************************************************//**
+ * Bytes per event by which a probe may fall short of the baseline without
+ * counting as suppression: sequence numbers, and event IDs derived from them,
+ * gain digits as the run goes on.
+ *****************************************************************************/
+#define DEMO_PROBE_SLACK 16
+
+/**************************************************************************//**
+ * Recorded propagation delays, in milliseconds, for interval changes and for
+ * domain suppression/restoration, plus the commands that never took effect,
+ * were applied without shrinking the events, or had nothing to change.
+ *****************************************************************************/
+typedef struct demo_latency_samples {
+  const char * name;
+  double samples[DEMO_MAX_LATENCY_SAMPLES];
+  int count;
+  int timeouts;
+  int unchanged;
+  int no_ops;
+} DEMO_LATENCY_SAMPLES;
+
+static DEMO_LATENCY_SAMPLES demo_interval_latency = {"interval"};
+static DEMO_LATENCY_SAMPLES demo_suppress_latency = {"suppression"};
+
+/**************************************************************************//**
+ * Find a builder in the builder table by name.
+ *
+ * @param[in] name    Name of the builder.
+ * @returns The builder, or NULL if there is none of that name.
+ *****************************************************************************/
+static DEMO_BUILDER * demo_find_builder(const char * name)
+{
+  DEMO_BUILDER * builder;
+
+  for (builder = demo_builders; builder->name != NULL; builder++)
+  {
+    if (strcmp(builder->name, name) == 0)
+    {
+      return builder;
+    }
+  }
+  return NULL;
+}
+
+/**************************************************************************//**
+ * Encoded JSON size of one run of a builder, under the current throttling.
+ *
+ * The builder's accounting is left as it was, so probes don't appear in the
+ * per-builder summary.  Only call this when no command is outstanding.
+ *
+ * @param[in] builder The builder to probe.
+ * @param[out] events Number of events the run produced.
+ * @returns Total JSON bytes of the events produced.
+ *****************************************************************************/
+static unsigned long long demo_probe_json_size(DEMO_BUILDER * builder,
+                                               unsigned long long * events)
+{
+  DEMO_BUILDER saved = *builder;
+  int encode_locally = demo_encode_locally;
+  unsigned long long json_size;
+
+  demo_encode_locally = 1;
+  demo_run_builder(builder);
+  json_size = builder->json_bytes - saved.json_bytes;
+  *events = builder->events - saved.events;
+  *builder = saved;
+  demo_encode_locally = encode_locally;
+  return json_size;
+}
+
+/**************************************************************************//**
+ * Take the unthrottled JSON size of each builder.
+ *
+ * @param[out] baseline   JSON size of each builder, by index.
+ *****************************************************************************/
+static void demo_take_baseline(unsigned long long * baseline)
+{
+  DEMO_BUILDER * builder;
+  unsigned long long events;
+
+  for (builder = demo_builders; builder->name != NULL; builder++)
+  {
+    baseline[builder - demo_builders] = demo_probe_json_size(builder, &events);
+  }
+}
+
+/**************************************************************************//**
+ * Whether a builder's events are now smaller than its baseline by more than
+ * the slack allowed for their growing sequence numbers.
+ *
+ * @param[in] builder     The builder to probe.
+ * @param[in] baseline    Unthrottled JSON size of each builder.
+ * @returns 1 if suppressed, 0 otherwise.
+ *****************************************************************************/
+static int demo_is_suppressed(DEMO_BUILDER * builder,
+                              const unsigned long long * baseline)
+{
+  unsigned long long events;
+  unsigned long long json_size = demo_probe_json_size(builder, &events);
+
+  return json_size + events * DEMO_PROBE_SLACK <
+                                            baseline[builder - demo_builders];
+}
+
+/**************************************************************************//**
+ * Milliseconds on the monotonic clock.
+ *****************************************************************************/
+static double demo_now_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+/**************************************************************************//**
+ * Post a heartbeat every heartbeat_ms until the library's measurement
+ * interval reads back as expected.
+ *
+ * The commandList set through the testControl API only reaches the agent in
+ * the response to its next event, so the heartbeats stand in for the agent's
+ * normal event stream.
+ *
+ * @param[in] interval      The interval to wait for.
+ * @param[in] heartbeat_ms  Interval between heartbeats.
+ * @param[in] issued        When the command was issued, in milliseconds.
+ * @returns When the interval was seen, in milliseconds, or 0 if it wasn't
+ *          within ::DEMO_LATENCY_TIMEOUT_MS.
+ *****************************************************************************/
+static double demo_await_interval(const int interval,
+                                  const int heartbeat_ms,
+                                  const double issued)
+{
+  EVENT_HEADER * heartbeat = NULL;
+  double last_heartbeat = 0;
+  double now = issued;
+
+  while (now - issued < DEMO_LATENCY_TIMEOUT_MS && !glob_exit_now)
+  {
+    if (now - last_heartbeat >= heartbeat_ms)
+    {
+      heartbeat = evel_new_heartbeat();
+      if (heartbeat != NULL)
+      {
+        evel_post_event(heartbeat);
+      }
+      else
+      {
+        EVEL_ERROR("New heartbeat failed");
+      }
+      last_heartbeat = now;
+    }
+    usleep(DEMO_LATENCY_POLL_MS * 1000);
+    now = demo_now_ms();
+    if (evel_get_measurement_interval() == interval)
+    {
+      return now;
+    }
+  }
+  return 0;
+}
+
+/**************************************************************************//**
+ * Measure the propagation delay of throttling commands.
+ *
+ * The delay runs from just before the testControl request to the first poll
+ * at which the command is seen to have been applied.
+ *
+ * @param[in] cycles        Number of commands to issue.
+ * @param[in] heartbeat_ms  Interval between heartbeats while waiting.
+ *****************************************************************************/
+void demo_throttle_latency(const int cycles, const int heartbeat_ms)
+{
+  unsigned long long baseline[sizeof(demo_builders) / sizeof(demo_builders[0])];
+  const DEMO_CONTROL_STEP * step = demo_control_steps;
+  DEMO_LATENCY_SAMPLES * samples;
+  int fence = DEMO_FENCE_INTERVAL;
+  int expected;
+  int settled;
+  int cycle = 0;
+  double issued;
+  double applied;
+
+  /***************************************************************************/
+  /* Reset the collector's throttling and, once that has been applied, take  */
+  /* the unthrottled sizes.                                                  */
+  /***************************************************************************/
+  evel_test_control_scenario(TC_RESET_ALL_DOMAINS,
+                             api_secure,
+                             api_fqdn,
+                             api_port);
+  evel_test_control_meas_interval(++fence,
+                                  api_secure,
+                                  api_fqdn,
+                                  api_port);
+  if (demo_await_interval(fence, heartbeat_ms, demo_now_ms()) == 0)
+  {
+    fprintf(stderr, "Throttling reset did not take effect within %d ms.\n",
+            DEMO_LATENCY_TIMEOUT_MS);
+    return;
+  }
+  demo_take_baseline(baseline);
+  settled = 1;
+
+  printf("Measuring throttle reaction for %d commands...\n", cycles);
+  while (cycle++ < cycles && !glob_exit_now)
+  {
+    samples = (step->expect == DEMO_EXPECT_INTERVAL) ?
+                               &demo_interval_latency : &demo_suppress_latency;
+
+    /*************************************************************************/
+    /* A suppression can only be checked for beforehand if the last command  */
+    /* was seen to be applied; a reset is always issued, to renew the        */
+    /* baseline.                                                             */
+    /*************************************************************************/
+    if ((step->expect == DEMO_EXPECT_INTERVAL &&
+         evel_get_measurement_interval() == step->interval) ||
+        (step->expect == DEMO_EXPECT_SUPPRESSED && settled &&
+         demo_is_suppressed(demo_find_builder(step->probe), baseline)))
+    {
+      printf("   %-24s already in effect\n", step->description);
+      samples->no_ops++;
+    }
+    else
+    {
+      issued = demo_now_ms();
+      if (step->expect == DEMO_EXPECT_INTERVAL)
+      {
+        evel_test_control_meas_interval(step->interval,
+                                        api_secure,
+                                        api_fqdn,
+                                        api_port);
+        expected = step->interval;
+      }
+      else
+      {
+        evel_test_control_scenario(step->scenario,
+                                   api_secure,
+                                   api_fqdn,
+                                   api_port);
+        evel_test_control_meas_interval(++fence,
+                                        api_secure,
+                                        api_fqdn,
+                                        api_port);
+        expected = fence;
+      }
+
+      applied = demo_await_interval(expected, heartbeat_ms, issued);
+      settled = (applied > 0);
+      if (!settled)
+      {
+        printf("   %-24s did not take effect within %d ms\n",
+               step->description, DEMO_LATENCY_TIMEOUT_MS);
+        samples->timeouts++;
+      }
+      else if (step->expect == DEMO_EXPECT_SUPPRESSED &&
+               !demo_is_suppressed(demo_find_builder(step->probe), baseline))
+      {
+        printf("   %-24s applied after %.1f ms but %s events did not "
+               "shrink\n", step->description, applied - issued, step->probe);
+        samples->unchanged++;
+      }
+      else
+      {
+        if (step->expect == DEMO_EXPECT_RESTORED)
+        {
+          demo_take_baseline(baseline);
+        }
+        printf("   %-24s took effect after %.1f ms\n",
+               step->description, applied - issued);
+        if (samples->count < DEMO_MAX_LATENCY_SAMPLES)
+        {
+          samples->samples[samples->count++] = applied - issued;
+        }
+      }
+    }
+    fflush(stdout);
+
+    step++;
+    if (step->description == NULL)
+    {
+      step = demo_control_steps;
+    }
+  }
+}
+
+/**************************************************************************//**
+ * Comparison function for qsort() of latency samples.
+ *****************************************************************************/
+static int demo_compare_ms(const void * a, const void * b)
+{
+  const double x = *(const double *)a;
+  const double y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/**************************************************************************//**
+ * Print the distribution of one set of latency samples.
+ *
+ * @param[in] samples     The samples, which are sorted in place.
+ *****************************************************************************/
+static void demo_report_latency_samples(DEMO_LATENCY_SAMPLES * samples)
+{
+  const int count = samples->count;
+  double total = 0;
+  int i;
+
+  printf("%-12s %6d %8d %9d %6d", samples->name, count, samples->timeouts,
+         samples->unchanged, samples->no_ops);
+  if (count == 0)
+  {
+    printf("\n");
+    return;
+  }
+
+  qsort(samples->samples, count, sizeof(double), demo_compare_ms);
+  for (i = 0; i < count; i++)
+  {
+    total += samples->samples[i];
+  }
+  printf(" %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+         samples->samples[0],
+         samples->samples[count / 2],
+         samples->samples[(count * 90 - 1) / 100],
+         samples->samples[(count * 99 - 1) / 100],
+         samples->samples[count - 1],
+         total / count);
+}
+
+/**************************************************************************//**
+ * Print the throttle-reaction latency distribution, in milliseconds.
+ *****************************************************************************/
+void demo_report_latency(void)
+{
+  printf("\n%-12s %6s %8s %9s %6s %9s %9s %9s %9s %9s %9s\n",
+         "Command", "Count", "Timeouts", "Unchanged", "No-ops",
+         "Min", "Median", "P90", "P99", "Max", "Mean");
+  demo_report_latency_samples(&demo_interval_latency);
+  demo_report_latency_samples(&demo_suppress_latency);
+  fflush(stdout);
+}
+
+#ifdef EVEL_DEMO_ENCODE_BENCH
+/**************************************************************************//**
+ * Definition of long options to the encoding benchmark.
+ *****************************************************************************/
+static const struct option bench_long_options[] = {
+    {"help",       no_argument,       0, 'h'},
+    {"iterations", required_argument, 0, 'n'},
+    {"warmup",     required_argument, 0, 'w'},
+    {"output",     required_argument, 0, 'o'},
+    {"gzip-level", required_argument, 0, 'z'},
+    {"dump",       required_argument, 0, 'd'},
+    {0, 0, 0, 0}
+  };
+
+static const char* bench_short_options = "hn:w:o:z:d:";
+
+static const char* bench_usage_text =
+"evel_encode_bench [--help]\n"
+"                  [--iterations <iterations>]\n"
+"                  [--warmup <iterations>]\n"
+"                  [--output <file>]\n"
+"                  [--gzip-level <level>]\n"
+"                  [--dump <dir>]\n"
+"\n"
+"Time construction, JSON encoding, CBOR transcoding, gzip compression and\n"
+"freeing of the events produced by each of the evel_demo builders, and write\n"
+"the results as JSON.  The JSON, CBOR and gzipped sizes give the bytes on the\n"
+"wire with and without --cbor and --gzip, and cbor_ns and gzip_ns the agent\n"
+"CPU they cost.\n"
+"\n"
+"  -n         Measured runs of each builder.  Default = 10000.\n"
+"  --iterations\n"
+"\n"
+"  -w         Unmeasured warm-up runs of each builder.  Default = 1000.\n"
+"  --warmup\n"
+"\n"
+"  -o         Write the results to <file> rather than stdout.\n"
+"  --output\n"
+"\n"
+"  -z         zlib compression level, 1-9.  Default = 6.\n"
+"  --gzip-level\n"
+"\n"
+"  -d         Rather than timing anything, run each builder once and write\n"
+"  --dump     each event's JSON and CBOR to <dir>/<builder>-<n>.json and\n"
+"             .cbor, for tests/collector/cbor_roundtrip_test.py to check\n"
+"             against the collector's decoder.\n";
+
+/**************************************************************************//**
+ * Comparison function for qsort() of nanosecond samples.
+ *****************************************************************************/
+static int bench_compare_ns(const void * a, const void * b)
+{
+  const unsigned long long x = *(const unsigned long long *)a;
+  const unsigned long long y = *(const unsigned long long *)b;
+
+  return (x > y) - (x < y);
+}
+
+/**************************************************************************//**
+ * Write summary statistics for one phase of one builder.
+ *
+ * The samples are sorted in place.  Percentiles are nearest-rank.
+ *
+ * @param[in] fp          Stream to write to.
+ * @param[in] name        Name of the phase.
+ * @param[in] samples     Per-run samples, in nanoseconds.
+ * @param[in] count       Number of samples.
+ * @param[in] last        Whether this is the last phase for the builder.
+ *****************************************************************************/
+static void bench_write_phase(FILE * fp,
+                              const char * name,
+                              unsigned long long * samples,
+                              const int count,
+                              const int last)
+{
+  unsigned long long total = 0;
+  int i;
+
+  qsort(samples, count, sizeof(samples[0]), bench_compare_ns);
+  for (i = 0; i < count; i++)
+  {
+    total += samples[i];
+  }
+
+  fprintf(fp, "      \"%s\": {\"min\": %llu, \"median\": %llu, "
+              "\"mean\": %llu, \"p90\": %llu, \"p99\": %llu, "
+              "\"max\": %llu}%s\n",
+          name,
+          samples[0],
+          samples[count / 2],
+          total / count,
+          samples[(count * 90 - 1) / 100],
+          samples[(count * 99 - 1) / 100],
+          samples[count - 1],
+          last ? "" : ",");
+}
+
+/**************************************************************************//**
+ * Main function of the encoding benchmark.
+ *
+ * Each builder in turn is warmed up and then run the requested number of
+ * times with every event encoded locally and freed.  Only the statistics of
+ * the per-run phase totals are reported, in a fixed order, so results from
+ * different library versions can be diffed directly.
+ *
+ * @param[in] argc  Argument count.
+ * @param[in] argv  Argument vector - for usage see bench_usage_text.
+ *****************************************************************************/
+int main(int argc, char ** argv)
+{
+  int option_index = 0;
+  int param = 0;
+  int iterations = 10000;
+  int warmup = 1000;
+  char * output = NULL;
+  int gzip_level = GZIP_POST_DEFAULT_LEVEL;
+  FILE * fp = stdout;
+  DEMO_BUILDER * builder;
+  unsigned long long * samples[DEMO_PHASE_MAX];
+  unsigned long long events;
+  int iteration;
+  int phase;
+
+  param = getopt_long(argc, argv,
+                      bench_short_options,
+                      bench_long_options,
+                      &option_index);
+  while (param != -1)
+  {
+    switch (param)
+    {
+      case 'h':
+        fputs(bench_usage_text, stdout);
+        exit(0);
+        break;
+
+      case 'n':
+        iterations = atoi(optarg);
+        break;
+
+      case 'w':
+        warmup = atoi(optarg);
+        break;
+
+      case 'o':
+        output = optarg;
+        break;
+
+      case 'z':
+        gzip_level = atoi(optarg);
+        break;
+
+      case 'd':
+        demo_dump_dir = optarg;
+        break;
+
+      default:
+        fputs(bench_usage_text, stderr);
+        exit(-1);
+    }
+    param = getopt_long(argc, argv,
+                        bench_short_options,
+                        bench_long_options,
+                        &option_index);
+  }
+
+  if (iterations <= 0 || warmup < 0)
+  {
+    fprintf(stderr, "Iterations must be greater than zero and warm-up must "
+                    "not be negative.\n");
+    exit(1);
+  }
+  if (gzip_encoder_init(&demo_gzip, gzip_level) != 0)
+  {
+    fprintf(stderr, "Gzip level must be between 1 and 9.\n");
+    exit(1);
+  }
+
+  if (output != NULL && demo_dump_dir == NULL)
+  {
+    fp = fopen(output, "w");
+    if (fp == NULL)
+    {
+      fprintf(stderr, "Failed to open %s for writing.\n", output);
+      exit(1);
+    }
+  }
+
+  for (phase = 0; phase < DEMO_PHASE_MAX; phase++)
+  {
+    samples[phase] = malloc(iterations * sizeof(unsigned long long));
+    if (samples[phase] == NULL)
+    {
+      fprintf(stderr, "Failed to allocate sample storage.\n");
+      exit(1);
+    }
+  }
+
+  /***************************************************************************/
+  /* Nothing is posted, but the library must be initialized for the event    */
+  /* constructors to fill in the common header.                              */
+  /***************************************************************************/
+  if (evel_initialize("127.0.0.1",
+                      30000,
+                      NULL,
+                      NULL,
+                      0,
+                      "",
+                      "",
+                      EVEL_SOURCE_VIRTUAL_MACHINE,
+                      "EVEL encode benchmark",
+                      0))
+  {
+    fprintf(stderr, "Failed to initialize the EVEL library!!!\n");
+    exit(-1);
+  }
+
+  demo_encode_locally = 1;
+  if (demo_dump_dir != NULL)
+  {
+    for (builder = demo_builders; builder->name != NULL; builder++)
+    {
+      demo_current = builder;
+      builder->run();
+      printf("%s: %llu events written to %s\n",
+             builder->name, builder->events, demo_dump_dir);
+    }
+    demo_current = NULL;
+    gzip_encoder_end(&demo_gzip);
+    evel_terminate();
+    return 0;
+  }
+
+  fprintf(fp, "{\n");
+  fprintf(fp, "  \"benchmark\": \"evel_encode\",\n");
+  fprintf(fp, "  \"iterations\": %d,\n", iterations);
+  fprintf(fp, "  \"warmup\": %d,\n", warmup);
+  fprintf(fp, "  \"gzip_level\": %d,\n", gzip_level);
+  fprintf(fp, "  \"builders\": [\n");
+
+  for (builder = demo_builders; builder->name != NULL; builder++)
+  {
+    for (iteration = 0; iteration < warmup; iteration++)
+    {
+      builder->run();
+    }
+
+    demo_timing = 1;
+    demo_current = builder;
+    for (iteration = 0; iteration < iterations; iteration++)
+    {
+      memset(demo_phase_ns, 0, sizeof(demo_phase_ns));
+      clock_gettime(CLOCK_MONOTONIC, &demo_mark);
+      builder->run();
+      builder->runs++;
+      for (phase = 0; phase < DEMO_PHASE_MAX; phase++)
+      {
+        samples[phase][iteration] = demo_phase_ns[phase];
+      }
+    }
+    demo_current = NULL;
+    demo_timing = 0;
+
+    events = (builder->events > 0) ? builder->events : 1;
+    fprintf(fp, "    {\n");
+    fprintf(fp, "      \"builder\": \"%s\",\n", builder->name);
+    fprintf(fp, "      \"domain\": \"%s\",\n", builder->domain);
+    fprintf(fp, "      \"events_per_run\": %llu,\n",
+            builder->events / builder->runs);
+    fprintf(fp, "      \"json_bytes_per_event\": %llu,\n",
+            builder->json_bytes / events);
+    fprintf(fp, "      \"cbor_bytes_per_event\": %llu,\n",
+            builder->cbor_bytes / events);
+    fprintf(fp, "      \"gzip_bytes_per_event\": %llu,\n",
+            builder->gzip_bytes / events);
+    for (phase = 0; phase < DEMO_PHASE_MAX; phase++)
+    {
+      bench_write_phase(fp,
+                        demo_phase_names[phase],
+                        samples[phase],
+                        iterations,
+                        phase == DEMO_PHASE_MAX - 1);
+    }
+    fprintf(fp, "    }%s\n", ((builder + 1)->name != NULL) ? "," : "");
+  }
+
+  fprintf(fp, "  ]\n");
+  fprintf(fp, "}\n");
+
+  if (fp != stdout)
+  {
+    fclose(fp);
+  }
+  for (phase = 0; phase < DEMO_PHASE_MAX; phase++)
+  {
+    free(samples[phase]);
+  }
+  gzip_encoder_end(&demo_gzip);
+  evel_terminate();
+  return 0;
 }
+#endif
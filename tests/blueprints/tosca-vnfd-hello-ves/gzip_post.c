@@ -0,0 +1,387 @@
+/**************************************************************************//**
+ * @file
+ * Gzip-compressed and CBOR-encoded event posting for the vHello_VES agent.
+ *
+ * Each event is encoded with evel_json_encode_event() and, in CBOR mode,
+ * transcoded to CBOR.  If the body reaches the threshold it is gzipped with
+ * a reused zlib stream.  Bodies that are CBOR or gzipped are posted over one
+ * keep-alive libcurl handle; otherwise the encoding is thrown away and the
+ * event goes to evel_post_event() as normal.  Heartbeats always go to
+ * evel_post_event(), since the collector's commandLists are only acted on
+ * in responses to the library's own posts.  JSON bytes and bytes on the
+ * wire, and the CPU time spent transcoding and compressing, are totalled so
+ * the saving can be weighed against its cost.
+ *
+ * Copyright 2017 AT&T Intellectual Property, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <curl/curl.h>
+
+#include "evel.h"
+#include "gzip_post.h"
+#include "cbor_encode.h"
+
+/**************************************************************************//**
+ * Largest URL and credentials string built.
+ *****************************************************************************/
+#define GZIP_POST_MAX_URL 512
+
+/**************************************************************************//**
+ * Seconds allowed for one post.
+ *****************************************************************************/
+#define GZIP_POST_TIMEOUT 10
+
+static GZIP_POST_CONFIG gzip_config;
+static int gzip_enabled = 0;
+static pthread_mutex_t gzip_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GZIP_ENCODER gzip_encoder;
+static CURL * gzip_curl = NULL;
+static struct curl_slist * gzip_headers = NULL;
+static struct curl_slist * gzip_plain_headers = NULL;
+static char gzip_url[GZIP_POST_MAX_URL];
+static char gzip_userpwd[GZIP_POST_MAX_URL];
+static char gzip_json[GZIP_POST_MAX_JSON];
+static char gzip_body[GZIP_POST_MAX_JSON];
+static unsigned char gzip_cbor[GZIP_POST_MAX_JSON];
+
+/**************************************************************************//**
+ * Totals reported by gzip_post_terminate().
+ *****************************************************************************/
+static unsigned long gzip_posted = 0;
+static unsigned long gzip_failed = 0;
+static unsigned long gzip_passed = 0;
+static unsigned long long gzip_json_bytes = 0;
+static unsigned long long gzip_wire_bytes = 0;
+static unsigned long long gzip_cpu_ns = 0;
+
+/**************************************************************************//**
+ * Set up an encoder.
+ *
+ * A window of 15 bits plus 16 asks zlib for a gzip rather than a zlib
+ * wrapper, which is what "Content-Encoding: gzip" means.
+ *
+ * @param[out] encoder  The encoder.
+ * @param[in] level     zlib compression level, 1-9.
+ * @returns 0 on success, -1 on failure.
+ *****************************************************************************/
+int gzip_encoder_init(GZIP_ENCODER * encoder, int level)
+{
+  memset(encoder, 0, sizeof(*encoder));
+  if (deflateInit2(&encoder->stream,
+                   level,
+                   Z_DEFLATED,
+                   15 + 16,
+                   8,
+                   Z_DEFAULT_STRATEGY) != Z_OK)
+  {
+    return -1;
+  }
+  encoder->initialized = 1;
+  return 0;
+}
+
+/**************************************************************************//**
+ * Gzip a buffer.
+ *
+ * @param[in] encoder   The encoder.
+ * @param[in] in        The data to compress.
+ * @param[in] length    Length of the data.
+ * @param[out] out      Buffer for the gzip stream.
+ * @param[in] out_size  Size of the buffer.
+ * @returns Length of the gzip stream, or 0 if it didn't fit or failed.
+ *****************************************************************************/
+size_t gzip_encode(GZIP_ENCODER * encoder,
+                   const char * in,
+                   size_t length,
+                   char * out,
+                   size_t out_size)
+{
+  size_t encoded = 0;
+
+  if (!encoder->initialized || deflateReset(&encoder->stream) != Z_OK)
+  {
+    return 0;
+  }
+  encoder->stream.next_in = (Bytef *)in;
+  encoder->stream.avail_in = length;
+  encoder->stream.next_out = (Bytef *)out;
+  encoder->stream.avail_out = out_size;
+  if (deflate(&encoder->stream, Z_FINISH) == Z_STREAM_END)
+  {
+    encoded = out_size - encoder->stream.avail_out;
+  }
+  return encoded;
+}
+
+/**************************************************************************//**
+ * Free an encoder's zlib state.
+ *
+ * @param[in] encoder   The encoder.
+ *****************************************************************************/
+void gzip_encoder_end(GZIP_ENCODER * encoder)
+{
+  if (encoder->initialized)
+  {
+    deflateEnd(&encoder->stream);
+    encoder->initialized = 0;
+  }
+}
+
+/**************************************************************************//**
+ * CPU time used by the calling thread, in nanoseconds.
+ *****************************************************************************/
+static unsigned long long gzip_cpu_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**************************************************************************//**
+ * libcurl write callback: the response body is not used.
+ *****************************************************************************/
+static size_t gzip_discard(void * data, size_t size, size_t nmemb, void * user)
+{
+  return size * nmemb;
+}
+
+/**************************************************************************//**
+ * Enable gzip posting.  Must follow evel_initialize().
+ *
+ * The URL is built the same way as the library builds its own, so gzipped
+ * and uncompressed events reach the same listener.
+ *
+ * @param[in] config    Where to post, and the threshold and level to use.
+ * @returns 0 on success, -1 on failure.
+ *****************************************************************************/
+int gzip_post_initialize(const GZIP_POST_CONFIG * config)
+{
+  gzip_config = *config;
+  if (gzip_config.level < 1 || gzip_config.level > 9)
+  {
+    gzip_config.level = GZIP_POST_DEFAULT_LEVEL;
+  }
+
+  snprintf(gzip_url, sizeof(gzip_url), "%s://%s:%d%s%s/eventListener/v%d%s%s",
+           gzip_config.secure ? "https" : "http",
+           gzip_config.fqdn,
+           gzip_config.port,
+           (gzip_config.path != NULL) ? "/" : "",
+           (gzip_config.path != NULL) ? gzip_config.path : "",
+           EVEL_API_MAJOR_VERSION,
+           (gzip_config.topic != NULL) ? "/" : "",
+           (gzip_config.topic != NULL) ? gzip_config.topic : "");
+  snprintf(gzip_userpwd, sizeof(gzip_userpwd), "%s:%s",
+           gzip_config.username, gzip_config.password);
+
+  if (gzip_encoder_init(&gzip_encoder, gzip_config.level) != 0)
+  {
+    EVEL_ERROR("Gzip: failed to initialize zlib");
+    return -1;
+  }
+
+  gzip_curl = curl_easy_init();
+  if (gzip_curl == NULL)
+  {
+    EVEL_ERROR("Gzip: failed to get a libcurl handle");
+    gzip_encoder_end(&gzip_encoder);
+    return -1;
+  }
+  gzip_plain_headers = curl_slist_append(gzip_plain_headers,
+                                         gzip_config.cbor ?
+                                         "Content-Type: " CBOR_CONTENT_TYPE :
+                                         "Content-Type: application/json");
+  gzip_headers = curl_slist_append(gzip_headers,
+                                   gzip_config.cbor ?
+                                   "Content-Type: " CBOR_CONTENT_TYPE :
+                                   "Content-Type: application/json");
+  gzip_headers = curl_slist_append(gzip_headers, "Content-Encoding: gzip");
+  curl_easy_setopt(gzip_curl, CURLOPT_URL, gzip_url);
+  curl_easy_setopt(gzip_curl, CURLOPT_USERPWD, gzip_userpwd);
+  curl_easy_setopt(gzip_curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+  curl_easy_setopt(gzip_curl, CURLOPT_TIMEOUT, GZIP_POST_TIMEOUT);
+  curl_easy_setopt(gzip_curl, CURLOPT_NOSIGNAL, 1L);
+  curl_easy_setopt(gzip_curl, CURLOPT_WRITEFUNCTION, gzip_discard);
+  curl_easy_setopt(gzip_curl, CURLOPT_POST, 1L);
+
+  gzip_enabled = 1;
+  EVEL_INFO("Gzip: posting %s events%s to %s, gzip threshold %lu level %d",
+            gzip_config.cbor ? "CBOR" : "JSON",
+            gzip_config.cbor ? "" : " over the threshold",
+            gzip_url,
+            (unsigned long)gzip_config.threshold,
+            gzip_config.level);
+  return 0;
+}
+
+/**************************************************************************//**
+ * Post an event as CBOR and/or gzipped, as configured, otherwise through
+ * evel_post_event().  Either way the event is owned by the callee
+ * afterwards.
+ *
+ * @param[in] event     The event to post.
+ * @returns Status code, as for evel_post_event().
+ *****************************************************************************/
+EVEL_ERR_CODES gzip_post_event(EVENT_HEADER * event)
+{
+  EVEL_ERR_CODES evel_rc = EVEL_SUCCESS;
+  unsigned long long cpu_start;
+  CURLcode curl_rc;
+  long http_code = 0;
+  size_t json_size;
+  const char * body;
+  size_t body_size;
+  int gzipped;
+
+  if (!gzip_enabled)
+  {
+    return evel_post_event(event);
+  }
+
+  /***************************************************************************/
+  /* Keep heartbeats on the library, which acts on the commandList in the    */
+  /* response; the responses to posts made here are discarded.              */
+  /***************************************************************************/
+  if (event->event_domain == EVEL_DOMAIN_HEARTBEAT)
+  {
+    pthread_mutex_lock(&gzip_mutex);
+    gzip_passed++;
+    pthread_mutex_unlock(&gzip_mutex);
+    return evel_post_event(event);
+  }
+
+  pthread_mutex_lock(&gzip_mutex);
+  json_size = evel_json_encode_event(gzip_json, GZIP_POST_MAX_JSON, event);
+  body = gzip_json;
+  body_size = json_size;
+
+  /***************************************************************************/
+  /* Transcode to CBOR before deciding, since the JSON is what's compared    */
+  /* with the threshold but the library can still take the event if the    */
+  /* transcoding fails.                                                      */
+  /***************************************************************************/
+  cpu_start = gzip_cpu_now();
+  if (gzip_config.cbor && json_size < GZIP_POST_MAX_JSON - 1)
+  {
+    body_size = cbor_from_json(gzip_json, json_size,
+                               gzip_cbor, sizeof(gzip_cbor));
+    body = (const char *)gzip_cbor;
+    if (body_size == 0)
+    {
+      EVEL_ERROR("Gzip: failed to transcode %lu byte event to CBOR",
+                 (unsigned long)json_size);
+    }
+  }
+  gzipped = (gzip_config.threshold > 0 && json_size >= gzip_config.threshold);
+  if (json_size >= GZIP_POST_MAX_JSON - 1 || body_size == 0 ||
+      (!gzip_config.cbor && !gzipped))
+  {
+    gzip_cpu_ns += gzip_cpu_now() - cpu_start;
+    gzip_passed++;
+    pthread_mutex_unlock(&gzip_mutex);
+    return evel_post_event(event);
+  }
+  evel_free_event(event);
+
+  if (gzipped)
+  {
+    body_size = gzip_encode(&gzip_encoder,
+                            body,
+                            body_size,
+                            gzip_body,
+                            sizeof(gzip_body));
+    body = gzip_body;
+  }
+  gzip_cpu_ns += gzip_cpu_now() - cpu_start;
+
+  if (body_size == 0)
+  {
+    EVEL_ERROR("Gzip: failed to compress %lu byte event",
+               (unsigned long)json_size);
+    gzip_failed++;
+    pthread_mutex_unlock(&gzip_mutex);
+    return EVEL_ERR_GEN_FAIL;
+  }
+
+  curl_easy_setopt(gzip_curl, CURLOPT_HTTPHEADER,
+                   gzipped ? gzip_headers : gzip_plain_headers);
+  curl_easy_setopt(gzip_curl, CURLOPT_POSTFIELDS, body);
+  curl_easy_setopt(gzip_curl, CURLOPT_POSTFIELDSIZE, (long)body_size);
+  curl_rc = curl_easy_perform(gzip_curl);
+  if (curl_rc == CURLE_OK)
+  {
+    curl_easy_getinfo(gzip_curl, CURLINFO_RESPONSE_CODE, &http_code);
+  }
+  if (curl_rc != CURLE_OK || http_code < 200 || http_code > 299)
+  {
+    EVEL_ERROR("Gzip: post failed, %s, HTTP %ld",
+               curl_easy_strerror(curl_rc), http_code);
+    gzip_failed++;
+    evel_rc = EVEL_ERR_GEN_FAIL;
+  }
+  else
+  {
+    gzip_posted++;
+    gzip_json_bytes += json_size;
+    gzip_wire_bytes += body_size;
+  }
+  pthread_mutex_unlock(&gzip_mutex);
+  return evel_rc;
+}
+
+/**************************************************************************//**
+ * Log and print the totals and release the connection.
+ *****************************************************************************/
+void gzip_post_terminate(void)
+{
+  unsigned long long posted;
+
+  pthread_mutex_lock(&gzip_mutex);
+  if (!gzip_enabled)
+  {
+    pthread_mutex_unlock(&gzip_mutex);
+    return;
+  }
+  gzip_enabled = 0;
+
+  posted = (gzip_posted > 0) ? gzip_posted : 1;
+  EVEL_INFO("Gzip: %lu posted, %lu failed, %lu left to the library, "
+            "%llu JSON bytes sent as %llu, %llu ns CPU/event",
+            gzip_posted, gzip_failed, gzip_passed,
+            gzip_json_bytes, gzip_wire_bytes, gzip_cpu_ns / posted);
+  printf("Gzip: %lu posted, %lu failed, %lu left to the library, "
+         "%llu JSON bytes sent as %llu (%.1f:1), %llu ns CPU/event\n",
+         gzip_posted, gzip_failed, gzip_passed,
+         gzip_json_bytes, gzip_wire_bytes,
+         (gzip_wire_bytes > 0) ?
+                       (double)gzip_json_bytes / gzip_wire_bytes : 0.0,
+         gzip_cpu_ns / posted);
+
+  curl_easy_cleanup(gzip_curl);
+  gzip_curl = NULL;
+  curl_slist_free_all(gzip_headers);
+  gzip_headers = NULL;
+  curl_slist_free_all(gzip_plain_headers);
+  gzip_plain_headers = NULL;
+  gzip_encoder_end(&gzip_encoder);
+  pthread_mutex_unlock(&gzip_mutex);
+}
@@ -0,0 +1,136 @@
+#ifndef GZIP_POST_INCLUDED
+#define GZIP_POST_INCLUDED
+/**************************************************************************//**
+ * @file
+ * Gzip-compressed and CBOR-encoded event posting for the vHello_VES agent.
+ *
+ * The EVEL library posts every event as plain JSON and offers no way to set
+ * a Content-Encoding or Content-Type.  Measurement events in particular
+ * compress about ten to one, so events whose encoding reaches a size
+ * threshold are instead gzipped here and posted directly to the same Vendor
+ * Event Listener URL with "Content-Encoding: gzip".  Events may also be sent
+ * as CBOR (see cbor_encode.h), which is smaller and cheaper for the
+ * collector to decode.  Events neither gzipped nor sent as CBOR are left to
+ * the library, and so are heartbeats, so that the agent still receives the
+ * collector's commandLists.
+ *
+ * Copyright 2017 AT&T Intellectual Property, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************/
+
+#include <stddef.h>
+#include <zlib.h>
+
+#include "evel.h"
+
+/**************************************************************************//**
+ * Largest encoded event handled; anything bigger is left to the library.
+ *****************************************************************************/
+#define GZIP_POST_MAX_JSON 65536
+
+/**************************************************************************//**
+ * Defaults for the size threshold, in bytes of JSON, and zlib level.
+ *****************************************************************************/
+#define GZIP_POST_DEFAULT_THRESHOLD 1024
+#define GZIP_POST_DEFAULT_LEVEL 6
+
+/**************************************************************************//**
+ * Gzip posting configuration.  The API fields are as for evel_initialize().
+ *****************************************************************************/
+typedef struct gzip_post_config {
+  const char * fqdn;
+  int port;
+  const char * path;            /* Optional path prefix, or NULL.           */
+  const char * topic;           /* Optional topic, or NULL.                 */
+  int secure;
+  const char * username;
+  const char * password;
+  size_t threshold;             /* Smallest body gzipped, or 0 for none.    */
+  int level;                    /* zlib compression level, 1-9.             */
+  int cbor;                     /* Post every event as CBOR.                */
+} GZIP_POST_CONFIG;
+
+/**************************************************************************//**
+ * A reusable gzip encoder, so that zlib's state is allocated once rather
+ * than for every event.
+ *****************************************************************************/
+typedef struct gzip_encoder {
+  z_stream stream;
+  int initialized;
+} GZIP_ENCODER;
+
+/**************************************************************************//**
+ * Set up an encoder.
+ *
+ * @param[out] encoder  The encoder.
+ * @param[in] level     zlib compression level, 1-9.
+ * @returns 0 on success, -1 on failure.
+ *****************************************************************************/
+int gzip_encoder_init(GZIP_ENCODER * encoder, int level);
+
+/**************************************************************************//**
+ * Gzip a buffer.
+ *
+ * @param[in] encoder   The encoder.
+ * @param[in] in        The data to compress.
+ * @param[in] length    Length of the data.
+ * @param[out] out      Buffer for the gzip stream.
+ * @param[in] out_size  Size of the buffer.
+ * @returns Length of the gzip stream, or 0 if it didn't fit or failed.
+ *****************************************************************************/
+size_t gzip_encode(GZIP_ENCODER * encoder,
+                   const char * in,
+                   size_t length,
+                   char * out,
+                   size_t out_size);
+
+/**************************************************************************//**
+ * Free an encoder's zlib state.
+ *
+ * @param[in] encoder   The encoder.
+ *****************************************************************************/
+void gzip_encoder_end(GZIP_ENCODER * encoder);
+
+/**************************************************************************//**
+ * Enable gzip posting.  Must follow evel_initialize().
+ *
+ * @param[in] config    Where to post, and the threshold and level to use.
+ * @returns 0 on success, -1 on failure.
+ *****************************************************************************/
+int gzip_post_initialize(const GZIP_POST_CONFIG * config);
+
+/**************************************************************************//**
+ * Post an event as CBOR and/or gzipped, as configured, otherwise through
+ * evel_post_event().  Either way the event is owned by the callee
+ * afterwards.
+ *
+ * Responses to posts made here are not passed to the library, so a
+ * commandList from the collector only takes effect when it answers a post
+ * made by the library.  Heartbeats are therefore always posted through
+ * evel_post_event(), so that throttling, measurement interval and overload
+ * commands reach the agent at least once per heartbeat however the other
+ * events are sent.
+ *
+ * @param[in] event     The event to post.
+ * @returns Status code, as for evel_post_event().
+ *****************************************************************************/
+EVEL_ERR_CODES gzip_post_event(EVENT_HEADER * event);
+
+/**************************************************************************//**
+ * Log and print the totals and release the connection.
+ *****************************************************************************/
+void gzip_post_terminate(void);
+
+#endif
@@ -306,7 +306,8 @@ def test_listener(environ, start_response, schema):
     There is no authentication on this interface.
 
     This simply stores a commandList which will be sent in response to the next
-    incoming event on the EVEL interface.
+    incoming event on the EVEL interface.  Commands posted before then are
+    added to those already pending, so they all reach the agent, in order.
     '''
     global pending_command_list
     logger.info('Got a Test Control input')
@@ -380,7 +381,13 @@ def test_listener(environ, start_response, schema):
     # Respond to the caller. If we received otherField 'ThrottleRequest',
     # generate the appropriate canned response.
     #--------------------------------------------------------------------------
-    pending_command_list = decoded_body
+    if (pending_command_list is not None and
+        isinstance(decoded_body, dict) and
+        isinstance(decoded_body.get('commandList'), list)):
+        pending_command_list['commandList'].extend(
+                                                decoded_body['commandList'])
+    else:
+        pending_command_list = decoded_body
     print('===== TEST CONTROL END =====')
     print('============================')
     start_response('202 Accepted', [])
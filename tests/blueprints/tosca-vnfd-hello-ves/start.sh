@@ -153,6 +153,7 @@ setup_agent () {
   sudo apt-get install -y gcc
   # NOTE: force is required as some packages can't be authenticated...
   sudo apt-get install -y --force-yes libcurl4-openssl-dev
+  sudo apt-get install -y zlib1g-dev
   sudo apt-get install -y make
 
   echo "$0: Clone agent library"
@@ -162,17 +163,24 @@ setup_agent () {
   echo "$0: Clone VES repo"
   git clone https://gerrit.opnfv.org/gerrit/ves
 
-  echo "$0: Use vHello_VES blueprint version of agent_demo.c"
-  cp ves/tests/blueprints/tosca-vnfd-hello-ves/evel_demo.c evel-library/code/evel_demo/evel_demo.c
-  
-  echo "$0: Build evel_demo agent"
+  echo "$0: Build agent library"
   cd evel-library/bldjobs
   make
   export LD_LIBRARY_PATH=$LD_LIBRARY_PATH:/home/ubuntu/evel-library/libs/x86_64
-  
+
+  echo "$0: Build vHello_VES blueprint version of evel_demo agent"
+  cd /home/ubuntu/ves/tests/blueprints/tosca-vnfd-hello-ves
+  make evel_demo CODE_ROOT=/home/ubuntu/evel-library
+
+  echo "$0: Forward local syslog (other than the agent's own) to the agent"
+  cat <<'EOF' | sudo tee /etc/rsyslog.d/60-ves-agent.conf
+if $programname != 'EVEL' and $programname != 'evel_demo' then @127.0.0.1:5514
+EOF
+  sudo service rsyslog restart
+
   echo "$0: Start evel_demo agent"
   id=$(cut -d ',' -f 3 /mnt/openstack/latest/meta_data.json | cut -d '"' -f 4)
-  nohup ../output/x86_64/evel_demo --id $id --fqdn $collector_ip --port 30000 --username $username --password $password -x > /dev/null 2>&1 &
+  nohup ./evel_demo --id $id --fqdn $collector_ip --port 30000 --username $username --password $password -x --syslog-udp 5514 > /dev/null 2>&1 &
 
   echo "$0: Start collectd agent running in the VM"
   setup_collectd true
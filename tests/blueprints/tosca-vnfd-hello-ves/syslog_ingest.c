@@ -0,0 +1,870 @@
+/**************************************************************************//**
+ * @file
+ * Syslog ingestion for the vHello_VES agent.
+ *
+ * A single thread polls a Unix datagram socket and/or a UDP socket, drains
+ * up to SYSLOG_BATCH datagrams per system call, parses each in place and
+ * posts it as a syslog event.  Every message must take a token from its
+ * source's bucket and from the global bucket before any event is built, so
+ * a flood costs little more than the recvmmsg() and parse; suppressed
+ * messages are counted and reported per source every
+ * SYSLOG_SUMMARY_INTERVAL seconds.
+ *
+ * Copyright 2017 AT&T Intellectual Property, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "evel.h"
+#include "syslog_ingest.h"
+
+/**************************************************************************//**
+ * Datagrams received per recvmmsg() call.
+ *****************************************************************************/
+#define SYSLOG_BATCH 32
+
+/**************************************************************************//**
+ * Sources tracked individually; any more share one bucket.
+ *****************************************************************************/
+#define SYSLOG_MAX_SOURCES 256
+#define SYSLOG_MAX_SOURCE_KEY 64
+
+/**************************************************************************//**
+ * Seconds between reports of suppressed messages.
+ *****************************************************************************/
+#define SYSLOG_SUMMARY_INTERVAL 10
+
+/**************************************************************************//**
+ * Poll timeout, which bounds how long syslog_ingest_stop() waits.
+ *****************************************************************************/
+#define SYSLOG_POLL_MS 250
+
+/**************************************************************************//**
+ * Facility of the suppression reports: messages generated by syslogd.
+ *****************************************************************************/
+#define SYSLOG_FACILITY_SYSLOGD 5
+
+/**************************************************************************//**
+ * Kernel receive buffer requested for each socket, to ride out bursts.
+ *****************************************************************************/
+#define SYSLOG_RCVBUF (1024 * 1024)
+
+/**************************************************************************//**
+ * A token bucket.
+ *****************************************************************************/
+typedef struct syslog_bucket {
+  double tokens;
+  double updated;
+} SYSLOG_BUCKET;
+
+/**************************************************************************//**
+ * Rate limiting state for one source.
+ *****************************************************************************/
+typedef struct syslog_source {
+  char key[SYSLOG_MAX_SOURCE_KEY];
+  SYSLOG_BUCKET bucket;
+  unsigned long suppressed;
+} SYSLOG_SOURCE;
+
+/**************************************************************************//**
+ * Names of the RFC 5424 severities.
+ *****************************************************************************/
+static const char * const syslog_severities[] = {
+  "Emergency", "Alert", "Critical", "Error",
+  "Warning", "Notice", "Informational", "Debug"
+};
+
+static SYSLOG_INGEST_CONFIG syslog_config;
+static int syslog_fds[2] = {-1, -1};
+static int syslog_nfds = 0;
+static pthread_t syslog_thread;
+static volatile int syslog_stop = 0;
+
+static SYSLOG_SOURCE syslog_sources[SYSLOG_MAX_SOURCES];
+static SYSLOG_SOURCE syslog_overflow = {"(other sources)"};
+static SYSLOG_BUCKET syslog_global;
+
+static char syslog_buffers[SYSLOG_BATCH][SYSLOG_MAX_MESSAGE + 1];
+
+static unsigned long syslog_received = 0;
+static unsigned long syslog_malformed = 0;
+static unsigned long syslog_posted = 0;
+static unsigned long syslog_suppressed = 0;
+
+/**************************************************************************//**
+ * Seconds on the monotonic clock.
+ *****************************************************************************/
+static double syslog_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**************************************************************************//**
+ * Take a token from a bucket, refilling it for the time since the last take.
+ *
+ * @param[in] bucket  The bucket.
+ * @param[in] rate    Tokens added per second.
+ * @param[in] burst   Capacity of the bucket.
+ * @param[in] now     The current time.
+ * @returns 1 if a token was taken, 0 if the bucket is empty.
+ *****************************************************************************/
+static int syslog_bucket_take(SYSLOG_BUCKET * bucket,
+                              double rate,
+                              double burst,
+                              double now)
+{
+  if (bucket->updated == 0)
+  {
+    bucket->tokens = burst;
+  }
+  else
+  {
+    bucket->tokens += (now - bucket->updated) * rate;
+    if (bucket->tokens > burst)
+    {
+      bucket->tokens = burst;
+    }
+  }
+  bucket->updated = now;
+
+  if (bucket->tokens < 1)
+  {
+    return 0;
+  }
+  bucket->tokens -= 1;
+  return 1;
+}
+
+/**************************************************************************//**
+ * Find or add the state for a source.
+ *
+ * @param[in] key   NUL-terminated name of the source.
+ * @returns The source's state, or the shared overflow state if the table is
+ *          full.
+ *****************************************************************************/
+static SYSLOG_SOURCE * syslog_source_lookup(const char * key)
+{
+  unsigned int hash = 2166136261u;
+  const char * p;
+  int i;
+  SYSLOG_SOURCE * source;
+
+  for (p = key; *p != '\0'; p++)
+  {
+    hash = (hash ^ (unsigned char)*p) * 16777619u;
+  }
+
+  for (i = 0; i < SYSLOG_MAX_SOURCES; i++)
+  {
+    source = &syslog_sources[(hash + i) % SYSLOG_MAX_SOURCES];
+    if (source->key[0] == '\0')
+    {
+      strncpy(source->key, key, SYSLOG_MAX_SOURCE_KEY - 1);
+      return source;
+    }
+    if (strncmp(source->key, key, SYSLOG_MAX_SOURCE_KEY - 1) == 0)
+    {
+      return source;
+    }
+  }
+  return &syslog_overflow;
+}
+
+/**************************************************************************//**
+ * Take the next space-delimited token as a field.
+ *
+ * @param[in,out] p   Parse position, left after the delimiting space.
+ * @param[in] end     End of the message.
+ * @param[out] field  The token, empty if it is the nil value "-".
+ * @returns 0 on success, -1 if the message ends first.
+ *****************************************************************************/
+static int syslog_token(const char ** p, const char * end, SYSLOG_FIELD * field)
+{
+  const char * start = *p;
+  const char * q = start;
+
+  while (q < end && *q != ' ')
+  {
+    q++;
+  }
+  if (q == start || q == end)
+  {
+    return -1;
+  }
+
+  field->start = start;
+  field->length = (q - start == 1 && *start == '-') ? 0 : q - start;
+  *p = q + 1;
+  return 0;
+}
+
+/**************************************************************************//**
+ * Parse the remainder of an RFC 5424 message, after the "1 " version.
+ *****************************************************************************/
+static int syslog_parse_5424(const char * p,
+                             const char * end,
+                             SYSLOG_MESSAGE * message)
+{
+  SYSLOG_FIELD timestamp;
+  const char * sd_start;
+
+  message->version = 1;
+  if (syslog_token(&p, end, &timestamp) != 0 ||
+      syslog_token(&p, end, &message->hostname) != 0 ||
+      syslog_token(&p, end, &message->app_name) != 0 ||
+      syslog_token(&p, end, &message->proc_id) != 0 ||
+      syslog_token(&p, end, &message->msg_id) != 0 ||
+      p >= end)
+  {
+    return -1;
+  }
+
+  /***************************************************************************/
+  /* STRUCTURED-DATA is "-" or one or more [SD-ID PARAM="VALUE" ...], in    */
+  /* which values may contain escaped quotes and brackets.                  */
+  /***************************************************************************/
+  sd_start = p;
+  if (*p == '-')
+  {
+    p++;
+  }
+  else
+  {
+    while (p < end && *p == '[')
+    {
+      while (p < end && *p != ']')
+      {
+        if (*p == '"')
+        {
+          for (p++; p < end && *p != '"'; p++)
+          {
+            if (*p == '\\')
+            {
+              p++;
+            }
+          }
+        }
+        p++;
+      }
+      if (p >= end)
+      {
+        return -1;
+      }
+      p++;
+    }
+    if (p == sd_start)
+    {
+      return -1;
+    }
+    message->structured_data.start = sd_start;
+    message->structured_data.length = p - sd_start;
+  }
+
+  if (p < end && *p == ' ')
+  {
+    p++;
+  }
+  if (end - p >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0)
+  {
+    p += 3;
+  }
+  message->msg.start = p;
+  message->msg.length = end - p;
+  return 0;
+}
+
+/**************************************************************************//**
+ * Parse the remainder of an RFC 3164 message, after the PRI.
+ *
+ * Messages from syslog(3) on the local socket carry no HOSTNAME, so the
+ * first token after the timestamp is taken as the TAG if it ends in ':' or
+ * contains '['.
+ *****************************************************************************/
+static int syslog_parse_3164(const char * p,
+                             const char * end,
+                             SYSLOG_MESSAGE * message)
+{
+  const char * q;
+  int has_header = 0;
+
+  message->version = 0;
+
+  /***************************************************************************/
+  /* HEADER is "Mmm dd hh:mm:ss HOSTNAME ", without which there's no        */
+  /* HOSTNAME either.                                                        */
+  /***************************************************************************/
+  if (end - p >= 16 && p[3] == ' ' && p[6] == ' ' && p[9] == ':' &&
+      p[12] == ':' && p[15] == ' ')
+  {
+    p += 16;
+    has_header = 1;
+  }
+
+  for (q = p; q < end && *q != ' ' && *q != '['; q++)
+  {
+  }
+  if (has_header && q < end && *q == ' ' && q > p && q[-1] != ':')
+  {
+    message->hostname.start = p;
+    message->hostname.length = q - p;
+    p = q + 1;
+  }
+
+  /***************************************************************************/
+  /* TAG, optionally followed by [PID], and a ':'.  Anything else is part    */
+  /* of the content.                                                         */
+  /***************************************************************************/
+  for (q = p; q < end && *q != '[' && *q != ':' && *q != ' '; q++)
+  {
+  }
+  if (q > p && q < end && (*q == '[' || *q == ':'))
+  {
+    message->app_name.start = p;
+    message->app_name.length = q - p;
+    if (*q == '[')
+    {
+      p = ++q;
+      while (q < end && *q != ']')
+      {
+        q++;
+      }
+      if (q >= end)
+      {
+        return -1;
+      }
+      message->proc_id.start = p;
+      message->proc_id.length = q - p;
+      q++;
+    }
+    if (q < end && *q == ':')
+    {
+      q++;
+    }
+    if (q < end && *q == ' ')
+    {
+      q++;
+    }
+    p = q;
+  }
+
+  message->msg.start = p;
+  message->msg.length = end - p;
+  return 0;
+}
+
+/**************************************************************************//**
+ * Parse a syslog message without copying it.
+ *
+ * @param[in] buffer    The received message.
+ * @param[in] length    Length of the message.
+ * @param[out] message  The parsed fields, which point into buffer.
+ * @returns 0 on success, -1 if the message is not valid syslog.
+ *****************************************************************************/
+int syslog_parse(const char * buffer, size_t length, SYSLOG_MESSAGE * message)
+{
+  const char * p = buffer;
+  const char * end = buffer + length;
+  int pri = 0;
+  int digits = 0;
+  int rc;
+
+  memset(message, 0, sizeof(*message));
+
+  /***************************************************************************/
+  /* Trailing newlines are framing, not content.                             */
+  /***************************************************************************/
+  while (end > p && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == '\0'))
+  {
+    end--;
+  }
+
+  /***************************************************************************/
+  /* PRI is "<" 1-3 digits ">", facility * 8 + severity.                     */
+  /***************************************************************************/
+  if (p >= end || *p++ != '<')
+  {
+    return -1;
+  }
+  while (p < end && *p >= '0' && *p <= '9' && digits < 3)
+  {
+    pri = pri * 10 + (*p++ - '0');
+    digits++;
+  }
+  if (digits == 0 || p >= end || *p++ != '>' || pri > 191)
+  {
+    return -1;
+  }
+  message->facility = pri >> 3;
+  message->severity = pri & 7;
+
+  if (end - p >= 2 && p[0] == '1' && p[1] == ' ')
+  {
+    rc = syslog_parse_5424(p + 2, end, message);
+  }
+  else
+  {
+    rc = syslog_parse_3164(p, end, message);
+  }
+  return rc;
+}
+
+/**************************************************************************//**
+ * NUL-terminate a field in place in the receive buffer.
+ *
+ * Done only once parsing is complete, since the terminator overwrites the
+ * delimiter that follows the field.
+ *
+ * @returns The field as a string, or NULL if it is absent or nil.
+ *****************************************************************************/
+static const char * syslog_field_string(const SYSLOG_FIELD * field)
+{
+  if (field->start == NULL || field->length == 0)
+  {
+    return NULL;
+  }
+  ((char *)field->start)[field->length] = '\0';
+  return field->start;
+}
+
+/**************************************************************************//**
+ * Post a parsed message as a syslog event.
+ *
+ * @param[in] message   The message, whose buffer has room for a terminator
+ *                      after the last byte.
+ *****************************************************************************/
+static void syslog_post(const SYSLOG_MESSAGE * message)
+{
+  EVENT_SYSLOG * syslog = NULL;
+  EVEL_ERR_CODES evel_rc = EVEL_SUCCESS;
+  const char * hostname = syslog_field_string(&message->hostname);
+  const char * app_name = syslog_field_string(&message->app_name);
+  const char * proc_id = syslog_field_string(&message->proc_id);
+  const char * msg_id = syslog_field_string(&message->msg_id);
+  const char * sd = syslog_field_string(&message->structured_data);
+  const char * msg = syslog_field_string(&message->msg);
+  char * proc_id_end = NULL;
+  long pid;
+
+  syslog = evel_new_syslog(EVEL_SOURCE_VIRTUAL_NETWORK_FUNCTION,
+                           msg != NULL ? msg : "",
+                           app_name != NULL ? app_name : "syslog");
+  if (syslog == NULL)
+  {
+    EVEL_ERROR("New Syslog failed");
+    return;
+  }
+
+  /***************************************************************************/
+  /* EVEL_SYSLOG_FACILITIES follows the RFC 5424 facility codes.             */
+  /***************************************************************************/
+  evel_syslog_facility_set(syslog, (EVEL_SYSLOG_FACILITIES)message->facility);
+  evel_syslog_addl_field_add(syslog, "severity",
+                             syslog_severities[message->severity]);
+  if (hostname != NULL)
+  {
+    evel_syslog_event_source_host_set(syslog, hostname);
+  }
+  if (app_name != NULL)
+  {
+    evel_syslog_proc_set(syslog, app_name);
+  }
+  if (proc_id != NULL)
+  {
+    pid = strtol(proc_id, &proc_id_end, 10);
+    if (*proc_id_end == '\0')
+    {
+      evel_syslog_proc_id_set(syslog, (int)pid);
+    }
+    else
+    {
+      evel_syslog_addl_field_add(syslog, "procId", proc_id);
+    }
+  }
+  if (message->version > 0)
+  {
+    evel_syslog_version_set(syslog, message->version);
+  }
+  if (msg_id != NULL)
+  {
+    evel_syslog_addl_field_add(syslog, "msgId", msg_id);
+  }
+  if (sd != NULL)
+  {
+    evel_syslog_addl_field_add(syslog, "structuredData", sd);
+  }
+
+  evel_rc = evel_post_event((EVENT_HEADER *)syslog);
+  if (evel_rc != EVEL_SUCCESS)
+  {
+    EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
+    return;
+  }
+  syslog_posted++;
+}
+
+/**************************************************************************//**
+ * Report a source's suppressed messages as one syslog event.
+ *****************************************************************************/
+static void syslog_post_suppressed(SYSLOG_SOURCE * source)
+{
+  EVENT_SYSLOG * syslog = NULL;
+  EVEL_ERR_CODES evel_rc = EVEL_SUCCESS;
+  char text[128];
+  char count[32];
+
+  snprintf(text, sizeof(text),
+           "%lu syslog messages suppressed in the last %d seconds",
+           source->suppressed, SYSLOG_SUMMARY_INTERVAL);
+  snprintf(count, sizeof(count), "%lu", source->suppressed);
+  source->suppressed = 0;
+
+  syslog = evel_new_syslog(EVEL_SOURCE_VIRTUAL_NETWORK_FUNCTION,
+                           text,
+                           "syslog_ingest");
+  if (syslog == NULL)
+  {
+    EVEL_ERROR("New Syslog failed");
+    return;
+  }
+  evel_syslog_event_source_host_set(syslog, source->key);
+  evel_syslog_facility_set(syslog,
+                           (EVEL_SYSLOG_FACILITIES)SYSLOG_FACILITY_SYSLOGD);
+  evel_syslog_addl_field_add(syslog, "suppressedCount", count);
+  evel_rc = evel_post_event((EVENT_HEADER *)syslog);
+  if (evel_rc != EVEL_SUCCESS)
+  {
+    EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
+  }
+}
+
+/**************************************************************************//**
+ * Rate limit and post one received datagram.
+ *
+ * @param[in] buffer  The datagram, with room for a terminator at length.
+ * @param[in] length  Length of the datagram.
+ * @param[in] peer    Name of the sender, used when the message has no
+ *                    HOSTNAME.
+ * @param[in] now     The current time.
+ *****************************************************************************/
+static void syslog_handle(char * buffer,
+                          size_t length,
+                          const char * peer,
+                          double now)
+{
+  SYSLOG_MESSAGE message;
+  SYSLOG_SOURCE * source;
+  char key[SYSLOG_MAX_SOURCE_KEY];
+
+  syslog_received++;
+  if (syslog_parse(buffer, length, &message) != 0)
+  {
+    syslog_malformed++;
+    return;
+  }
+
+  if (message.hostname.length > 0)
+  {
+    snprintf(key, sizeof(key), "%.*s",
+             (int)message.hostname.length, message.hostname.start);
+  }
+  else
+  {
+    snprintf(key, sizeof(key), "%s", peer);
+  }
+  source = syslog_source_lookup(key);
+
+  if (!syslog_bucket_take(&source->bucket,
+                          syslog_config.source_rate,
+                          syslog_config.source_burst,
+                          now) ||
+      !syslog_bucket_take(&syslog_global,
+                          syslog_config.global_rate,
+                          syslog_config.global_burst,
+                          now))
+  {
+    source->suppressed++;
+    syslog_suppressed++;
+    return;
+  }
+  syslog_post(&message);
+}
+
+/**************************************************************************//**
+ * Drain one socket, SYSLOG_BATCH datagrams at a time.
+ *****************************************************************************/
+static void syslog_drain(int fd, double now)
+{
+  struct mmsghdr msgs[SYSLOG_BATCH];
+  struct iovec iovecs[SYSLOG_BATCH];
+  struct sockaddr_storage peers[SYSLOG_BATCH];
+  char peer[INET6_ADDRSTRLEN];
+  struct sockaddr_in * in;
+  int received;
+  int i;
+
+  do
+  {
+    memset(msgs, 0, sizeof(msgs));
+    for (i = 0; i < SYSLOG_BATCH; i++)
+    {
+      iovecs[i].iov_base = syslog_buffers[i];
+      iovecs[i].iov_len = SYSLOG_MAX_MESSAGE;
+      msgs[i].msg_hdr.msg_iov = &iovecs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &peers[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+    }
+
+    received = recvmmsg(fd, msgs, SYSLOG_BATCH, MSG_DONTWAIT, NULL);
+    for (i = 0; i < received; i++)
+    {
+      strcpy(peer, "localhost");
+      if (peers[i].ss_family == AF_INET)
+      {
+        in = (struct sockaddr_in *)&peers[i];
+        inet_ntop(AF_INET, &in->sin_addr, peer, sizeof(peer));
+      }
+      syslog_handle(syslog_buffers[i], msgs[i].msg_len, peer, now);
+    }
+  } while (received == SYSLOG_BATCH && !syslog_stop);
+
+  if (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+  {
+    EVEL_ERROR("Syslog receive failed: %s", strerror(errno));
+  }
+}
+
+/**************************************************************************//**
+ * The ingestion thread.
+ *****************************************************************************/
+static void * syslog_ingest_thread(void * arg)
+{
+  struct pollfd pollfds[2];
+  double now;
+  double next_summary = syslog_now() + SYSLOG_SUMMARY_INTERVAL;
+  int i;
+
+  for (i = 0; i < syslog_nfds; i++)
+  {
+    pollfds[i].fd = syslog_fds[i];
+    pollfds[i].events = POLLIN;
+  }
+
+  while (!syslog_stop)
+  {
+    if (poll(pollfds, syslog_nfds, SYSLOG_POLL_MS) < 0 && errno != EINTR)
+    {
+      EVEL_ERROR("Syslog poll failed: %s", strerror(errno));
+      break;
+    }
+
+    now = syslog_now();
+    for (i = 0; i < syslog_nfds; i++)
+    {
+      if (pollfds[i].revents & POLLIN)
+      {
+        syslog_drain(pollfds[i].fd, now);
+      }
+    }
+
+    if (now >= next_summary)
+    {
+      for (i = 0; i < SYSLOG_MAX_SOURCES; i++)
+      {
+        if (syslog_sources[i].suppressed > 0)
+        {
+          syslog_post_suppressed(&syslog_sources[i]);
+        }
+      }
+      if (syslog_overflow.suppressed > 0)
+      {
+        syslog_post_suppressed(&syslog_overflow);
+      }
+      next_summary = now + SYSLOG_SUMMARY_INTERVAL;
+    }
+  }
+  return NULL;
+}
+
+/**************************************************************************//**
+ * Ask for a larger kernel receive buffer, so bursts are queued rather than
+ * dropped while the thread is busy.
+ *****************************************************************************/
+static void syslog_set_rcvbuf(int fd)
+{
+  int size = SYSLOG_RCVBUF;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) != 0)
+  {
+    EVEL_ERROR("Failed to set syslog receive buffer: %s", strerror(errno));
+  }
+}
+
+/**************************************************************************//**
+ * Open the local Unix datagram socket.
+ *****************************************************************************/
+static int syslog_open_unix(const char * path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    EVEL_ERROR("Syslog socket path too long: %s", path);
+    return -1;
+  }
+  fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (fd < 0)
+  {
+    EVEL_ERROR("Failed to create syslog socket: %s", strerror(errno));
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+  {
+    EVEL_ERROR("Failed to bind syslog socket %s: %s", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  chmod(path, 0666);
+  syslog_set_rcvbuf(fd);
+  return fd;
+}
+
+/**************************************************************************//**
+ * Open the UDP socket.
+ *****************************************************************************/
+static int syslog_open_udp(int port)
+{
+  struct sockaddr_in addr;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+  {
+    EVEL_ERROR("Failed to create syslog UDP socket: %s", strerror(errno));
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(port);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+  {
+    EVEL_ERROR("Failed to bind syslog UDP port %d: %s", port, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  syslog_set_rcvbuf(fd);
+  return fd;
+}
+
+/**************************************************************************//**
+ * Open the configured sockets and start the ingestion thread.
+ *
+ * @param[in] config    The sockets and rate limits to use.
+ * @returns 0 on success, -1 if no socket could be opened.
+ *****************************************************************************/
+int syslog_ingest_start(const SYSLOG_INGEST_CONFIG * config)
+{
+  int fd;
+
+  syslog_config = *config;
+  syslog_nfds = 0;
+  syslog_stop = 0;
+
+  if (config->unix_path != NULL)
+  {
+    fd = syslog_open_unix(config->unix_path);
+    if (fd >= 0)
+    {
+      syslog_fds[syslog_nfds++] = fd;
+    }
+  }
+  if (config->udp_port > 0)
+  {
+    fd = syslog_open_udp(config->udp_port);
+    if (fd >= 0)
+    {
+      syslog_fds[syslog_nfds++] = fd;
+    }
+  }
+  if (syslog_nfds == 0)
+  {
+    return -1;
+  }
+
+  if (pthread_create(&syslog_thread, NULL, syslog_ingest_thread, NULL) != 0)
+  {
+    EVEL_ERROR("Failed to start syslog ingestion thread");
+    while (syslog_nfds > 0)
+    {
+      close(syslog_fds[--syslog_nfds]);
+    }
+    return -1;
+  }
+  EVEL_INFO("Syslog ingestion started");
+  return 0;
+}
+
+/**************************************************************************//**
+ * Stop the ingestion thread, close the sockets and log the totals.
+ *****************************************************************************/
+void syslog_ingest_stop(void)
+{
+  if (syslog_nfds == 0)
+  {
+    return;
+  }
+
+  syslog_stop = 1;
+  pthread_join(syslog_thread, NULL);
+  while (syslog_nfds > 0)
+  {
+    close(syslog_fds[--syslog_nfds]);
+  }
+  if (syslog_config.unix_path != NULL)
+  {
+    unlink(syslog_config.unix_path);
+  }
+
+  EVEL_INFO("Syslog: %lu received, %lu malformed, %lu posted, %lu suppressed",
+            syslog_received, syslog_malformed, syslog_posted,
+            syslog_suppressed);
+  printf("Syslog: %lu received, %lu malformed, %lu posted, %lu suppressed\n",
+         syslog_received, syslog_malformed, syslog_posted, syslog_suppressed);
+}
@@ -0,0 +1,103 @@
+#ifndef SYSLOG_INGEST_INCLUDED
+#define SYSLOG_INGEST_INCLUDED
+/**************************************************************************//**
+ * @file
+ * Syslog ingestion for the vHello_VES agent.
+ *
+ * Receives syslog messages on a local Unix datagram socket and/or a UDP
+ * socket, parses them as RFC 5424 or RFC 3164 and posts them to the EVEL
+ * library as syslog events, rate limited per source so that a log storm
+ * from one VNF component cannot swamp the collector or the agent.
+ *
+ * Copyright 2017 AT&T Intellectual Property, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************/
+
+#include <stddef.h>
+
+/**************************************************************************//**
+ * Largest syslog message accepted.  RFC 5424 requires receivers to accept
+ * 480 octets and recommends 2048; longer datagrams are truncated.
+ *****************************************************************************/
+#define SYSLOG_MAX_MESSAGE 2048
+
+/**************************************************************************//**
+ * Defaults for the rate limits, in messages per second and burst size.
+ *****************************************************************************/
+#define SYSLOG_DEFAULT_SOURCE_RATE 10
+#define SYSLOG_DEFAULT_SOURCE_BURST 50
+#define SYSLOG_DEFAULT_GLOBAL_RATE 100
+#define SYSLOG_DEFAULT_GLOBAL_BURST 500
+
+/**************************************************************************//**
+ * Syslog ingestion configuration.
+ *****************************************************************************/
+typedef struct syslog_ingest_config {
+  const char * unix_path;       /* Unix datagram socket, or NULL for none.  */
+  int udp_port;                 /* UDP port, or 0 for none.                 */
+  double source_rate;           /* Messages/s posted for any one source.    */
+  double source_burst;
+  double global_rate;           /* Messages/s posted for all sources.       */
+  double global_burst;
+} SYSLOG_INGEST_CONFIG;
+
+/**************************************************************************//**
+ * A field of a parsed message: a slice of the received datagram, which is
+ * not NUL-terminated.  An absent or nil ("-") field has length 0.
+ *****************************************************************************/
+typedef struct syslog_field {
+  const char * start;
+  size_t length;
+} SYSLOG_FIELD;
+
+/**************************************************************************//**
+ * A parsed syslog message.
+ *****************************************************************************/
+typedef struct syslog_message {
+  int facility;
+  int severity;
+  int version;                  /* 1 for RFC 5424, 0 for RFC 3164.          */
+  SYSLOG_FIELD hostname;
+  SYSLOG_FIELD app_name;
+  SYSLOG_FIELD proc_id;
+  SYSLOG_FIELD msg_id;
+  SYSLOG_FIELD structured_data;
+  SYSLOG_FIELD msg;
+} SYSLOG_MESSAGE;
+
+/**************************************************************************//**
+ * Parse a syslog message without copying it.
+ *
+ * @param[in] buffer    The received message.
+ * @param[in] length    Length of the message.
+ * @param[out] message  The parsed fields, which point into buffer.
+ * @returns 0 on success, -1 if the message is not valid syslog.
+ *****************************************************************************/
+int syslog_parse(const char * buffer, size_t length, SYSLOG_MESSAGE * message);
+
+/**************************************************************************//**
+ * Open the configured sockets and start the ingestion thread.
+ *
+ * @param[in] config    The sockets and rate limits to use.
+ * @returns 0 on success, -1 if no socket could be opened.
+ *****************************************************************************/
+int syslog_ingest_start(const SYSLOG_INGEST_CONFIG * config);
+
+/**************************************************************************//**
+ * Stop the ingestion thread, close the sockets and log the totals.
+ *****************************************************************************/
+void syslog_ingest_stop(void);
+
+#endif
@@ -0,0 +1,150 @@
+#!/usr/bin/env python
+#
+# Copyright 2017 AT&T Intellectual Property, Inc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# What this is: Round-trip test of the CBOR event encoding.  Each event the
+# vHello_VES agent's builders produce, as JSON and as the CBOR its
+# cbor_encode.c transcodes that to, is decoded by the VES collector's own
+# CBOR decoder (cbor_decode, and cbor_loads if a C decoder is installed)
+# and compared with the JSON decoded by json.loads.  The size of each
+# encoding and the collector's time to decode it are reported per builder.
+#
+# Status: this is a work in progress, under test.
+#
+# How to use:
+#   $ cd tests/blueprints/tosca-vnfd-hello-ves
+#   $ make evel_encode_bench && ./evel_encode_bench --dump /tmp/events
+#   $ PYTHONPATH=<evel-test-collector>/code/collector \
+#     python ../../collector/cbor_roundtrip_test.py /tmp/events
+#   The collector's dependencies (rest_dispatcher from evel-test-collector,
+#   jsonschema and requests) must be importable.  Exits 0 if every event
+#   decodes the same from CBOR as from JSON, 1 otherwise.
+
+from argparse import ArgumentParser, ArgumentDefaultsHelpFormatter
+import imp
+import json
+import os
+import sys
+import time
+
+def load_collector(path):
+    '''
+    The collector script, imported as a module for its CBOR decoder.
+    '''
+    argv = sys.argv
+    sys.argv = [path]
+    try:
+        return imp.load_source('ves_collector', path)
+    finally:
+        sys.argv = argv
+
+def mean_us(decode, data, repeat):
+    '''
+    Mean time to decode data, in microseconds.
+    '''
+    start = time.time()
+    for i in xrange(repeat):
+        decode(data)
+    return (time.time() - start) * 1000000 / repeat
+
+def main():
+    parser = ArgumentParser(description='Check that the collector decodes '
+                                        'the agent\'s CBOR events to the '
+                                        'same documents as their JSON.',
+                            formatter_class=ArgumentDefaultsHelpFormatter)
+    parser.add_argument('directory',
+                        help='directory written by evel_encode_bench --dump')
+    parser.add_argument('--collector',
+                        default=os.path.join(os.path.dirname(
+                                             os.path.abspath(__file__)),
+                                             '..', '..', 'build',
+                                             'ves-collector', 'monitor.py'),
+                        help='collector script whose decoder to use')
+    parser.add_argument('--repeat', type=int, default=1000,
+                        help='decodes of each event to time')
+    args = parser.parse_args()
+
+    collector = load_collector(args.collector)
+    decoders = [('cbor_decode', collector.cbor_decode)]
+    if collector.cbor_loads is not collector.cbor_decode:
+        decoders.append(('cbor_loads', collector.cbor_loads))
+
+    #--------------------------------------------------------------------------
+    # Group the events by builder: <builder>-<n>.json and .cbor.
+    #--------------------------------------------------------------------------
+    builders = {}
+    for name in sorted(os.listdir(args.directory)):
+        if name.endswith('.json'):
+            builder = name[:-len('.json')].rpartition('-')[0]
+            builders.setdefault(builder, []).append(
+                               os.path.join(args.directory, name[:-len('.json')]))
+    if not builders:
+        print('No events in {0}'.format(args.directory))
+        return 1
+
+    print('{0:<18} {1:>6} {2:>10} {3:>10} {4:>6} {5:>10} {6}'.format(
+                  'Builder', 'Events', 'JSON bytes', 'CBOR bytes', 'CBOR %',
+                  'json us', ' '.join('{0:>11}'.format(name + ' us')
+                                      for name, decode in decoders)))
+    failures = 0
+    totals = [0, 0, 0]
+    for builder in sorted(builders):
+        json_bytes = 0
+        cbor_bytes = 0
+        times = [0.0] * (len(decoders) + 1)
+        for base in builders[builder]:
+            with open(base + '.json', 'rb') as f:
+                json_data = f.read()
+            with open(base + '.cbor', 'rb') as f:
+                cbor_data = f.read()
+            json_bytes += len(json_data)
+            cbor_bytes += len(cbor_data)
+            expected = json.loads(json_data)
+            times[0] += mean_us(json.loads, json_data, args.repeat)
+            for i, (name, decode) in enumerate(decoders):
+                try:
+                    decoded = decode(cbor_data)
+                except Exception as e:
+                    decoded = e
+                if decoded != expected:
+                    failures += 1
+                    print('{0}: {1} decodes differently from the JSON: '
+                          '{2!r}'.format(os.path.basename(base), name,
+                                         decoded))
+                    continue
+                times[i + 1] += mean_us(decode, cbor_data, args.repeat)
+        events = len(builders[builder])
+        totals[0] += events
+        totals[1] += json_bytes
+        totals[2] += cbor_bytes
+        print('{0:<18} {1:>6} {2:>10} {3:>10} {4:>6.1f} {5:>10.1f} '
+              '{6}'.format(builder, events, json_bytes / events,
+                           cbor_bytes / events,
+                           100.0 * cbor_bytes / json_bytes,
+                           times[0] / events,
+                           ' '.join('{0:>11.1f}'.format(t / events)
+                                    for t in times[1:])))
+
+    print('{0} events, {1} JSON bytes, {2} CBOR bytes ({3:.1f}%), '
+          '{4} mismatches'.format(totals[0], totals[1], totals[2],
+                                  100.0 * totals[2] / totals[1], failures))
+    if failures:
+        print('FAILED')
+        return 1
+    print('PASSED')
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,346 @@
+#!/usr/bin/env python
+#
+# Copyright 2017 AT&T Intellectual Property, Inc
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+# What this is: Test of the VES collector's InfluxDB spool.  A stand-in for
+# InfluxDB is restarted while events are streamed to the collector: it stops
+# listening, then comes back answering writes with 503 for a while, as
+# InfluxDB does while it loads its shards, and then with 204.  The test
+# passes if every event's point reaches the stand-in exactly once.
+#
+# Status: this is a work in progress, under test.
+#
+# How to use:
+#   $ PYTHONPATH=<evel-test-collector>/code/collector \
+#     python spool_restart_test.py [--collector <monitor.py>] [--events N]
+#   The collector needs its own dependencies (rest_dispatcher from
+#   evel-test-collector, jsonschema and requests) to be importable.  It is
+#   run with a spool in a temporary directory and no rollups, and stopped at
+#   the end.  Exits 0 if nothing was lost or duplicated, 1 otherwise.
+
+from BaseHTTPServer import HTTPServer, BaseHTTPRequestHandler
+from argparse import ArgumentParser, ArgumentDefaultsHelpFormatter
+from base64 import b64encode
+import SocketServer
+import json
+import os
+import re
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib2
+
+USERNAME = 'hello'
+PASSWORD = 'world'
+
+#------------------------------------------------------------------------------
+# A heartbeat's point as the collector writes it.
+#------------------------------------------------------------------------------
+HEARTBEAT = re.compile(r'^heartbeat,\S+ sequence=(\d+)i? \d+$')
+
+class InfluxStandIn(object):
+    '''
+    Just enough of InfluxDB's HTTP API for the collector: /ping, /query and
+    /write, which answers 503 while warming up and 204 otherwise.  Only
+    points written with a 204 are counted.
+    '''
+
+    def __init__(self, port):
+        self.port = port
+        self.lock = threading.Lock()
+        self.written = {}
+        self.refused = 0
+        self.warm_until = 0
+        self.server = None
+
+    def start(self, warmup=0):
+        stand_in = self
+
+        class Handler(BaseHTTPRequestHandler):
+            def do_GET(self):
+                self.reply(204 if self.path.startswith('/ping') else 200)
+
+            def do_POST(self):
+                length = int(self.headers.getheader('Content-Length', '0'))
+                body = self.rfile.read(length)
+                if self.path.startswith('/write'):
+                    self.reply(stand_in.write(body))
+                else:
+                    self.reply(200)
+
+            def reply(self, status):
+                self.send_response(status)
+                self.send_header('Content-Length', '0')
+                self.end_headers()
+
+            def log_message(self, *args):
+                pass
+
+        class Server(SocketServer.ThreadingMixIn, HTTPServer):
+            daemon_threads = True
+
+        self.warm_until = time.time() + warmup
+        self.server = Server(('127.0.0.1', self.port), Handler)
+        thread = threading.Thread(target=self.server.serve_forever)
+        thread.daemon = True
+        thread.start()
+
+    def stop(self):
+        self.server.shutdown()
+        self.server.server_close()
+
+    def write(self, body):
+        self.lock.acquire()
+        try:
+            if time.time() < self.warm_until:
+                self.refused += 1
+                return 503
+            for line in body.split('\n'):
+                match = HEARTBEAT.match(line.strip())
+                if match:
+                    sequence = int(match.group(1))
+                    self.written[sequence] = self.written.get(sequence, 0) + 1
+            return 204
+        finally:
+            self.lock.release()
+
+    def counts(self):
+        self.lock.acquire()
+        try:
+            return dict(self.written)
+        finally:
+            self.lock.release()
+
+def free_port():
+    '''
+    A TCP port nothing is listening on just now.
+    '''
+    s = socket.socket()
+    s.bind(('127.0.0.1', 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+def write_config(directory, vel_port, influx_port, batch_points):
+    '''
+    A collector config with a spool under directory and nothing else that
+    writes points of its own in the way.
+    '''
+    path = os.path.join(directory, 'collector.conf')
+    with open(path, 'w') as f:
+        f.write('[default]\n'
+                'log_file = {0}/collector.log\n'
+                'schema_file = {0}/no-schema.json\n'
+                'base_schema_file = {0}/no-schema.json\n'
+                'throttle_schema_file = {0}/no-schema.json\n'
+                'test_control_schema_file = {0}/no-schema.json\n'
+                'vel_port = {1}\n'
+                'vel_path =\n'
+                'vel_username = {2}\n'
+                'vel_password = {3}\n'
+                'vel_topic_name =\n'
+                'influxdb = 127.0.0.1:{4}\n'
+                'influxdb_batch_points = {5}\n'
+                'influxdb_batch_ms = 100\n'
+                'ingest_stats_interval = 3600\n'
+                'spool_dir = {0}/spool\n'
+                'spool_segment_bytes = 4096\n'
+                'spool_replay_rate = 2000\n'
+                'rollups =\n'
+                'dedup_window = 0\n'
+                'stream_max_subscribers = 0\n'.format(directory, vel_port,
+                                                       USERNAME, PASSWORD,
+                                                       influx_port,
+                                                       batch_points))
+    return path
+
+def heartbeat(sequence):
+    '''
+    A VES 5 heartbeat with its own sequence number and event time.
+    '''
+    now = int(time.time() * 1000000)
+    return json.dumps({'event': {'commonEventHeader': {
+        'domain': 'heartbeat',
+        'eventId': 'spool-test-{0}'.format(sequence),
+        'eventName': 'heartbeat_spool_test',
+        'lastEpochMicrosec': now + sequence,
+        'priority': 'Normal',
+        'reportingEntityName': 'spool-test',
+        'sequence': sequence,
+        'sourceName': 'spool-test',
+        'sourceId': 'spool-test',
+        'startEpochMicrosec': now + sequence,
+        'version': 3.0}}})
+
+def post_event(url, body):
+    '''
+    Post an event, waiting and retrying while the collector says it is
+    overloaded.  Returns whether it was accepted.
+    '''
+    request = urllib2.Request(url, body, {
+                    'Content-Type': 'application/json',
+                    'Authorization': 'Basic ' + b64encode(USERNAME + ':' +
+                                                          PASSWORD)})
+    for attempt in range(50):
+        try:
+            urllib2.urlopen(request, timeout=10).read()
+            return True
+        except urllib2.HTTPError as e:
+            if e.code != 503:
+                print('Event refused: {0}'.format(e))
+                return False
+            time.sleep(float(e.headers.get('Retry-After', '1')))
+        except urllib2.URLError as e:
+            time.sleep(0.2)
+    return False
+
+def spooled(directory):
+    '''
+    Whether any points are still spooled.
+    '''
+    spool = os.path.join(directory, 'spool')
+    if not os.path.isdir(spool):
+        return False
+    return any(name.startswith('segment-') or name == 'inflight.lp'
+               for name in os.listdir(spool))
+
+def main():
+    parser = ArgumentParser(description='Restart an InfluxDB stand-in while '
+                                        'events stream through the '
+                                        'collector and check that none are '
+                                        'lost or duplicated.',
+                            formatter_class=ArgumentDefaultsHelpFormatter)
+    parser.add_argument('--collector',
+                        default=os.path.join(os.path.dirname(
+                                             os.path.abspath(__file__)),
+                                             '..', '..', 'build',
+                                             'ves-collector', 'monitor.py'),
+                        help='collector script to test')
+    parser.add_argument('--events', type=int, default=1000,
+                        help='events to post')
+    parser.add_argument('--rate', type=float, default=200,
+                        help='events posted a second')
+    parser.add_argument('--outage', type=float, default=2,
+                        help='seconds the stand-in is not listening')
+    parser.add_argument('--warmup', type=float, default=3,
+                        help='seconds it then answers writes with 503')
+    parser.add_argument('--batch-points', type=int, default=50,
+                        help='influxdb_batch_points for the collector')
+    parser.add_argument('--timeout', type=float, default=60,
+                        help='seconds to wait for the spool to drain')
+    args = parser.parse_args()
+
+    directory = tempfile.mkdtemp(prefix='ves-spool-test-')
+    influx_port = free_port()
+    vel_port = free_port()
+    config = write_config(directory, vel_port, influx_port,
+                          args.batch_points)
+    url = 'http://127.0.0.1:{0}/eventListener/v5'.format(vel_port)
+
+    stand_in = InfluxStandIn(influx_port)
+    stand_in.start()
+    collector = subprocess.Popen([sys.executable, args.collector,
+                                  '--config', config,
+                                  '--section', 'default'],
+                                 stdout=open(os.path.join(directory,
+                                                          'monitor.log'), 'w'),
+                                 stderr=subprocess.STDOUT,
+                                 close_fds=True)
+    try:
+        #----------------------------------------------------------------------
+        # Wait for the collector to listen.
+        #----------------------------------------------------------------------
+        deadline = time.time() + 30
+        while True:
+            try:
+                socket.create_connection(('127.0.0.1', vel_port), 1).close()
+                break
+            except socket.error:
+                if collector.poll() is not None or time.time() > deadline:
+                    print('Collector did not start; see {0}'.format(
+                                                                  directory))
+                    return 1
+                time.sleep(0.2)
+
+        #----------------------------------------------------------------------
+        # Stream the events, restarting the stand-in a third of the way in.
+        #----------------------------------------------------------------------
+        print('Posting {0} events at {1}/s to {2}'.format(args.events,
+                                                          args.rate, url))
+        start = time.time()
+        restart_at = args.events // 3
+        restarted = None
+        posted = 0
+        for sequence in range(args.events):
+            if sequence == restart_at:
+                print('Stopping the InfluxDB stand-in')
+                stand_in.stop()
+                restarted = time.time() + args.outage
+            if restarted is not None and time.time() >= restarted:
+                print('Restarting it, answering 503 for {0} s'.format(
+                                                                 args.warmup))
+                stand_in.start(args.warmup)
+                restarted = None
+            time.sleep(max(0.0, start + sequence / args.rate - time.time()))
+            if post_event(url, heartbeat(sequence)):
+                posted += 1
+        if restarted is not None:
+            time.sleep(max(0.0, restarted - time.time()))
+            print('Restarting it, answering 503 for {0} s'.format(
+                                                                 args.warmup))
+            stand_in.start(args.warmup)
+
+        #----------------------------------------------------------------------
+        # Wait for every point, and for the spool to empty.
+        #----------------------------------------------------------------------
+        deadline = time.time() + args.warmup + args.timeout
+        while time.time() < deadline:
+            if len(stand_in.counts()) >= posted and not spooled(directory):
+                break
+            time.sleep(0.5)
+        time.sleep(1)
+    finally:
+        if collector.poll() is None:
+            collector.send_signal(signal.SIGINT)
+            collector.wait()
+        stand_in.stop()
+
+    counts = stand_in.counts()
+    lost = [s for s in range(args.events) if s not in counts]
+    duplicated = [s for s, count in counts.items() if count > 1]
+    print('{0} events posted, {1} points written, {2} writes refused while '
+          'warming up'.format(posted, sum(counts.values()), stand_in.refused))
+    print('{0} lost, {1} duplicated, {2} still spooled'.format(
+                                                  len(lost), len(duplicated),
+                                                  'some' if spooled(directory)
+                                                  else 'none'))
+    if lost or duplicated or posted != args.events:
+        if lost:
+            print('Lost: {0}'.format(lost[:20]))
+        if duplicated:
+            print('Duplicated: {0}'.format(duplicated[:20]))
+        print('FAILED; collector logs are in {0}'.format(directory))
+        return 1
+    shutil.rmtree(directory)
+    print('PASSED')
+    return 0
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,1265 @@
+/**************************************************************************//**
+ * @file
+ * Open-loop HTTP load generator for the VES collector's event listener.
+ *
+ * Events are posted over up to --connections non-blocking sockets driven by
+ * a single epoll loop, at a fixed rate: request i is due at start + i/rate
+ * whether or not earlier requests have been answered.  When every
+ * connection is busy, due requests wait and are sent as connections free
+ * up, and each latency is measured from when its request was due, not from
+ * when it was sent, so a stalled collector shows up in the percentiles
+ * rather than slowing the generator down (coordinated omission).
+ * Connections are kept alive when the server allows it and reopened when
+ * it doesn't.
+ *
+ * Bodies are VES 5.0 heartbeat, measurementsForVfScaling and fault events
+ * like those the demo agents send, or templates given with --body, with
+ * ${SOURCE}, ${SEQUENCE} and ${EPOCH} replaced in each request so every
+ * event has its own source sequence number and timestamp.
+ *
+ * With --sweep, runs are repeated at rates rising by --sweep-factor until
+ * one fails to keep up: less than 95% of the target rate completed,
+ * requests left unsent or unanswered, more than 1% errors, or a p99 latency
+ * over --slo-ms.  The rate between the last good and first failed run is
+ * then bisected to find the saturation point.
+ *
+ * Copyright 2017 AT&T Intellectual Property, Inc
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ *****************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/**************************************************************************//**
+ * Largest request, headers and body, and most response header bytes kept.
+ *****************************************************************************/
+#define LOADGEN_MAX_REQUEST 16384
+#define LOADGEN_MAX_RESPONSE 4096
+
+/**************************************************************************//**
+ * Most --body templates, sources and connections.
+ *****************************************************************************/
+#define LOADGEN_MAX_TEMPLATES 16
+#define LOADGEN_MAX_SOURCES 100000
+#define LOADGEN_MAX_CONNECTIONS 10000
+
+/**************************************************************************//**
+ * Latency histogram.  Values in microseconds below LOADGEN_HIST_LINEAR have
+ * a bucket each; above that each power of two is split into
+ * LOADGEN_HIST_LINEAR / 2 buckets, so every value is within 0.2%.
+ *****************************************************************************/
+#define LOADGEN_HIST_LINEAR 1024
+#define LOADGEN_HIST_SHIFTS 40
+#define LOADGEN_HIST_SIZE (LOADGEN_HIST_LINEAR + \
+                           LOADGEN_HIST_SHIFTS * (LOADGEN_HIST_LINEAR / 2))
+
+/**************************************************************************//**
+ * Events handled per epoll_wait() call.
+ *****************************************************************************/
+#define LOADGEN_EPOLL_EVENTS 256
+
+/**************************************************************************//**
+ * Connection states.
+ *****************************************************************************/
+typedef enum {
+  CONN_CLOSED,
+  CONN_IDLE,
+  CONN_CONNECTING,
+  CONN_WRITING,
+  CONN_READING
+} CONN_STATE;
+
+/**************************************************************************//**
+ * One connection to the collector, and the request it has in flight.
+ *****************************************************************************/
+typedef struct loadgen_conn {
+  int fd;
+  CONN_STATE state;
+  unsigned long long due_ns;
+  char request[LOADGEN_MAX_REQUEST];
+  size_t request_length;
+  size_t sent;
+  char response[LOADGEN_MAX_RESPONSE];
+  size_t response_length;
+  size_t header_length;
+  long long body_remaining;
+  int until_close;
+  int status;
+  int keep_alive;
+} LOADGEN_CONN;
+
+/**************************************************************************//**
+ * Results of one run.
+ *****************************************************************************/
+typedef struct loadgen_result {
+  double rate;
+  double seconds;
+  unsigned long long scheduled;
+  unsigned long long ok;
+  unsigned long long rejected;
+  unsigned long long errors;
+  unsigned long long unsent;
+  unsigned long long unanswered;
+  unsigned long long connects;
+  unsigned long long histogram[LOADGEN_HIST_SIZE];
+  unsigned long long samples;
+  unsigned long long max_us;
+  unsigned long long last_ns;
+} LOADGEN_RESULT;
+
+/**************************************************************************//**
+ * Definition of long options to the load generator.
+ *****************************************************************************/
+static const struct option long_options[] = {
+    {"help",         no_argument,       0, 'h'},
+    {"fqdn",         required_argument, 0, 'f'},
+    {"port",         required_argument, 0, 'n'},
+    {"path",         required_argument, 0, 'P'},
+    {"username",     required_argument, 0, 'u'},
+    {"password",     required_argument, 0, 'w'},
+    {"connections",  required_argument, 0, 'c'},
+    {"rate",         required_argument, 0, 'r'},
+    {"duration",     required_argument, 0, 'd'},
+    {"drain",        required_argument, 0, 'D'},
+    {"sources",      required_argument, 0, 's'},
+    {"body",         required_argument, 0, 'b'},
+    {"sweep",        no_argument,       0, 'S'},
+    {"sweep-factor", required_argument, 0, 'F'},
+    {"max-rate",     required_argument, 0, 'M'},
+    {"refine",       required_argument, 0, 'R'},
+    {"slo-ms",       required_argument, 0, 'l'},
+    {"pause",        required_argument, 0, 'p'},
+    {0, 0, 0, 0}
+  };
+
+static const char* short_options = "hf:n:P:u:w:c:r:d:D:s:b:SF:M:R:l:p:";
+
+static const char* usage_text =
+"ves_loadgen [--help]\n"
+"            [--fqdn <domain>]\n"
+"            [--port <port>]\n"
+"            [--path <path>]\n"
+"            [--username <username>]\n"
+"            [--password <password>]\n"
+"            [--connections <connections>]\n"
+"            [--rate <events per second>]\n"
+"            [--duration <seconds>]\n"
+"            [--drain <seconds>]\n"
+"            [--sources <sources>]\n"
+"            [--body <template file>]...\n"
+"            [--sweep]\n"
+"            [--sweep-factor <factor>]\n"
+"            [--max-rate <events per second>]\n"
+"            [--refine <runs>]\n"
+"            [--slo-ms <milliseconds>]\n"
+"            [--pause <seconds>]\n"
+"\n"
+"Post VES events to a collector at a fixed open-loop rate and report the\n"
+"throughput and the latency percentiles, measured from when each request\n"
+"was due so that a stalled collector isn't hidden (coordinated omission).\n"
+"\n"
+"  -f         The FQDN or IP address of the collector.  Default = localhost.\n"
+"  --fqdn\n"
+"\n"
+"  -n         The port of the collector.  Default = 30000.\n"
+"  --port\n"
+"\n"
+"  -P         The event listener path.  Default = /eventListener/v5.\n"
+"  --path\n"
+"\n"
+"  -u         Username and password for the collector's Basic\n"
+"  --username authentication, if any.\n"
+"  -w\n"
+"  --password\n"
+"\n"
+"  -c         Most concurrent connections.  Default = 64.\n"
+"  --connections\n"
+"\n"
+"  -r         Events posted per second; with --sweep the first rate tried.\n"
+"  --rate     Default = 100.\n"
+"\n"
+"  -d         Seconds to post for at each rate.  Default = 10.\n"
+"  --duration\n"
+"\n"
+"  -D         Seconds after the last request is due to wait for answers.\n"
+"  --drain    Default = 5.\n"
+"\n"
+"  -s         Distinct sourceName/sourceId values, round robin.  Default = 10.\n"
+"  --sources\n"
+"\n"
+"  -b         A file holding an event body, in which ${SOURCE}, ${SEQUENCE}\n"
+"  --body     and ${EPOCH} are replaced per request.  May be repeated; the\n"
+"             templates are used in turn.  Default = heartbeat,\n"
+"             measurementsForVfScaling and fault events.\n"
+"\n"
+"  -S         Raise the rate until the collector can't keep up, then\n"
+"  --sweep    bisect to find the saturation point.\n"
+"\n"
+"  -F         Factor the rate rises by between sweep runs.  Default = 1.5.\n"
+"  --sweep-factor\n"
+"\n"
+"  -M         Highest rate a sweep tries.  Default = 1000000.\n"
+"  --max-rate\n"
+"\n"
+"  -R         Bisection runs after the sweep.  Default = 3.\n"
+"  --refine\n"
+"\n"
+"  -l         p99 latency a run must meet to count as keeping up.\n"
+"  --slo-ms   Default = 200.\n"
+"\n"
+"  -p         Seconds to pause between runs, for the collector to drain.\n"
+"  --pause    Default = 5.\n";
+
+/**************************************************************************//**
+ * Event templates used unless --body is given, after the demo agents'.
+ *****************************************************************************/
+static const char * const default_templates[] = {
+  "{\"event\": {\"commonEventHeader\": {\"domain\": \"heartbeat\", "
+  "\"eventId\": \"heartbeat${SEQUENCE}\", \"eventName\": "
+  "\"Heartbeat_vLoadGen\", \"eventType\": \"Autonomous heartbeat\", "
+  "\"lastEpochMicrosec\": ${EPOCH}, \"priority\": \"Normal\", "
+  "\"reportingEntityName\": \"${SOURCE}\", \"sequence\": ${SEQUENCE}, "
+  "\"sourceId\": \"${SOURCE}\", \"sourceName\": \"${SOURCE}\", "
+  "\"startEpochMicrosec\": ${EPOCH}, \"version\": 3.0}, "
+  "\"heartbeatFields\": {\"heartbeatFieldsVersion\": 1.0, "
+  "\"heartbeatInterval\": 60}}}",
+
+  "{\"event\": {\"commonEventHeader\": {\"domain\": "
+  "\"measurementsForVfScaling\", \"eventId\": \"mvfs${SEQUENCE}\", "
+  "\"eventName\": \"Mfvs_vLoadGen\", \"eventType\": \"HTTP request rate\", "
+  "\"lastEpochMicrosec\": ${EPOCH}, \"priority\": \"Normal\", "
+  "\"reportingEntityName\": \"${SOURCE}\", \"sequence\": ${SEQUENCE}, "
+  "\"sourceId\": \"${SOURCE}\", \"sourceName\": \"${SOURCE}\", "
+  "\"startEpochMicrosec\": ${EPOCH}, \"version\": 3.0}, "
+  "\"measurementsForVfScalingFields\": {\"measurementInterval\": 10, "
+  "\"measurementsForVfScalingVersion\": 2.1, \"requestRate\": 520, "
+  "\"cpuUsageArray\": [{\"cpuIdentifier\": \"cpu0\", \"cpuIdle\": 87.4, "
+  "\"cpuUsageSystem\": 3.1, \"cpuUsageUser\": 9.5, \"percentUsage\": 12.6}], "
+  "\"memoryUsageArray\": [{\"memoryFree\": 1573584, \"memoryUsed\": 464576, "
+  "\"vmIdentifier\": \"${SOURCE}\"}], "
+  "\"vNicPerformanceArray\": [{\"vNicIdentifier\": \"eth0\", "
+  "\"valuesAreSuspect\": \"false\", "
+  "\"receivedOctetsAccumulated\": 284756921, "
+  "\"receivedTotalPacketsAccumulated\": 923817, "
+  "\"transmittedOctetsAccumulated\": 1893782645, "
+  "\"transmittedTotalPacketsAccumulated\": 1456225}], "
+  "\"additionalFields\": [{\"name\": "
+  "\"cpu-aggregation-cpu-average-idle-percent-value\", "
+  "\"value\": \"87.4\"}]}}}",
+
+  "{\"event\": {\"commonEventHeader\": {\"domain\": \"fault\", "
+  "\"eventId\": \"fault${SEQUENCE}\", \"eventName\": \"Fault_vLoadGen\", "
+  "\"eventType\": \"App state change\", "
+  "\"lastEpochMicrosec\": ${EPOCH}, \"priority\": \"High\", "
+  "\"reportingEntityName\": \"${SOURCE}\", \"sequence\": ${SEQUENCE}, "
+  "\"sourceId\": \"${SOURCE}\", \"sourceName\": \"${SOURCE}\", "
+  "\"startEpochMicrosec\": ${EPOCH}, \"version\": 3.0}, "
+  "\"faultFields\": {\"alarmCondition\": \"vLoadGen state change\", "
+  "\"eventSeverity\": \"MAJOR\", \"eventSourceType\": \"virtualMachine\", "
+  "\"faultFieldsVersion\": 2.0, \"specificProblem\": \"Stopped\", "
+  "\"vfStatus\": \"Active\"}}}"
+};
+
+static const char * fqdn = "localhost";
+static int port = 30000;
+static const char * path = "/eventListener/v5";
+static char authorization[512] = "";
+static int max_connections = 64;
+static double duration = 10;
+static double drain = 5;
+static int sources = 10;
+static const char * templates[LOADGEN_MAX_TEMPLATES];
+static int template_count = 0;
+
+static struct sockaddr_storage address;
+static socklen_t address_length;
+static int epoll_fd = -1;
+static LOADGEN_CONN * connections;
+static int * free_connections;
+static int free_count;
+static unsigned long long * sequences;
+static LOADGEN_RESULT result;
+
+/**************************************************************************//**
+ * Nanoseconds on the monotonic clock.
+ *****************************************************************************/
+static unsigned long long loadgen_now(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**************************************************************************//**
+ * Microseconds since the epoch, for event timestamps.
+ *****************************************************************************/
+static unsigned long long loadgen_epoch_us(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/**************************************************************************//**
+ * Histogram bucket of a latency.
+ *
+ * @param[in] us  The latency in microseconds.
+ * @returns The bucket index.
+ *****************************************************************************/
+static int hist_index(unsigned long long us)
+{
+  int shift;
+
+  if (us < LOADGEN_HIST_LINEAR)
+  {
+    return (int)us;
+  }
+  shift = 63 - __builtin_clzll(us) - 9;
+  if (shift > LOADGEN_HIST_SHIFTS)
+  {
+    return LOADGEN_HIST_SIZE - 1;
+  }
+  return LOADGEN_HIST_LINEAR + (shift - 1) * (LOADGEN_HIST_LINEAR / 2) +
+         (int)((us >> shift) - LOADGEN_HIST_LINEAR / 2);
+}
+
+/**************************************************************************//**
+ * Highest latency in a histogram bucket.
+ *
+ * @param[in] index  The bucket index.
+ * @returns The latency in microseconds.
+ *****************************************************************************/
+static unsigned long long hist_value(int index)
+{
+  int shift;
+  unsigned long long mantissa;
+
+  if (index < LOADGEN_HIST_LINEAR)
+  {
+    return index;
+  }
+  index -= LOADGEN_HIST_LINEAR;
+  shift = index / (LOADGEN_HIST_LINEAR / 2) + 1;
+  mantissa = index % (LOADGEN_HIST_LINEAR / 2) + LOADGEN_HIST_LINEAR / 2;
+  return ((mantissa + 1) << shift) - 1;
+}
+
+/**************************************************************************//**
+ * Latency at a percentile of the current run.
+ *
+ * @param[in] percentile  The percentile, 0-100.
+ * @returns The latency in milliseconds, or 0 if nothing was answered.
+ *****************************************************************************/
+static double hist_percentile(double percentile)
+{
+  unsigned long long rank;
+  unsigned long long seen = 0;
+  int i;
+
+  if (result.samples == 0)
+  {
+    return 0;
+  }
+  rank = (unsigned long long)(percentile / 100.0 * result.samples + 0.999999);
+  if (rank < 1)
+  {
+    rank = 1;
+  }
+  for (i = 0; i < LOADGEN_HIST_SIZE; i++)
+  {
+    seen += result.histogram[i];
+    if (seen >= rank)
+    {
+      unsigned long long us = hist_value(i);
+      return (us < result.max_us ? us : result.max_us) / 1000.0;
+    }
+  }
+  return result.max_us / 1000.0;
+}
+
+/**************************************************************************//**
+ * Base64-encode a string, for the Authorization header.
+ *****************************************************************************/
+static void base64_encode(const char * in, char * out, size_t size)
+{
+  static const char digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  size_t length = strlen(in);
+  size_t i;
+  size_t o = 0;
+
+  for (i = 0; i < length && o + 5 < size; i += 3)
+  {
+    unsigned long triple = (unsigned char)in[i] << 16;
+    if (i + 1 < length) triple |= (unsigned char)in[i + 1] << 8;
+    if (i + 2 < length) triple |= (unsigned char)in[i + 2];
+    out[o++] = digits[(triple >> 18) & 63];
+    out[o++] = digits[(triple >> 12) & 63];
+    out[o++] = i + 1 < length ? digits[(triple >> 6) & 63] : '=';
+    out[o++] = i + 2 < length ? digits[triple & 63] : '=';
+  }
+  out[o] = '\0';
+}
+
+/**************************************************************************//**
+ * Read a --body template.
+ *
+ * @param[in] file  The file.
+ * @returns The template, or NULL on failure.
+ *****************************************************************************/
+static char * read_template(const char * file)
+{
+  FILE * fp = fopen(file, "r");
+  char * body;
+  size_t length;
+
+  if (fp == NULL)
+  {
+    fprintf(stderr, "Failed to open %s.\n", file);
+    return NULL;
+  }
+  body = malloc(LOADGEN_MAX_REQUEST);
+  length = fread(body, 1, LOADGEN_MAX_REQUEST - 1, fp);
+  if (!feof(fp))
+  {
+    fprintf(stderr, "%s is too large.\n", file);
+    fclose(fp);
+    free(body);
+    return NULL;
+  }
+  fclose(fp);
+  while (length > 0 && (body[length - 1] == '\n' || body[length - 1] == '\r'))
+  {
+    length--;
+  }
+  body[length] = '\0';
+  return body;
+}
+
+/**************************************************************************//**
+ * Build request number n into a connection's buffer.
+ *
+ * @returns 0 on success, -1 if the request doesn't fit.
+ *****************************************************************************/
+static int build_request(LOADGEN_CONN * conn, unsigned long long n)
+{
+  char body[LOADGEN_MAX_REQUEST];
+  char source[32];
+  char sequence[24];
+  char epoch[24];
+  const int source_index = (int)(n % sources);
+  const char * p = templates[(n / sources) % template_count];
+  size_t length = 0;
+  int header_length;
+
+  snprintf(source, sizeof(source), "loadgen-%d", source_index);
+  snprintf(sequence, sizeof(sequence), "%llu", sequences[source_index]++);
+  snprintf(epoch, sizeof(epoch), "%llu", loadgen_epoch_us());
+
+  while (*p != '\0')
+  {
+    const char * value = NULL;
+    size_t skip = 0;
+    size_t value_length;
+
+    if (p[0] == '$' && p[1] == '{')
+    {
+      if (strncmp(p, "${SOURCE}", 9) == 0)
+      {
+        value = source;
+        skip = 9;
+      }
+      else if (strncmp(p, "${SEQUENCE}", 11) == 0)
+      {
+        value = sequence;
+        skip = 11;
+      }
+      else if (strncmp(p, "${EPOCH}", 8) == 0)
+      {
+        value = epoch;
+        skip = 8;
+      }
+    }
+    if (value == NULL)
+    {
+      if (length + 1 >= sizeof(body))
+      {
+        return -1;
+      }
+      body[length++] = *p++;
+      continue;
+    }
+    value_length = strlen(value);
+    if (length + value_length >= sizeof(body))
+    {
+      return -1;
+    }
+    memcpy(body + length, value, value_length);
+    length += value_length;
+    p += skip;
+  }
+
+  header_length = snprintf(conn->request, sizeof(conn->request),
+                           "POST %s HTTP/1.1\r\n"
+                           "Host: %s:%d\r\n"
+                           "%s"
+                           "Content-Type: application/json\r\n"
+                           "Content-Length: %zu\r\n"
+                           "\r\n",
+                           path, fqdn, port, authorization, length);
+  if (header_length < 0 ||
+      (size_t)header_length + length > sizeof(conn->request))
+  {
+    return -1;
+  }
+  memcpy(conn->request + header_length, body, length);
+  conn->request_length = header_length + length;
+  conn->sent = 0;
+  return 0;
+}
+
+/**************************************************************************//**
+ * Watch a connection for reading or writing.
+ *****************************************************************************/
+static void conn_watch(LOADGEN_CONN * conn, unsigned int events, int add)
+{
+  struct epoll_event event;
+
+  event.events = events;
+  event.data.ptr = conn;
+  epoll_ctl(epoll_fd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/**************************************************************************//**
+ * Close a connection and put it back on the free list.
+ *****************************************************************************/
+static void conn_close(LOADGEN_CONN * conn)
+{
+  if (conn->fd >= 0)
+  {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  if (conn->state != CONN_IDLE)
+  {
+    free_connections[free_count++] = (int)(conn - connections);
+  }
+  conn->state = CONN_CLOSED;
+}
+
+/**************************************************************************//**
+ * Record a failed request and close its connection.
+ *****************************************************************************/
+static void conn_fail(LOADGEN_CONN * conn)
+{
+  result.errors++;
+  conn_close(conn);
+}
+
+/**************************************************************************//**
+ * Record an answered request and free its connection.
+ *****************************************************************************/
+static void conn_complete(LOADGEN_CONN * conn)
+{
+  unsigned long long now = loadgen_now();
+  unsigned long long us = now > conn->due_ns ? (now - conn->due_ns) / 1000 : 0;
+
+  result.histogram[hist_index(us)]++;
+  result.samples++;
+  result.last_ns = now;
+  if (us > result.max_us)
+  {
+    result.max_us = us;
+  }
+  if (conn->status >= 200 && conn->status < 300)
+  {
+    result.ok++;
+  }
+  else
+  {
+    result.rejected++;
+  }
+
+  if (conn->keep_alive)
+  {
+    conn->state = CONN_IDLE;
+    conn_watch(conn, EPOLLIN, 0);
+    free_connections[free_count++] = (int)(conn - connections);
+  }
+  else
+  {
+    conn_close(conn);
+  }
+}
+
+/**************************************************************************//**
+ * Write as much of the request as the socket takes.
+ *****************************************************************************/
+static void conn_write(LOADGEN_CONN * conn)
+{
+  while (conn->sent < conn->request_length)
+  {
+    ssize_t n = send(conn->fd,
+                     conn->request + conn->sent,
+                     conn->request_length - conn->sent,
+                     MSG_NOSIGNAL);
+    if (n < 0)
+    {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        conn->state = CONN_WRITING;
+        conn_watch(conn, EPOLLOUT, 0);
+        return;
+      }
+      conn_fail(conn);
+      return;
+    }
+    conn->sent += n;
+  }
+  conn->state = CONN_READING;
+  conn->response_length = 0;
+  conn->header_length = 0;
+  conn_watch(conn, EPOLLIN, 0);
+}
+
+/**************************************************************************//**
+ * Parse the status line and headers once they are all in.
+ *
+ * @returns 1 if the headers are complete, 0 if more are needed.
+ *****************************************************************************/
+static int conn_parse_headers(LOADGEN_CONN * conn)
+{
+  char * end;
+  char * line;
+  int minor = 1;
+
+  conn->response[conn->response_length] = '\0';
+  end = strstr(conn->response, "\r\n\r\n");
+  if (end == NULL)
+  {
+    return 0;
+  }
+  conn->header_length = end + 4 - conn->response;
+  *end = '\0';
+
+  if (sscanf(conn->response, "HTTP/1.%d %d", &minor, &conn->status) != 2)
+  {
+    conn->status = 0;
+  }
+  conn->keep_alive = minor >= 1;
+  conn->until_close = 0;
+  conn->body_remaining = -1;
+  for (line = strstr(conn->response, "\r\n");
+       line != NULL;
+       line = strstr(line, "\r\n"))
+  {
+    line += 2;
+    if (strncasecmp(line, "Content-Length:", 15) == 0)
+    {
+      conn->body_remaining = atoll(line + 15);
+    }
+    else if (strncasecmp(line, "Connection:", 11) == 0)
+    {
+      if (strcasestr(line + 11, "close") != NULL)
+      {
+        conn->keep_alive = 0;
+      }
+      else if (strcasestr(line + 11, "keep-alive") != NULL)
+      {
+        conn->keep_alive = 1;
+      }
+    }
+  }
+  if (conn->body_remaining < 0 &&
+      (conn->status == 204 || conn->status == 304 || conn->status < 200))
+  {
+    conn->body_remaining = 0;
+  }
+  if (conn->body_remaining < 0)
+  {
+    /* No length: the body runs to the end of the connection.               */
+    conn->until_close = 1;
+    conn->keep_alive = 0;
+  }
+  else
+  {
+    conn->body_remaining -= conn->response_length - conn->header_length;
+  }
+  return 1;
+}
+
+/**************************************************************************//**
+ * Read what has arrived on a connection.
+ *****************************************************************************/
+static void conn_read(LOADGEN_CONN * conn)
+{
+  char discard[LOADGEN_MAX_RESPONSE];
+
+  for (;;)
+  {
+    char * buffer = discard;
+    size_t space = sizeof(discard);
+    ssize_t n;
+
+    if (conn->state == CONN_READING && conn->header_length == 0)
+    {
+      buffer = conn->response + conn->response_length;
+      space = sizeof(conn->response) - 1 - conn->response_length;
+      if (space == 0)
+      {
+        conn_fail(conn);
+        return;
+      }
+    }
+    n = recv(conn->fd, buffer, space, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      return;
+    }
+    if (conn->state == CONN_IDLE)
+    {
+      /* The server closed a kept-alive connection, or sent something       */
+      /* unasked for; either way it is no use.                              */
+      close(conn->fd);
+      conn->fd = -1;
+      conn->state = CONN_CLOSED;
+      return;
+    }
+    if (n <= 0)
+    {
+      /* A response without a length ends with the connection; anything    */
+      /* else ending early is an error, including a kept-alive connection  */
+      /* the server closed as the request went out, which isn't retried as */
+      /* the server may have seen it.                                      */
+      if (n == 0 && conn->header_length > 0 && conn->until_close)
+      {
+        conn_complete(conn);
+      }
+      else
+      {
+        conn_fail(conn);
+      }
+      return;
+    }
+    if (conn->header_length == 0)
+    {
+      conn->response_length += n;
+      if (!conn_parse_headers(conn))
+      {
+        continue;
+      }
+    }
+    else
+    {
+      conn->body_remaining -= n;
+    }
+    if (!conn->until_close && conn->body_remaining <= 0)
+    {
+      conn_complete(conn);
+      return;
+    }
+  }
+}
+
+/**************************************************************************//**
+ * Start connecting a closed connection.
+ *
+ * @returns 0 if connected or connecting, -1 on failure.
+ *****************************************************************************/
+static int conn_open(LOADGEN_CONN * conn)
+{
+  int one = 1;
+
+  conn->fd = socket(address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (conn->fd < 0)
+  {
+    return -1;
+  }
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  result.connects++;
+  if (connect(conn->fd, (struct sockaddr *)&address, address_length) == 0)
+  {
+    conn->state = CONN_WRITING;
+    conn_watch(conn, EPOLLOUT, 1);
+    return 0;
+  }
+  if (errno != EINPROGRESS)
+  {
+    close(conn->fd);
+    conn->fd = -1;
+    return -1;
+  }
+  conn->state = CONN_CONNECTING;
+  conn_watch(conn, EPOLLOUT, 1);
+  return 0;
+}
+
+/**************************************************************************//**
+ * Send request number n, due at due_ns, on a free connection.
+ *****************************************************************************/
+static void dispatch(unsigned long long n, unsigned long long due_ns)
+{
+  LOADGEN_CONN * conn = &connections[free_connections[--free_count]];
+
+  conn->due_ns = due_ns;
+  if (build_request(conn, n) != 0)
+  {
+    fprintf(stderr, "Request too large.\n");
+    exit(1);
+  }
+  if (conn->state == CONN_CLOSED)
+  {
+    if (conn_open(conn) != 0)
+    {
+      result.errors++;
+      free_connections[free_count++] = (int)(conn - connections);
+      return;
+    }
+    if (conn->state == CONN_CONNECTING)
+    {
+      return;
+    }
+  }
+  conn->state = CONN_WRITING;
+  conn_write(conn);
+}
+
+/**************************************************************************//**
+ * Handle readiness of a connection.
+ *****************************************************************************/
+static void conn_ready(LOADGEN_CONN * conn, unsigned int events)
+{
+  if (conn->state == CONN_CONNECTING)
+  {
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    if (error != 0 || (events & EPOLLERR))
+    {
+      conn_fail(conn);
+      return;
+    }
+    conn->state = CONN_WRITING;
+  }
+  if (conn->state == CONN_WRITING)
+  {
+    conn_write(conn);
+  }
+  else if (conn->state == CONN_READING || conn->state == CONN_IDLE)
+  {
+    conn_read(conn);
+  }
+}
+
+/**************************************************************************//**
+ * Post at a fixed rate for the configured duration.
+ *
+ * Request i is due at start + i / rate.  Requests are sent when due if a
+ * connection is free, or as soon as one is; any still unsent drain seconds
+ * after the last was due are counted as unsent, and any still in flight as
+ * unanswered.
+ *
+ * @param[in] rate  Events per second.
+ *****************************************************************************/
+static void run(double rate)
+{
+  struct epoll_event events[LOADGEN_EPOLL_EVENTS];
+  const unsigned long long total = (unsigned long long)(rate * duration);
+  const double interval_ns = 1e9 / rate;
+  unsigned long long start;
+  unsigned long long deadline;
+  unsigned long long next = 0;
+  int i;
+
+  memset(&result, 0, sizeof(result));
+  result.rate = rate;
+  result.scheduled = total;
+
+  start = loadgen_now();
+  deadline = start + (unsigned long long)((duration + drain) * 1e9);
+  for (;;)
+  {
+    unsigned long long now = loadgen_now();
+    int timeout = 100;
+    int ready;
+
+    while (next < total && free_count > 0 &&
+           start + (unsigned long long)(next * interval_ns) <= now)
+    {
+      dispatch(next, start + (unsigned long long)(next * interval_ns));
+      next++;
+    }
+    if (free_count == max_connections && next >= total)
+    {
+      break;
+    }
+    if (now >= deadline)
+    {
+      break;
+    }
+    if (next < total && free_count > 0)
+    {
+      unsigned long long due = start +
+                               (unsigned long long)(next * interval_ns);
+      timeout = due > now ? (int)((due - now + 999999) / 1000000) : 0;
+    }
+
+    ready = epoll_wait(epoll_fd, events, LOADGEN_EPOLL_EVENTS, timeout);
+    for (i = 0; i < ready; i++)
+    {
+      conn_ready((LOADGEN_CONN *)events[i].data.ptr, events[i].events);
+    }
+  }
+
+  result.unsent = total - next;
+  for (i = 0; i < max_connections; i++)
+  {
+    LOADGEN_CONN * conn = &connections[i];
+    if (conn->state == CONN_CONNECTING || conn->state == CONN_WRITING ||
+        conn->state == CONN_READING)
+    {
+      result.unanswered++;
+      conn_close(conn);
+    }
+  }
+  result.seconds = (result.last_ns > start ? result.last_ns - start : 0) / 1e9;
+  if (result.seconds < duration)
+  {
+    result.seconds = duration;
+  }
+}
+
+/**************************************************************************//**
+ * Whether the last run kept up with its rate.
+ *****************************************************************************/
+static int kept_up(double slo_ms)
+{
+  const double answered = result.ok + result.rejected;
+
+  return answered >= 0.95 * result.scheduled &&
+         result.unsent == 0 &&
+         result.unanswered == 0 &&
+         result.errors + result.rejected <= 0.01 * result.scheduled &&
+         hist_percentile(99) <= slo_ms;
+}
+
+/**************************************************************************//**
+ * Print the results of the last run on one line.
+ *****************************************************************************/
+static void report(double slo_ms)
+{
+  printf("%10.0f %10.1f %9llu %7llu %7llu %7llu %7llu %8llu "
+         "%8.2f %8.2f %8.2f %8.2f %8.2f %8.2f  %s\n",
+         result.rate,
+         (result.ok + result.rejected) / result.seconds,
+         result.ok,
+         result.rejected,
+         result.errors,
+         result.unsent,
+         result.unanswered,
+         result.connects,
+         hist_percentile(50),
+         hist_percentile(90),
+         hist_percentile(99),
+         hist_percentile(99.9),
+         hist_percentile(99.99),
+         result.max_us / 1000.0,
+         kept_up(slo_ms) ? "ok" : "SATURATED");
+  fflush(stdout);
+}
+
+/**************************************************************************//**
+ * Main function of the load generator.
+ *
+ * @param[in] argc  Argument count.
+ * @param[in] argv  Argument vector - for usage see usage_text.
+ *****************************************************************************/
+int main(int argc, char ** argv)
+{
+  int option_index = 0;
+  int param = 0;
+  const char * username = NULL;
+  const char * password = "";
+  double rate = 100;
+  int sweep = 0;
+  double sweep_factor = 1.5;
+  double max_rate = 1000000;
+  int refine = 3;
+  double slo_ms = 200;
+  double pause = 5;
+  char service[16];
+  struct addrinfo hints;
+  struct addrinfo * addresses;
+  int i;
+
+  param = getopt_long(argc, argv,
+                      short_options,
+                      long_options,
+                      &option_index);
+  while (param != -1)
+  {
+    switch (param)
+    {
+      case 'h':
+        fputs(usage_text, stdout);
+        exit(0);
+        break;
+
+      case 'f':
+        fqdn = optarg;
+        break;
+
+      case 'n':
+        port = atoi(optarg);
+        break;
+
+      case 'P':
+        path = optarg;
+        break;
+
+      case 'u':
+        username = optarg;
+        break;
+
+      case 'w':
+        password = optarg;
+        break;
+
+      case 'c':
+        max_connections = atoi(optarg);
+        break;
+
+      case 'r':
+        rate = atof(optarg);
+        break;
+
+      case 'd':
+        duration = atof(optarg);
+        break;
+
+      case 'D':
+        drain = atof(optarg);
+        break;
+
+      case 's':
+        sources = atoi(optarg);
+        break;
+
+      case 'b':
+        if (template_count == LOADGEN_MAX_TEMPLATES)
+        {
+          fprintf(stderr, "At most %d --body templates.\n",
+                  LOADGEN_MAX_TEMPLATES);
+          exit(1);
+        }
+        templates[template_count] = read_template(optarg);
+        if (templates[template_count] == NULL)
+        {
+          exit(1);
+        }
+        template_count++;
+        break;
+
+      case 'S':
+        sweep = 1;
+        break;
+
+      case 'F':
+        sweep_factor = atof(optarg);
+        break;
+
+      case 'M':
+        max_rate = atof(optarg);
+        break;
+
+      case 'R':
+        refine = atoi(optarg);
+        break;
+
+      case 'l':
+        slo_ms = atof(optarg);
+        break;
+
+      case 'p':
+        pause = atof(optarg);
+        break;
+
+      default:
+        fputs(usage_text, stderr);
+        exit(-1);
+    }
+    param = getopt_long(argc, argv,
+                        short_options,
+                        long_options,
+                        &option_index);
+  }
+
+  if (rate <= 0 || duration <= 0 || drain < 0 || sweep_factor <= 1 ||
+      max_connections < 1 || max_connections > LOADGEN_MAX_CONNECTIONS ||
+      sources < 1 || sources > LOADGEN_MAX_SOURCES)
+  {
+    fprintf(stderr, "Rate and duration must be greater than zero, the sweep "
+                    "factor greater than one, connections between 1 and %d "
+                    "and sources between 1 and %d.\n",
+            LOADGEN_MAX_CONNECTIONS, LOADGEN_MAX_SOURCES);
+    exit(1);
+  }
+  if (template_count == 0)
+  {
+    for (i = 0; i < (int)(sizeof(default_templates) /
+                          sizeof(default_templates[0])); i++)
+    {
+      templates[template_count++] = default_templates[i];
+    }
+  }
+  if (username != NULL)
+  {
+    char credentials[256];
+    char encoded[360];
+
+    snprintf(credentials, sizeof(credentials), "%s:%s", username, password);
+    base64_encode(credentials, encoded, sizeof(encoded));
+    snprintf(authorization, sizeof(authorization),
+             "Authorization: Basic %s\r\n", encoded);
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%d", port);
+  if (getaddrinfo(fqdn, service, &hints, &addresses) != 0)
+  {
+    fprintf(stderr, "Failed to resolve %s.\n", fqdn);
+    exit(1);
+  }
+  memcpy(&address, addresses->ai_addr, addresses->ai_addrlen);
+  address_length = addresses->ai_addrlen;
+  freeaddrinfo(addresses);
+
+  signal(SIGPIPE, SIG_IGN);
+  epoll_fd = epoll_create1(0);
+  connections = calloc(max_connections, sizeof(LOADGEN_CONN));
+  free_connections = calloc(max_connections, sizeof(int));
+  sequences = calloc(sources, sizeof(unsigned long long));
+  if (epoll_fd < 0 || connections == NULL || free_connections == NULL ||
+      sequences == NULL)
+  {
+    fprintf(stderr, "Failed to set up %d connections.\n", max_connections);
+    exit(1);
+  }
+  for (i = 0; i < max_connections; i++)
+  {
+    connections[i].fd = -1;
+    connections[i].state = CONN_CLOSED;
+    free_connections[free_count++] = max_connections - 1 - i;
+  }
+
+  printf("Posting to http://%s:%d%s over up to %d connections, %g s per "
+         "rate, %d sources, %d templates\n",
+         fqdn, port, path, max_connections, duration, sources,
+         template_count);
+  printf("%10s %10s %9s %7s %7s %7s %7s %8s %8s %8s %8s %8s %8s %8s\n",
+         "target/s", "achieved/s", "2xx", "other", "errors", "unsent",
+         "unansd", "connects", "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "p99.99",
+         "max ms");
+
+  run(rate);
+  report(slo_ms);
+  if (sweep)
+  {
+    double good = 0;
+    double bad = 0;
+
+    if (kept_up(slo_ms))
+    {
+      good = rate;
+      while (rate * sweep_factor <= max_rate)
+      {
+        rate *= sweep_factor;
+        usleep((useconds_t)(pause * 1e6));
+        run(rate);
+        report(slo_ms);
+        if (!kept_up(slo_ms))
+        {
+          bad = rate;
+          break;
+        }
+        good = rate;
+      }
+    }
+    else
+    {
+      bad = rate;
+    }
+
+    for (i = 0; i < refine && good > 0 && bad > 0; i++)
+    {
+      rate = (good + bad) / 2;
+      usleep((useconds_t)(pause * 1e6));
+      run(rate);
+      report(slo_ms);
+      if (kept_up(slo_ms))
+      {
+        good = rate;
+      }
+      else
+      {
+        bad = rate;
+      }
+    }
+
+    if (good == 0)
+    {
+      printf("Saturated at the first rate tried, %.0f/s; try a lower "
+             "--rate.\n", bad);
+    }
+    else if (bad == 0)
+    {
+      printf("Kept up at every rate up to %.0f/s.\n", good);
+    }
+    else
+    {
+      printf("Saturation point: between %.0f/s (kept up) and %.0f/s.\n",
+             good, bad);
+    }
+  }
+
+  for (i = 0; i < max_connections; i++)
+  {
+    if (connections[i].fd >= 0)
+    {
+      close(connections[i].fd);
+    }
+  }
+  close(epoll_fd);
+  return 0;
+}
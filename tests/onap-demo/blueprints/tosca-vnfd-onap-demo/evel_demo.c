@@ -20,12 +20,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <sys/signal.h>
 #include <pthread.h>
 #include <mcheck.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include "evel.h"
 #include "evel_demo.h"
@@ -129,46 +131,204 @@ typedef enum {
 /*****************************************************************************/
 
 /**************************************************************************//**
- * Global flags related the applicaton.
+ * App container states, and their names as reported in faults.
  *****************************************************************************/
+typedef enum {
+  APP_STATE_STOPPED,
+  APP_STATE_RUNNING
+} APP_STATE;
+
+static const char * const app_state_names[] = {"Stopped", "Started"};
 
-char *app_prevstate = "Stopped";
+/**************************************************************************//**
+ * Fault correlation.
+ *
+ * State changes are not posted as they are seen.  A change must hold for
+ * FAULT_DEBOUNCE_SECONDS before it is reported, so a flapping entity does
+ * not raise a fault per transition.  Once FAULT_FLAP_THRESHOLD transitions
+ * have been seen without the entity settling, one "Flapping" fault is
+ * raised carrying the flap count and the times of the first and last
+ * transitions, refreshed at most once per FAULT_COALESCE_WINDOW while the
+ * flapping continues.  When the entity settles, a clear (severity NORMAL)
+ * is posted with the final totals.
+ *
+ * Entities are kept in a small open-addressed table, so each observation is
+ * a hash and a probe regardless of how many transitions there have been.
+ *****************************************************************************/
+#define FAULT_DEBOUNCE_SECONDS 15
+#define FAULT_FLAP_THRESHOLD 3
+#define FAULT_COALESCE_WINDOW 300
+#define FAULT_MAX_KEYS 64
+#define FAULT_MAX_KEY_LENGTH 64
+
+typedef struct fault_entity {
+  char key[FAULT_MAX_KEY_LENGTH];
+  APP_STATE state;              /* Last state observed.                     */
+  APP_STATE reported;           /* Last state reported to the collector.    */
+  time_t changed;               /* When state was last observed to change.  */
+  int flaps;                    /* Transitions since reported state.        */
+  time_t first_flap;
+  time_t last_flap;
+  int storm_open;               /* A Flapping fault is outstanding.         */
+  time_t storm_posted;
+  int storm_flaps;              /* flaps when the Flapping fault was posted.*/
+} FAULT_ENTITY;
+
+static FAULT_ENTITY fault_entities[FAULT_MAX_KEYS];
+
+/**************************************************************************//**
+ * Find or add the correlation state for a fault key.
+ *
+ * @param[in] key       Name of the entity.
+ * @param[in] initial   State assumed for a new entity.
+ * @returns The entity, or NULL if the table is full.
+ *****************************************************************************/
+static FAULT_ENTITY * fault_entity_lookup(const char * key, APP_STATE initial)
+{
+  unsigned int hash = 2166136261u;
+  const char * p;
+  FAULT_ENTITY * entity;
+  int i;
+
+  for (p = key; *p != '\0'; p++)
+  {
+    hash = (hash ^ (unsigned char)*p) * 16777619u;
+  }
+
+  for (i = 0; i < FAULT_MAX_KEYS; i++)
+  {
+    entity = &fault_entities[(hash + i) % FAULT_MAX_KEYS];
+    if (entity->key[0] == '\0')
+    {
+      strncpy(entity->key, key, FAULT_MAX_KEY_LENGTH - 1);
+      entity->state = initial;
+      entity->reported = initial;
+      return entity;
+    }
+    if (strncmp(entity->key, key, FAULT_MAX_KEY_LENGTH - 1) == 0)
+    {
+      return entity;
+    }
+  }
+  return NULL;
+}
+
+/**************************************************************************//**
+ * Add a UTC timestamp to a fault's additional information.
+ *****************************************************************************/
+static void fault_addl_time_add(EVENT_FAULT * fault,
+                                const char * name,
+                                time_t when)
+{
+  char text[32];
+
+  strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%SZ", gmtime(&when));
+  evel_fault_addl_info_add(fault, name, text);
+}
 
 /**************************************************************************//**
  * Report app state change fault.
  *
- * Reports the change in app state.
+ * Reports the change in app state, or that it is flapping or has settled.
  *
- * param[in]  char *change     The type of change ("Started", "Stopped")
+ * param[in]  entity    The entity whose state has changed.
+ * param[in]  problem   The specific problem: the new state, or "Flapping".
+ * param[in]  severity  EVEL_SEVERITY_NORMAL to clear a Flapping fault.
  *****************************************************************************/
-void report_app_statechange(char *change)
+void report_app_statechange(const FAULT_ENTITY * entity,
+                            const char * problem,
+                            EVEL_SEVERITIES severity)
 {
-  printf("report_app_statechange(%s)\n", change);
+  printf("report_app_statechange(%s, %s)\n", entity->key, problem);
   EVENT_FAULT * fault = NULL;
   EVEL_ERR_CODES evel_rc = EVEL_SUCCESS;
   int status = EVEL_VF_STATUS_ACTIVE;
-  
-  if (change == "Stopped") {
+  char flaps[16];
+
+  if (entity->state == APP_STATE_STOPPED) {
     status = EVEL_VF_STATUS_IDLE;
   }
 
   fault = evel_new_fault("App state change",
-    change,
+    problem,
     EVEL_PRIORITY_HIGH,
-    EVEL_SEVERITY_MAJOR,
+    severity,
     EVEL_SOURCE_VIRTUAL_NETWORK_FUNCTION,
     status);
 
   if (fault != NULL) {
     evel_fault_type_set(fault, "App state change");
-    evel_fault_addl_info_add(fault, "change", change);
+    evel_fault_addl_info_add(fault, "change", app_state_names[entity->state]);
+    if (entity->flaps > 0) {
+      snprintf(flaps, sizeof(flaps), "%d", entity->flaps);
+      evel_fault_addl_info_add(fault, "flapCount", flaps);
+      fault_addl_time_add(fault, "firstTransition", entity->first_flap);
+      fault_addl_time_add(fault, "lastTransition", entity->last_flap);
+    }
     evel_rc = evel_post_event((EVENT_HEADER *)fault);
     if (evel_rc != EVEL_SUCCESS) {
       EVEL_ERROR("Post failed %d (%s)", evel_rc, evel_error_string());
     }
-    else {
-       EVEL_ERROR("Unable to send new fault report");
+  }
+  else {
+    EVEL_ERROR("Unable to send new fault report");
+  }
+}
+
+/**************************************************************************//**
+ * Correlate an observation of an entity's state.
+ *
+ * param[in]  key       Name of the entity.
+ * param[in]  state     The state observed.
+ *****************************************************************************/
+void fault_correlate(const char * key, APP_STATE state)
+{
+  FAULT_ENTITY * entity = fault_entity_lookup(key, APP_STATE_STOPPED);
+  time_t now = time(NULL);
+
+  if (entity == NULL) {
+    EVEL_ERROR("Fault correlation table full, dropping %s", key);
+    return;
+  }
+
+  if (state != entity->state) {
+    printf("App state change detected: %s\n", app_state_names[state]);
+    entity->state = state;
+    entity->changed = now;
+    if (entity->flaps++ == 0) {
+      entity->first_flap = now;
     }
+    entity->last_flap = now;
+  }
+
+  if (entity->flaps == 0) {
+    return;
+  }
+
+  if (now - entity->changed >= FAULT_DEBOUNCE_SECONDS) {
+    /*************************************************************************/
+    /* Settled: clear any Flapping fault, or report a real change of state.  */
+    /*************************************************************************/
+    if (entity->storm_open) {
+      report_app_statechange(entity, app_state_names[state],
+                             EVEL_SEVERITY_NORMAL);
+    }
+    else if (state != entity->reported) {
+      report_app_statechange(entity, app_state_names[state],
+                             EVEL_SEVERITY_MAJOR);
+    }
+    entity->reported = state;
+    entity->flaps = 0;
+    entity->storm_open = 0;
+  }
+  else if (entity->storm_open ?
+           (entity->flaps > entity->storm_flaps &&
+            now - entity->storm_posted >= FAULT_COALESCE_WINDOW) :
+           entity->flaps >= FAULT_FLAP_THRESHOLD) {
+    report_app_statechange(entity, "Flapping", EVEL_SEVERITY_MAJOR);
+    entity->storm_open = 1;
+    entity->storm_posted = now;
+    entity->storm_flaps = entity->flaps;
   }
 }
 
@@ -183,28 +343,17 @@ void check_app_container_state() {
   printf("Checking status of app container\n");
   FILE *fp;
   int status;
-  char state[100];
+  char state[100] = "";
 
   fp = popen("sudo docker inspect onap-demo | grep Status | sed -- 's/,//g' | sed -- 's/\"//g' | sed -- 's/            Status: //g'", "r");
   if (fp == NULL) {
     EVEL_ERROR("popen failed to execute command");
+    return;
   }
 
   fgets(state, 100, fp);
-  if (strstr(state, "running") != NULL) {
-    if (strcmp(app_prevstate,"Stopped") == 0) {
-      printf("App state change detected: Started\n");
-      report_app_statechange("Started");
-      app_prevstate = "Running";
-    }
-  }
-  else {
-    if (strcmp(app_prevstate, "Running") == 0) {
-      printf("App state change detected: Stopped\n");
-      report_app_statechange("Stopped");
-      app_prevstate = "Stopped";
-    }
-  }
+  fault_correlate("onap-demo", strstr(state, "running") != NULL ?
+                               APP_STATE_RUNNING : APP_STATE_STOPPED);
   status = pclose(fp);
   if (status == -1) {
     EVEL_ERROR("pclose returned an error");
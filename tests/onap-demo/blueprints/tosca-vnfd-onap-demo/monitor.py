@@ -40,15 +40,53 @@ monitor_mode = "f"
 vdu_id = ['','','','','','']
 summary_e = ['***** Summary of key stats *****','','','']
 summary_c = ['Collectd agents:']
-status = ['','Started','Started','Started']
+status = ['','Started','Started','Started','Started']
 base_url = ''
 template_404 = b'''POST {0}'''
 columns = 0
 rows = 0
+policy = None
+resolver = None
 
-class JSONObject:
-  def __init__(self, d):
-    self.__dict__ = d
+class JSONView(object):
+  '''
+  Attribute access to an already decoded JSON object, e.g. e.event.domain.
+  Nested objects and arrays are wrapped only as they are reached, rather
+  than converting the whole tree up front.
+  '''
+  __slots__ = ('_obj',)
+
+  def __init__(self, obj):
+    self._obj = obj
+
+  def __getattr__(self, name):
+    try:
+      return json_view(self._obj[name])
+    except KeyError:
+      raise AttributeError(name)
+
+class JSONListView(object):
+  __slots__ = ('_list',)
+
+  def __init__(self, l):
+    self._list = l
+
+  def __getitem__(self, i):
+    return json_view(self._list[i])
+
+  def __iter__(self):
+    for v in self._list:
+      yield json_view(v)
+
+  def __len__(self):
+    return len(self._list)
+
+def json_view(v):
+  if isinstance(v, dict):
+    return JSONView(v)
+  if isinstance(v, list):
+    return JSONListView(v)
+  return v
 
 __all__ = []
 __version__ = 0.1
@@ -91,14 +129,125 @@ pending_command_list = None
 #------------------------------------------------------------------------------
 logger = None
 
-def listener(environ, start_response, schema):
+#------------------------------------------------------------------------------
+# Policy rules, used unless a policy_file is configured.  Scopes are VDUs
+# (vdu1..vdu4) or the groups they belong to (webserver, loadbalancer,
+# firewall); a rule with a list of scopes is evaluated for each separately.
+# Metrics are tps (requestRate), cpu (percent busy) and faults (1 per fault
+# event).  stat is mean, sum or count of the samples in the last window
+# seconds, or rate, the change per second across the window (for a group,
+# the sum of its VDUs' rates).  A rule fires
+# when the stat goes above (or below) its threshold and is re-armed only
+# once it is back past clear, and at most once per cooldown seconds.
+#------------------------------------------------------------------------------
+DEFAULT_POLICY_RULES = [
+  {'name': 'webserver-scale-out', 'metric': 'tps', 'scope': 'webserver',
+   'stat': 'mean', 'window': 60, 'above': 1000, 'clear': 800,
+   'action': 'scale_out'},
+  {'name': 'webserver-scale-in', 'metric': 'tps', 'scope': 'webserver',
+   'stat': 'mean', 'window': 60, 'below': 100, 'clear': 200,
+   'action': 'scale_in'},
+  {'name': 'webserver-surge', 'metric': 'tps', 'scope': 'webserver',
+   'stat': 'rate', 'window': 60, 'above': 20, 'clear': 5,
+   'action': 'scale_out'},
+  {'name': 'vdu-heal', 'metric': 'faults',
+   'scope': ['vdu1', 'vdu2', 'vdu3', 'vdu4'],
+   'stat': 'sum', 'window': 300, 'above': 2, 'clear': 1,
+   'action': 'heal'}
+]
+
+VDU_GROUPS = {1: 'webserver', 2: 'webserver', 3: 'loadbalancer',
+              4: 'firewall'}
+
+#------------------------------------------------------------------------------
+# Agent names for each VDU, and the name fragments sources are matched on
+# when their sourceId isn't one of the configured VDU IDs.
+#------------------------------------------------------------------------------
+VDU_AGENTS = {1: 'webserver_1', 2: 'webserver_2', 3: 'loadbalancer',
+              4: 'firewall'}
+SOURCE_NAME_RULES = [('VDU1', 'webserver_1', 1), ('VDU2', 'webserver_2', 2),
+                     ('VDU3', 'loadbalancer', 3), ('VDU4', 'firewall', 4),
+                     ('VIRT', 'computehost', 0)]
+
+#------------------------------------------------------------------------------
+# Schema validation, compiled once.
+#------------------------------------------------------------------------------
+class EventValidator:
+    '''
+    Validator for one schema, built once at start-up rather than for every
+    event.
+
+    Where the schema defines a commonEventHeader and <domain>Fields blocks,
+    an event is checked against its header and its own domain's fields only,
+    chosen by commonEventHeader.domain, rather than against every domain in
+    the schema.  Anything else is checked against the whole schema.
+    '''
+
+    def __init__(self, schema):
+        jsonschema.Draft4Validator.check_schema(schema)
+        self.validator = jsonschema.Draft4Validator(schema)
+
+        resolver = jsonschema.RefResolver.from_schema(schema)
+        definitions = schema.get('definitions', {})
+        self.header = None
+        self.domains = {}
+        if 'commonEventHeader' in definitions:
+            self.header = jsonschema.Draft4Validator(
+                                            definitions['commonEventHeader'],
+                                            resolver=resolver)
+            for name, definition in definitions.items():
+                if name.endswith('Fields') and len(name) > len('Fields'):
+                    self.domains[name[:-len('Fields')]] = (
+                        name,
+                        jsonschema.Draft4Validator(definition,
+                                                   resolver=resolver))
+
+    def validate(self, decoded_body):
+        '''
+        Raise jsonschema.ValidationError if the body is invalid.
+        '''
+        event = None
+        header = None
+        if isinstance(decoded_body, dict):
+            event = decoded_body.get('event')
+        if isinstance(event, dict):
+            header = event.get('commonEventHeader')
+        if not isinstance(header, dict):
+            self.validator.validate(decoded_body)
+            return
+
+        domain = header.get('domain')
+        if self.header is None or domain not in self.domains:
+            self.validator.validate(decoded_body)
+            return
+
+        self.header.validate(header)
+        name, validator = self.domains[domain]
+        if name in event:
+            validator.validate(event[name])
+
+def compile_validator(name, schema):
+    '''
+    Build an EventValidator, or return None (no validation) if there is no
+    schema or the schema itself is invalid.
+    '''
+    if schema is None:
+        return None
+    try:
+        return EventValidator(schema)
+    except jsonschema.SchemaError as e:
+        logger.error('{0} schema is not valid! {1}'.format(name, e))
+        print('{0} schema is not valid! {1}'.format(name, e))
+        return None
+
+def listener(environ, start_response, validator):
     '''
     Handler for the Vendor Event Listener REST API.
 
     Extract headers and the body and check that:
 
       1)  The client authenticated themselves correctly.
-      2)  The body validates against the provided schema for the API.
+      2)  The body validates against the compiled schema for the API.
 
     '''
     logger.info('Got a Vendor Event request')
@@ -125,15 +274,20 @@ def listener(environ, start_response, schema):
     # logger.debug('Credentials: {0}'.format(credentials))
     logger.debug('Credentials: ****')
 
+    #--------------------------------------------------------------------------
+    # The body is decoded once here; the same object is then validated, saved
+    # and processed.
+    #--------------------------------------------------------------------------
+    decoded_body = None
+
     #--------------------------------------------------------------------------
     # If we have a schema file then check that the event matches that expected.
     #--------------------------------------------------------------------------
-    if (schema is not None):
-        logger.debug('Attempting to validate data: {0}\n'
-                     'Against schema: {1}'.format(body, schema))
+    if (validator is not None):
+        logger.debug('Attempting to validate data: {0}'.format(body))
         try:
             decoded_body = json.loads(body)
-            jsonschema.validate(decoded_body, schema)
+            validator.validate(decoded_body)
             logger.info('Event is valid!')
             print('Valid body decoded & checked against schema OK:\n'
                   '{0}'.format(json.dumps(decoded_body,
@@ -141,10 +295,6 @@ def listener(environ, start_response, schema):
                                           indent=4,
                                           separators=(',', ': '))))
 
-        except jsonschema.SchemaError as e:
-            logger.error('Schema is not valid! {0}'.format(e))
-            print('Schema is not valid! {0}'.format(e))
-
         except jsonschema.ValidationError as e:
             logger.warn('Event is not valid against schema! {0}'.format(e))
             print('Event is not valid against schema! {0}'.format(e))
@@ -220,29 +370,124 @@ def listener(environ, start_response, schema):
                     }
         yield json.dumps(req_error)
 
-    save_event(body)
-    process_event(body)
+    if decoded_body is not None:
+        save_event(decoded_body)
+        process_event(decoded_body)
+
+#--------------------------------------------------------------------------
+# Source resolution
+#--------------------------------------------------------------------------
+class SourceResolver:
+  '''
+  Maps an event's source to the agent name it is saved under and the VDU
+  it belongs to (0 if none), cached by sourceId.
+
+  A sourceId equal to one of the vduN_id values the blueprint writes to the
+  config is that VDU.  Otherwise the source name is matched against
+  SOURCE_NAME_RULES, and failing that the source is unknown and saved
+  under its own name, upper-cased as before, until max_unknown distinct
+  unknown names have been seen; later ones are all saved as "other", so a
+  stream of new sources can't create unbounded series in InfluxDB.
+
+  The config file is checked for changes at most every check_interval
+  seconds, and the VDU IDs reloaded and the cache cleared if it has
+  changed.  A cached sourceId seen with a different name is resolved again.
+  '''
+
+  def __init__(self, config_file, config_section, max_unknown=20,
+               max_cached=10000, check_interval=10):
+    self.config_file = config_file
+    self.config_section = config_section
+    self.max_unknown = max_unknown
+    self.max_cached = max_cached
+    self.check_interval = check_interval
+    self.cache = {}
+    self.unknown = set()
+    self.vdu_ids = {}
+    self.mtime = None
+    self.checked = 0
+    self.load()
+
+  def load(self):
+    global vdu_id
+    try:
+      self.mtime = os.path.getmtime(self.config_file)
+    except OSError:
+      self.mtime = None
+    config = ConfigParser.SafeConfigParser()
+    config.read(self.config_file)
+    self.vdu_ids = {}
+    for vdu in VDU_AGENTS:
+      option = 'vdu{0}_id'.format(vdu)
+      if config.has_option(self.config_section, option):
+        vdu_id[vdu] = config.get(self.config_section, option).strip()
+        if vdu_id[vdu]:
+          self.vdu_ids[vdu_id[vdu]] = vdu
+    self.cache = {}
+    self.unknown = set()
+    logger.info('Source resolver: {0} VDU IDs'.format(len(self.vdu_ids)))
+
+  def check(self, now):
+    self.checked = now
+    try:
+      mtime = os.path.getmtime(self.config_file)
+    except OSError:
+      mtime = None
+    if mtime != self.mtime:
+      logger.info('Topology changed in {0}'.format(self.config_file))
+      self.load()
+
+  def resolve(self, header):
+    '''
+    (agent, vdu) for a commonEventHeader.
+    '''
+    now = time.time()
+    if now - self.checked >= self.check_interval:
+      self.check(now)
+    name = header.get('sourceName') or header.get('reportingEntityName', '')
+    key = header.get('sourceId') or name
+    cached = self.cache.get(key)
+    if cached is not None and cached[0] == name:
+      return cached[1]
+
+    if key in self.vdu_ids:
+      vdu = self.vdu_ids[key]
+      identity = (VDU_AGENTS[vdu], vdu)
+    else:
+      upper = name.upper()
+      for fragment, agent, vdu in SOURCE_NAME_RULES:
+        if fragment in upper:
+          identity = (agent, vdu)
+          break
+      else:
+        if upper not in self.unknown and \
+           len(self.unknown) >= self.max_unknown:
+          identity = ('other', 0)
+        else:
+          self.unknown.add(upper)
+          identity = (upper, 0)
+
+    if len(self.cache) >= self.max_cached:
+      self.cache = {}
+    self.cache[key] = (name, identity)
+    return identity
+
+def influx_tag(value):
+  '''
+  value escaped for use as an InfluxDB tag value.
+  '''
+  return value.replace(' ', '\\ ').replace(',', '\\,').replace('=', '\\=')
 
 #--------------------------------------------------------------------------
 # Send event to influxdb
 #--------------------------------------------------------------------------
-def save_event(body):
-  jobj = json.loads(body)
-  e = json.loads(body, object_hook=JSONObject)
+def save_event(jobj):
+  e = JSONView(jobj)
 
   domain = jobj['event']['commonEventHeader']['domain']
   timestamp = jobj['event']['commonEventHeader']['lastEpochMicrosec']
-  agent = jobj['event']['commonEventHeader']['reportingEntityName'].upper(	)
-  if "VIRT" in agent: 
-    agent = "computehost"
-  if "VDU1" in agent: 
-    agent = "webserver_1"
-  if "VDU2" in agent: 
-    agent = "webserver_2"
-  if "VDU3" in agent: 
-    agent = "loadbalancer"
-  if "VDU4" in agent: 
-    agent = "firewall"
+  agent, vdu = resolver.resolve(jobj['event']['commonEventHeader'])
+  agent = influx_tag(agent)
 
   url = 'http://{}:8086/write?db=veseventsdb'.format(influxdb)
   if e.event.commonEventHeader.domain == "heartbeat":
@@ -304,17 +549,261 @@ def save_event(body):
       if r.status_code != 204:
         print('*** Failed to add http event to influxdb ***')
 
+#--------------------------------------------------------------------------
+# Policy engine
+#--------------------------------------------------------------------------
+class SlidingWindow:
+  '''
+  Samples of one metric over the last window seconds, in a ring of slots
+  each window/slots seconds wide, with the sum and count of the live slots
+  kept as samples come in and slots expire.  Adding a sample and reading
+  the mean, sum, count or rate are O(1), however long the window; moving
+  on to a new slot clears the slots skipped since the last sample, at most
+  once per slot.
+  '''
+
+  def __init__(self, window, slots=60):
+    self.window = float(window)
+    self.width = self.window / slots
+    self.slots = slots
+    self.sums = [0.0] * slots
+    self.counts = [0] * slots
+    self.firsts = [None] * slots
+    self.head = None
+    self.oldest = None
+    self.sum = 0.0
+    self.count = 0
+    self.last = None
+
+  def advance(self, now):
+    slot = int(now // self.width)
+    if self.head is None:
+      self.head = self.oldest = slot
+      return
+    if slot <= self.head:
+      return
+    for expired in xrange(max(self.head + 1, slot - self.slots + 1),
+                          slot + 1):
+      i = expired % self.slots
+      self.sum -= self.sums[i]
+      self.count -= self.counts[i]
+      self.sums[i] = 0.0
+      self.counts[i] = 0
+      self.firsts[i] = None
+    self.head = slot
+    self.oldest = max(self.oldest, slot - self.slots + 1)
+
+  def add(self, now, value):
+    self.advance(now)
+    i = self.head % self.slots
+    self.sums[i] += value
+    self.counts[i] += 1
+    if self.firsts[i] is None:
+      self.firsts[i] = (now, value)
+    self.sum += value
+    self.count += 1
+    self.last = (now, value)
+
+  def stat(self, name, now):
+    self.advance(now)
+    if self.count == 0:
+      return 0.0 if name in ('sum', 'count') else None
+    if name == 'mean':
+      return self.sum / self.count
+    if name == 'sum':
+      return self.sum
+    if name == 'count':
+      return self.count
+    while self.counts[self.oldest % self.slots] == 0:
+      self.oldest += 1
+    first = self.firsts[self.oldest % self.slots]
+    if self.last[0] <= first[0]:
+      return None
+    return (self.last[1] - first[1]) / (self.last[0] - first[0])
+
+class GroupWindow:
+  '''
+  A SlidingWindow over the samples of every VDU in a group, and one per VDU
+  for the rate: the change between samples from two different VDUs is the
+  difference between the hosts, not a change over time, so the group's
+  rate is the sum of its VDUs' rates.
+  '''
+
+  def __init__(self, window, slots=60):
+    self.window = window
+    self.slots = slots
+    self.combined = SlidingWindow(window, slots)
+    self.members = {}
+
+  def add(self, now, value, member):
+    self.combined.add(now, value)
+    if member not in self.members:
+      self.members[member] = SlidingWindow(self.window, self.slots)
+    self.members[member].add(now, value)
+
+  def stat(self, name, now):
+    if name != 'rate':
+      return self.combined.stat(name, now)
+    rates = [rate for rate in (window.stat('rate', now)
+                               for window in self.members.values())
+             if rate is not None]
+    if not rates:
+      return None
+    return sum(rates)
+
+class PolicyEngine:
+  '''
+  Threshold and rate-of-change rules over sliding windows of the metrics
+  seen per VDU and per VDU group, with hysteresis.  Each sample updates
+  one window per rule window length, and only the rules on that metric and
+  scope are evaluated, so an event costs the same whatever the windows.
+  '''
+
+  def __init__(self, rules, action_url=''):
+    self.action_url = action_url
+    self.rules = {}
+    self.windows = {}
+    for rule in rules:
+      scopes = rule['scope']
+      if not isinstance(scopes, list):
+        scopes = [scopes]
+      for scope in scopes:
+        key = (rule['metric'], scope)
+        self.rules.setdefault(key, []).append(
+          {'rule': rule, 'scope': scope, 'armed': True, 'fired': 0})
+        if scope.startswith('vdu'):
+          window = SlidingWindow(rule['window'])
+        else:
+          window = GroupWindow(rule['window'])
+        self.windows.setdefault(key, {}).setdefault(rule['window'], window)
+
+  def observe(self, metric, vdu, value, now=None):
+    if now is None:
+      now = time.time()
+    scopes = ['vdu{0}'.format(vdu)]
+    if vdu in VDU_GROUPS:
+      scopes.append(VDU_GROUPS[vdu])
+    for scope in scopes:
+      key = (metric, scope)
+      if key not in self.rules:
+        continue
+      for window in self.windows[key].values():
+        if scope == scopes[0]:
+          window.add(now, value)
+        else:
+          window.add(now, value, vdu)
+      for state in self.rules[key]:
+        self.evaluate(state, self.windows[key][state['rule']['window']], now)
+
+  def refresh(self, vdu, now=None):
+    '''
+    Evaluate the rules on the VDU and its group without a new sample, so
+    that a sum or count that has fired is cleared as its window empties
+    even if no more samples of that metric come.
+    '''
+    if now is None:
+      now = time.time()
+    scopes = ['vdu{0}'.format(vdu), VDU_GROUPS.get(vdu)]
+    for (metric, scope), states in self.rules.items():
+      if scope not in scopes:
+        continue
+      for state in states:
+        self.evaluate(state,
+                      self.windows[(metric, scope)][state['rule']['window']],
+                      now)
+
+  def evaluate(self, state, window, now):
+    rule = state['rule']
+    value = window.stat(rule.get('stat', 'mean'), now)
+    if value is None:
+      return
+    if 'above' in rule:
+      breached = value > rule['above']
+      cleared = value <= rule.get('clear', rule['above'])
+    else:
+      breached = value < rule['below']
+      cleared = value >= rule.get('clear', rule['below'])
+    if not state['armed']:
+      if cleared:
+        state['armed'] = True
+        logger.info('Policy {0} on {1} cleared at {2:.2f}'.format(
+                                          rule['name'], state['scope'], value))
+        self.recover(rule, state['scope'])
+      return
+    if breached and now - state['fired'] >= rule.get('cooldown', 120):
+      state['armed'] = False
+      state['fired'] = now
+      self.act(rule, state['scope'], value)
+
+  def act(self, rule, scope, value):
+    global status
+    action = rule['action']
+    message = 'Policy {0}: {1} {2} ({3} {4} {5:.2f})'.format(
+                rule['name'], action, scope, rule['metric'],
+                rule.get('stat', 'mean'), value)
+    logger.warn(message)
+    print(message)
+    vdu = int(scope[3:]) if scope.startswith('vdu') else 0
+    if action == 'heal' and 0 < vdu < len(status):
+      status[vdu] = 'Healing'
+    if self.action_url:
+      try:
+        r = requests.post(self.action_url,
+                          data=json.dumps({'policy': rule['name'],
+                                           'action': action,
+                                           'target': scope,
+                                           'metric': rule['metric'],
+                                           'value': value}),
+                          headers={'Content-Type': 'application/json'},
+                          timeout=10)
+        if r.status_code >= 300:
+          logger.error('Policy action {0} failed, return code {1}'.format(
+                                                        action, r.status_code))
+      except requests.exceptions.RequestException as e:
+        logger.error('Policy action {0} failed: {1}'.format(action, e))
+
+  def recover(self, rule, scope):
+    global status
+    vdu = int(scope[3:]) if scope.startswith('vdu') else 0
+    if rule['action'] == 'heal' and 0 < vdu < len(status) and \
+       status[vdu] == 'Healing':
+      status[vdu] = 'Started'
+
+def policy_metrics(e, domain):
+  '''
+  The (metric, value) samples the policy engine is fed from an event.
+  '''
+  samples = []
+  if domain == 'measurementsForVfScaling':
+    fields = e.event.measurementsForVfScalingFields
+    try:
+      samples.append(('tps', float(fields.requestRate)))
+    except (AttributeError, TypeError, ValueError):
+      pass
+    try:
+      for f in fields.additionalFields:
+        if f.name == "cpu-aggregation-cpu-average-idle-percent-value":
+          samples.append(('cpu', 100 - float(f.value)))
+          break
+      else:
+        samples.append(('cpu', 100 - float(fields.cpuUsageArray[0].cpuIdle)))
+    except (AttributeError, IndexError, TypeError, ValueError):
+      pass
+  if domain == 'fault':
+    samples.append(('faults', 1.0))
+  return samples
+
 #--------------------------------------------------------------------------
 # Event processing
 #--------------------------------------------------------------------------
-def process_event(body):
+def process_event(jobj):
   global status
   global summary_e
   global summary_c
   global vdu_id
   vdu = 0
 
-  e = json.loads(body, object_hook=JSONObject)
+  e = JSONView(jobj)
 
   epoch = e.event.commonEventHeader.lastEpochMicrosec
   sourceId = e.event.commonEventHeader.sourceId
@@ -323,13 +812,15 @@ def process_event(body):
                   time.localtime(int(epoch)/1000000))
 
   host = e.event.commonEventHeader.sourceName
-  if 'VDU1' in host or 'vdu1' in host: vdu = 1
-  if 'VDU2' in host or 'vdu2' in host: vdu = 2
-  if 'VDU3' in host or 'vdu3' in host: vdu = 3
-  if 'VDU4' in host or 'vdu4' in host: vdu = 4
+  agent, vdu = resolver.resolve(jobj['event']['commonEventHeader'])
 
   domain = e.event.commonEventHeader.domain
 
+  if policy is not None and vdu >= 1:
+    policy.refresh(vdu)
+    for metric, value in policy_metrics(e, domain):
+      policy.observe(metric, vdu, value)
+
   if domain == 'measurementsForVfScaling':
     if vdu <= 2:
       requestRate = e.event.measurementsForVfScalingFields.requestRate
@@ -546,7 +1037,10 @@ USAGE
         defaults = {'log_file': 'collector.log',
                     'vel_port': '12233',
                     'vel_path': '',
-                    'vel_topic_name': ''
+                    'vel_topic_name': '',
+                    'policy_file': '',
+                    'policy_action_url': '',
+                    'max_unknown_sources': '20'
                    }
         overrides = {}
         config = ConfigParser.SafeConfigParser(defaults)
@@ -581,6 +1075,10 @@ USAGE
         test_control_schema_file = config.get(config_section,
                                            'test_control_schema_file',
                                            vars=overrides)
+        policy_file = config.get(config_section, 'policy_file')
+        policy_action_url = config.get(config_section, 'policy_action_url')
+        max_unknown_sources = config.getint(config_section,
+                                            'max_unknown_sources')
 
         #----------------------------------------------------------------------
         # Finally we have enough info to start a proper flow trace.
@@ -623,6 +1121,8 @@ USAGE
                                                          throttle_schema_file))
         logger.debug('Test Control JSON Schema File = {0}'.format(
                                                      test_control_schema_file))
+        logger.debug('Policy File = {0}'.format(policy_file or 'default'))
+        logger.debug('Policy Action URL = {0}'.format(policy_action_url))
 
         #----------------------------------------------------------------------
         # Perform some basic error checking on the config.
@@ -685,6 +1185,23 @@ USAGE
                 vel_schema.update(base_schema)
                 logger.debug('Updated the JSON schema file')
 
+        #----------------------------------------------------------------------
+        # Load the policy rules.
+        #----------------------------------------------------------------------
+        global policy
+        if policy_file:
+            policy_rules = json.load(open(policy_file, 'r'))
+        else:
+            policy_rules = DEFAULT_POLICY_RULES
+        policy = PolicyEngine(policy_rules, policy_action_url)
+
+        #----------------------------------------------------------------------
+        # Resolve sources to VDUs from the IDs the blueprint configured.
+        #----------------------------------------------------------------------
+        global resolver
+        resolver = SourceResolver(config_file, config_section,
+                                  max_unknown_sources)
+
         #----------------------------------------------------------------------
         # We are now ready to get started with processing. Start-up the various
         # components of the system in order:
@@ -703,10 +1220,13 @@ USAGE
                        format(vel_path, api_version)
         set_404_content(root_url)
         dispatcher = PathDispatcher()
-        vendor_event_listener = partial(listener, schema = vel_schema)
+        vel_validator = compile_validator('Event Listener', vel_schema)
+        throttle_validator = compile_validator('Throttle', throttle_schema)
+        vendor_event_listener = partial(listener, validator = vel_validator)
         dispatcher.register('GET', root_url, vendor_event_listener)
         dispatcher.register('POST', root_url, vendor_event_listener)
-        vendor_throttle_listener = partial(listener, schema = throttle_schema)
+        vendor_throttle_listener = partial(listener,
+                                           validator = throttle_validator)
         dispatcher.register('GET', throttle_url, vendor_throttle_listener)
         dispatcher.register('POST', throttle_url, vendor_throttle_listener)
 